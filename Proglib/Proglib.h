@@ -18,3 +18,9 @@ void  print_version_info( char *version_string);
  *    */
 char* history_string( int ac, char* av[] );
 
+/*
+ *  In-place complex FFT of numpoints (a power of two) values stored as
+ *  signal[1..2*numpoints] = re,im,re,im...; direction is 1 (forward)
+ *  or -1 (inverse, unnormalized).
+ */
+void  fft1(float *signal, int numpoints, int direction);
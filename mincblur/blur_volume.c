@@ -98,8 +98,6 @@ extern int debug;
 
 int ms_volume_reals_flag;
 
-void fft1(float *signal, int numpoints, int direction);
-
 VIO_Status blur3D_volume(VIO_Volume data, int xyzv[VIO_MAX_DIMENSIONS],
                             double fwhmx, double fwhmy, double fwhmz, 
                             char *infile,
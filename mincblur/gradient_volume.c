@@ -77,8 +77,6 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/mincblur
 extern int debug;
 
 
-void fft1(float *signal, int numpoints, int direction);
-
 VIO_Status gradient3D_volume(FILE *ifd, 
                                 VIO_Volume data, 
                                 int xyzv[VIO_MAX_DIMENSIONS],
@@ -30,6 +30,7 @@ typedef struct {
    int estimate_trans;
    int estimate_rots;
    int estimate_quats;
+   int init_xcorr_fft;
 } Transform_Flags;
 
 typedef struct {
@@ -107,5 +108,11 @@ struct Arg_Data_struct {
   double                 speckle;      /* percent noise speckle                      */
   int                    groups;       /* number of groups to use for ratio of variance */
   int                    blur_pdf;     /* number of voxels for blurring in -mi pdfs */
+  double                 sample_fraction; /* fraction of lattice for coarse simplex */
+  int                    sample_count; /* number of lattice nodes for coarse simplex */
+  int                    multi_start;  /* number of starting points refined        */
+  double                 start_rotations[2]; /* step and extent (deg) of start grid */
+  double                 start_jitter; /* translation offset (mm) of start points   */
+  int                    start_flips;  /* add quarter turns to the start points      */
 };
 
@@ -0,0 +1,70 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : deform_grid.h
+@DESCRIPTION: structure-of-arrays storage of a deformation field, used
+              to hold the warps while they are being optimized, and
+              prototypes for Optimize/deform_grid.c
+@MODIFIED   : not yet!
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_DEFORM_GRID_H
+#define MINCTRACC_DEFORM_GRID_H
+
+/*
+   The three components of the deformation vectors are stored in three
+   separate contiguous arrays (d[VIO_X], d[VIO_Y], d[VIO_Z]), instead of
+   being interleaved along the vector dimension of a GRID_TRANSFORM's
+   displacement volume.
+
+   Nodes are stored in X, Y, Z order with Z varying fastest (the order
+   of the nested loops in do_non_linear_optimization()); each Z row is
+   padded to a multiple of DEFORM_GRID_PAD doubles and each array
+   starts on a DEFORM_GRID_ALIGN byte boundary.
+*/
+
+#define DEFORM_GRID_ALIGN  32
+#define DEFORM_GRID_PAD    (DEFORM_GRID_ALIGN/sizeof(double))
+
+typedef struct {
+  int       count[VIO_N_DIMENSIONS];  /* number of nodes in XYZ order      */
+  int       stride;                   /* padded length of a Z row          */
+  long      n_nodes;                  /* count[X]*count[Y]*stride          */
+  int       xyzv[VIO_MAX_DIMENSIONS]; /* of the displacement volume        */
+  double    *d[VIO_N_DIMENSIONS];     /* aligned component arrays          */
+  double    *base[VIO_N_DIMENSIONS];  /* as allocated                      */
+} Deform_grid;
+
+#define DEFORM_GRID_OFFSET(grid, x, y, z) \
+   ( ((long)(x)*(grid)->count[VIO_Y] + (y))*(grid)->stride + (z) )
+
+Deform_grid *new_deform_grid(VIO_General_transform *warp);
+
+void delete_deform_grid(Deform_grid *grid);
+
+void zero_deform_grid(Deform_grid *grid);
+
+void copy_transform_to_deform_grid(VIO_General_transform *warp,
+                                   Deform_grid *grid);
+
+void copy_deform_grid_to_transform(Deform_grid *grid,
+                                   VIO_General_transform *warp);
+
+VIO_BOOL get_deform_grid_average_of_neighbours(Deform_grid *grid,
+                                               int x, int y, int z,
+                                               int avg_type,
+                                               VIO_Real mean[]);
+
+void add_additional_deform_grid_to_current(Deform_grid *additional,
+                                           Deform_grid *current,
+                                           VIO_Real weight);
+
+void smooth_the_deform_grid(Deform_grid *smoothed,
+                            Deform_grid *current,
+                            int start[], int end[],
+                            VIO_Real weight);
+
+void extrapolate_deform_grid_to_unestimated_nodes(Deform_grid *current,
+                                                  Deform_grid *additional,
+                                                  unsigned char *estimated,
+                                                  int start[], int end[]);
+
+#endif
@@ -0,0 +1,91 @@
+/*------------------------------ MNI Header ----------------------------------
+@NAME       : dense_update.h
+@DESCRIPTION: whole-grid estimation of the additional deformation for
+              feature sets that need no sub-lattice (optical flow and
+              chamfer features), and prototypes for
+              Optimize/dense_update.c
+@MODIFIED   : not yet!
+-----------------------------------------------------------------------------*/
+
+#ifndef MINCTRACC_DENSE_UPDATE_H
+#define MINCTRACC_DENSE_UPDATE_H
+
+#include "deform_grid.h"
+
+/*
+   A volume with its voxel array and world-to-voxel mapping cached, so
+   that it can be sampled (tri-linearly, with derivatives) from several
+   threads at once, without going through the volume_io interpolation
+   routines.  The volume must hold doubles.
+*/
+
+typedef struct {
+  VIO_Volume  volume;
+  double      ***data;
+  int         sizes[VIO_N_DIMENSIONS];
+  VIO_Real    world_to_voxel[VIO_N_DIMENSIONS][4];
+} Dense_sampler;
+
+/*
+   The source side of a NONLIN_CHAMFER feature does not change during
+   the run: for each node, the distance to the nearest surface in the
+   source (data) chamfer volume decides whether the node is captured
+   (state), how much its estimate is weighted (weight), and the
+   surface point the estimate is computed from.  The surface point is
+   stored already mapped through the linear part of the transformation.
+*/
+
+#define DENSE_CHAMFER_FAR         0  /* too far from a surface          */
+#define DENSE_CHAMFER_AT_MEAN     1  /* use the neighbours' mean target */
+#define DENSE_CHAMFER_AT_SURFACE  2  /* use the nearest surface point   */
+
+typedef struct {
+  unsigned char  *state;
+  float          *weight;
+  Deform_grid    *surface;
+} Dense_chamfer;
+
+/*
+   Everything that does not change from one iteration to the next is
+   computed once: the world coordinate of each node (target), its
+   homolog through the linear part of the transformation (source), and
+   the chamfer information above.  The per-node magnitude and function
+   count of the last estimate are left in magnitude[] and n_funks[] for
+   the caller's statistics.
+*/
+
+typedef struct {
+  int            number_of_features;
+  int            start[VIO_N_DIMENSIONS];
+  int            end[VIO_N_DIMENSIONS];
+  int            ndim;
+  char           *obj_func;
+  Deform_grid    *target;
+  Deform_grid    *source;
+  Dense_sampler  *data;
+  Dense_sampler  *model;
+  Dense_sampler  threshold_model;
+  Dense_chamfer  *chamfer;
+  VIO_Real       grid_world_to_voxel[VIO_N_DIMENSIONS][4];
+  VIO_Volume     *model_mask;
+  VIO_Real       *weight;
+  float          *magnitude;
+  unsigned char  *n_funks;
+} Dense_update_struct;
+
+Dense_update_struct *new_dense_update(Arg_Data *globals,
+                                      VIO_General_transform *current_warp,
+                                      VIO_General_transform *linear,
+                                      Deform_grid *current,
+                                      int start[], int end[],
+                                      int ndim);
+
+void delete_dense_update(Dense_update_struct *dense);
+
+long estimate_dense_deformation(Dense_update_struct *dense,
+                                Deform_grid *current,
+                                Deform_grid *additional,
+                                unsigned char *estimated,
+                                VIO_Real threshold);
+
+#endif
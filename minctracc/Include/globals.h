@@ -24,6 +24,11 @@ double  smoothing_weight         = 0.5;
 double  similarity_cost_ratio    = 0.5;
 int     number_dimensions        = 3;
 int     Matlab_num_steps         = 15;
+char   *Sweep_params             = NULL;
+char   *Sweep_list               = NULL;
+int     Sweep_binary             = FALSE;
+char   *Measure_list             = NULL;
+int     Brick_volumes            = FALSE;
 int     Diameter_of_local_lattice= 5;
 
 int     invert_mapping_flag      = FALSE;
@@ -56,6 +61,8 @@ static ArgvInfo argTable[] = {
      "use rotations estimated from Principal axis trans."},*/
   {"-est_translations", ARGV_CONSTANT, (char *) TRUE, (char *) &main_args.trans_flags.estimate_trans,
      "use translations estimated from Principal axis trans."},
+  {"-init_xcorr_fft", ARGV_CONSTANT, (char *) TRUE, (char *) &main_args.trans_flags.init_xcorr_fft,
+     "refine the initial translation with an FFT cross-correlation search."},
   {"-center", ARGV_FLOAT, (char *) 3, 
      (char *) main_args.trans_info.center,
      "Force center of rotation and scale."},
@@ -117,6 +124,9 @@ static ArgvInfo argTable[] = {
   {"-nearest_neighbour", ARGV_CONSTANT, (char *) N_NEIGHBOUR,
      (char *) &main_args.interpolant_type,
      "Do nearest neighbour interpolation"},
+  {"-bricked", ARGV_CONSTANT, (char *) TRUE,
+     (char *) &Brick_volumes,
+     "Copy the target volumes into 8x8x8 bricks for sampling."},
   
   {NULL, ARGV_HELP, NULL, NULL,
      "\nLinear optimization objective functions. (default = -xcorr)"},
@@ -159,6 +169,27 @@ static ArgvInfo argTable[] = {
   {"-simplex", ARGV_FLOAT, (char *) 0, 
      (char *) &simplex_size,
      "Radius of simplex volume."},
+  {"-lbfgs", ARGV_CONSTANT, (char *) OPT_LBFGS, 
+     (char *) &main_args.optimize_type,
+     "Use L-BFGS instead of the final simplex (-xcorr, -zscore)."},
+  {"-sample_fraction", ARGV_FLOAT, (char *) 0, 
+     (char *) &main_args.sample_fraction,
+     "Fraction of lattice nodes used before the final simplex (-xcorr, -zscore, -vr)."},
+  {"-sample_count", ARGV_INT, (char *) 0, 
+     (char *) &main_args.sample_count,
+     "Number of lattice nodes used before the final simplex (overrides -sample_fraction)."},
+  {"-multi_start", ARGV_INT, (char *) 0, 
+     (char *) &main_args.multi_start,
+     "Number of starting points refined before the final simplex (0 = off)."},
+  {"-start_rotations", ARGV_FLOAT, (char *) 2, 
+     (char *) &main_args.start_rotations[0],
+     "Step and extent (degrees) of the rotation grid for -multi_start."},
+  {"-start_translations", ARGV_FLOAT, (char *) 0, 
+     (char *) &main_args.start_jitter,
+     "Translation offset (mm) along each axis for -multi_start."},
+  {"-start_flips", ARGV_CONSTANT, (char *) TRUE, 
+     (char *) &main_args.start_flips,
+     "Add quarter turns about each axis to the -multi_start points."},
   {"-w_translations", ARGV_FLOAT, (char *) 3, 
      (char *) &main_args.trans_info.weights[0],
      "Optimization weight of translation in x, y, z."},
@@ -179,9 +210,17 @@ static ArgvInfo argTable[] = {
      "Output curves for selected objective function vs parameter."},
   {"-num_steps", ARGV_INT, (char *) 0, (char *) &Matlab_num_steps,
      "Number of steps at which to measure obj fn for matlab output."},
+  {"-sweep", ARGV_STRING, (char *) 0, (char *) &Sweep_params,
+     "Parameters (e.g. tx,ry) swept jointly on a grid, written as CSV to -matlab."},
+  {"-sweep_list", ARGV_STRING, (char *) 0, (char *) &Sweep_list,
+     "File of parameter vectors (one per line) evaluated into -matlab."},
+  {"-sweep_binary", ARGV_CONSTANT, (char *) TRUE, (char *) &Sweep_binary,
+     "Write -sweep results as doubles instead of CSV."},
   {"-measure", ARGV_STRING, (char *) 0, 
      (char *) &main_args.filenames.measure_file,
      "Output value of each obj. func. for given x-form."},
+  {"-measure_list", ARGV_STRING, (char *) 0, (char *) &Measure_list,
+     "File of x-forms (one per line) scored with the selected obj. func. into -measure."},
 
   {NULL, ARGV_HELP, NULL, NULL,
      "\nOptions for 3D lattice."},
@@ -235,7 +274,7 @@ static ArgvInfo argTable[] = {
   {"-use_nonisotropic", ARGV_CONSTANT, (char *) FALSE, (char *) &main_args.trans_info.use_local_isotropic,
      "Turn on directionally sensitive smoothing (def=isotropic smoothing)."},
   {"-super", ARGV_INT, (char *) 0, (char *) &main_args.trans_info.use_super,
-     "super sample deformation field during optimization (default)."},
+     "super sample deformation field by <n> during optimization (default = 2)."},
   {"-no_super", ARGV_CONSTANT, (char *) 0, (char *) &main_args.trans_info.use_super,
      "do not super sample deformation field during optimization."},
   {"-iterations", ARGV_INT, (char *) 0, 
@@ -3,10 +3,62 @@
 
 #include "point_vector.h"
 
+/* what the descriptor interpolants need of a volume, taken once by
+   init_volume_descriptor() */
+
+typedef struct {
+  VIO_Volume volume;
+  int        sizes[3];
+  long       strides[3];        /* in voxels, along each axis           */
+  double     *data;             /* first voxel, or NULL when the volume
+                                   is not a double volume in memory      */
+  VIO_Real   scale;             /* value = scale * voxel + translation  */
+  VIO_Real   translation;
+  VIO_Real   outside;           /* value returned outside of the volume */
+  double     *bricks;           /* bricked copy of data, or NULL        */
+  int        brick_count[3];    /* number of bricks along each axis     */
+} Volume_descriptor;
+
+/* voxel (i,j,k) of a volume stored in bricks of 8x8x8 voxels, count[]
+   being the number of bricks along each axis (see brick_volume()) */
+
+#define BRICK_SIDE 8
+
+#define BRICK_OFFSET(count, i, j, k) \
+   ( ( ( ((long)((i)>>3) * (count)[1] + ((j)>>3)) * (count)[2] + ((k)>>3) ) << 9 ) + \
+     (((i)&7)<<6) + (((j)&7)<<3) + ((k)&7) )
+
+VIO_BOOL brick_volume(VIO_Volume volume);
+
+double *get_volume_bricks(VIO_Volume volume, int count[]);
+
+void free_volume_bricks(void);
+
+void init_volume_descriptor(Volume_descriptor *desc, VIO_Volume volume);
+
+int descriptor_trilinear_interpolant(Volume_descriptor *desc, 
+                                     VIO_Real x, VIO_Real y, VIO_Real z,
+                                     double *result);
+
+int descriptor_nearest_neighbour_interpolant(Volume_descriptor *desc, 
+                                             VIO_Real x, VIO_Real y, VIO_Real z,
+                                             double *result);
+
+int interpolate_points(Volume_descriptor *desc, 
+                       int (*interpolant)(VIO_Volume, PointR *, double *),
+                       int n,
+                       VIO_Real x[], VIO_Real y[], VIO_Real z[],
+                       double value[],
+                       char inside[],
+                       double (*gradient)[3]);
 
 int trilinear_interpolant(VIO_Volume volume, 
                                  PointR *coord, double *result);
 
+int trilinear_gradient_interpolant(VIO_Volume volume, 
+                                   PointR *coord, double *result,
+                                   double gradient[]);
+
 int tricubic_interpolant(VIO_Volume volume, 
                                 PointR *coord, double *result);
 
@@ -0,0 +1,20 @@
+#ifndef  _DEF_LBFGS_H
+#define  _DEF_LBFGS_H
+
+#include  <volume_io.h>
+
+/* returns the function value at x[], and its gradient in gradient[] */
+
+typedef  VIO_Real    (*lbfgs_function) ( void *, VIO_Real [], VIO_Real [] );
+
+int  lbfgs_minimize(
+    int               n_parameters,
+    VIO_Real          parameters[],
+    VIO_Real          initial_step,
+    lbfgs_function    function,
+    void              *function_data,
+    VIO_Real          tolerance,
+    int               max_evaluations,
+    VIO_Real          *value );
+
+#endif
@@ -146,6 +146,12 @@ void rotation_to_homogeneous(int ndim, float **rotation,
 
 float fit_function(float *x);        /* apply cross correlation to the data sets    */
 
+Arg_Data *new_fit_args(void);        /* a copy of main_args for one thread          */
+
+void delete_fit_args(Arg_Data *args);
+
+float fit_function_args(Arg_Data *args, float *x, VIO_BOOL quater);
+
 float zscore_function(float *x);     /* calculate rms z-score difference.           */
 
 float check_function(float *x);      /* calculate the squared error between points2 */
@@ -193,6 +199,14 @@ float measure_fit(VIO_Volume d1,
                          VIO_Volume m2, 
                          Arg_Data *globals);
 
+VIO_Status measure_transform_list(VIO_Volume d1,
+                                  VIO_Volume d2,
+                                  VIO_Volume m1,
+                                  VIO_Volume m2,
+                                  char *list_file,
+                                  char *output_file,
+                                  Arg_Data *globals);
+
 void make_matlab_data_file(VIO_Volume d1,
                                   VIO_Volume d2,
                                   VIO_Volume m1,
@@ -286,7 +300,13 @@ Arg_Data main_args = {
   {0.0,0.0},                        /* lower limit of voxels considered                 */
   5.0,                                /* percent noise speckle                            */
   256,                                /* number of groups to use for ratio of variance    */
-  3                                /* pdf blurring size for -mi                        */
+  3,                                /* pdf blurring size for -mi                        */
+  1.0,                                /* use the whole lattice for the simplex...         */
+  0,                                /* ...unless a number of nodes is given             */
+  0,                                /* refine the initial transformation only...        */
+  {30.0, 30.0},                        /* ...or starts on a 30 degree rotation grid,       */
+  0.0,                                /* without translation offsets                      */
+  FALSE                                /* or quarter turns                                 */
 };
 
 
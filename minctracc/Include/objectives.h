@@ -35,3 +35,22 @@ float normalized_mutual_information_objective(VIO_Volume d1,
                            Arg_Data *globals);
 
 
+VIO_BOOL objective_has_gradient(Arg_Data *globals);
+
+VIO_BOOL objective_is_reentrant(Arg_Data *globals);
+
+float objective_gradient(VIO_Volume d1,
+                         VIO_Volume d2,
+                         VIO_Volume m1,
+                         VIO_Volume m2, 
+                         Arg_Data *globals,
+                         VIO_Real dfdm[3][4]);
+
+void begin_source_lattice_cache(void);
+
+void end_source_lattice_cache(void);
+
+void set_source_lattice_sampling(VIO_BOOL on);
+
+void free_mutual_information_bins(void);
+
@@ -18,14 +18,17 @@
 
 typedef struct Segment_Table_Struct Segment_Table;
 
-                                /* this function will return the group value */
-typedef int (*Segment_Function)(int value, Segment_Table *table);
+                                /* this function will return the group value
+                                   of a voxel value */
+typedef int (*Segment_Function)(VIO_Real value, Segment_Table *table);
 
 
 struct Segment_Table_Struct
 {
   int min;                        /* minimum voxel value */
   int max;                        /* maximum voxel value */
+  VIO_Real range_min;           /* data range (as voxels) split into  */
+  VIO_Real range_max;           /* groups, for float and double vols  */
   int groups;                        /* number of groups in table */
   int *table;                        /* list of look up values for segmentation */
   Segment_Function segment;     /* name of the function used to apply the segmentation */
@@ -44,6 +47,8 @@ VIO_BOOL build_segment_table(Segment_Table **table, VIO_Volume d1, int groups);
 
 VIO_BOOL free_segment_table(Segment_Table *table);
 
-int     get_segment_LUT_value(int value, Segment_Table *table);
+int     get_segment_LUT_value(VIO_Real value, Segment_Table *table);
+
+int     get_segment_range_value(VIO_Real value, Segment_Table *table);
 
 
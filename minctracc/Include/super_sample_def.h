@@ -1,6 +1,8 @@
 #ifndef MINCTRACC_SUPER_SAMPLE_DEF_H
 #define MINCTRACC_SUPER_SAMPLE_DEF_H
 
+#include "deform_grid.h"
+
 /* build the volume structure and allocate the data space to store
    a super-sampled GRID_TRANSFORM.
 
@@ -94,4 +96,57 @@ void create_super_sampled_data_volumes_by2(VIO_General_transform *orig_deformati
 void interpolate_super_sampled_data_by2( VIO_General_transform *orig_deformation,
                                                 VIO_General_transform *super_sampled);
 
+
+/*
+   Lazily evaluated super-sampled deformation field.
+
+   The fine field has factor-1 extra samples between each pair of coarse
+   nodes, and is split into LAZY_TILE^3 tiles that are computed from the
+   coarse field (read from its Deform_grid copy) the first time a point
+   inside them is looked up.  At most
+   max_tiles tiles are resident at any time.
+
+   The kernel is a separable Catmull-Rom cubic, falling back to linear
+   interpolation between the first and last pair of nodes along each
+   axis.  For factor == 2 it is the kernel used by
+   interpolate_super_sampled_data_by2().
+
+   flush_lazy_super_sampled_def() must be called whenever the coarse 
+   grid changes.
+*/
+
+#define LAZY_TILE  8               /* fine voxels along each tile edge     */
+#define LAZY_SPAN  (LAZY_TILE+4)   /* max coarse nodes feeding a tile edge */
+#define LAZY_SUPER_MAX_TILES 4096  /* about 25Mb of resident tiles         */
+
+typedef struct {
+  VIO_Volume coarse_vol;        /* displacement volume of the coarse warp */
+  Deform_grid *coarse_grid;     /* and the grid holding its values        */
+  int        xyzv[VIO_MAX_DIMENSIONS];
+  int        factor;            /* super-sampling rate                    */
+  VIO_Real   *kernel;           /* 4 cubic weights for each fine offset   */
+  int        coarse_count[VIO_N_DIMENSIONS];     /* in XYZ order          */
+  int        fine_count[VIO_N_DIMENSIONS];
+  int        n_tiles[VIO_N_DIMENSIONS];
+  int        total_tiles;
+  int        max_tiles;
+  int        n_resident;
+  long       n_filled;          /* number of tiles computed so far        */
+  float      **tiles;           /* total_tiles entries, NULL if not built */
+  float      **pool;            /* max_tiles buffers, reused on flush     */
+} Lazy_super_sampled_def;
+
+Lazy_super_sampled_def *new_lazy_super_sampled_def(VIO_General_transform *orig_deformation,
+                                                   Deform_grid *coarse_grid,
+                                                   int factor,
+                                                   int max_tiles);
+
+void flush_lazy_super_sampled_def(Lazy_super_sampled_def *lazy);
+
+void delete_lazy_super_sampled_def(Lazy_super_sampled_def *lazy);
+
+VIO_BOOL get_lazy_super_sampled_def(Lazy_super_sampled_def *lazy,
+                                    VIO_Real wx, VIO_Real wy, VIO_Real wz,
+                                    VIO_Real def[]);
+
 #endif
@@ -0,0 +1,22 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : xcorr_fft.h
+@DESCRIPTION: prototypes for Numerical/xcorr_fft.c, the FFT based search
+              for the translation that best aligns two volumes.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#ifndef MINCTRACC_XCORR_FFT_H
+#define MINCTRACC_XCORR_FFT_H
+
+#define XCORR_FFT_MAX_SIZE  128   /* largest grid dimension (power of two) */
+
+VIO_BOOL xcorr_fft_translation(VIO_Volume d1,
+                               VIO_Volume d2,
+                               VIO_Volume m1,
+                               VIO_Volume m2,
+                               VIO_General_transform *transform,
+                               double *step,
+                               double shift[]);
+
+#endif
@@ -94,6 +94,7 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 
 
 #include <config.h>
+#include <string.h>
 #include <volume_io.h>
 
 #include "constants.h"
@@ -116,9 +117,18 @@ extern VIO_Real            *prob_fn1;
 extern VIO_Real            *prob_fn2;         
 
 extern int Matlab_num_steps;
+extern char *Sweep_params;
+extern char *Sweep_list;
+extern int Sweep_binary;
+
+static char *Sweep_names[12] = { "tx", "ty", "tz", "rx", "ry", "rz", 
+                                 "sx", "sy", "sz", "shx", "shy", "shz" };
 
 float fit_function(float *params);
 float fit_function_quater(float *params);
+Arg_Data *new_fit_args(void);
+void delete_fit_args(Arg_Data *args);
+float fit_function_args(Arg_Data *args, float *params, VIO_BOOL quater);
 
 void make_zscore_volume(VIO_Volume d1, VIO_Volume m1, 
                                VIO_Real *threshold); 
@@ -141,7 +151,364 @@ void parameters_to_vector_quater(double *trans,
                                         float  *op_vector,
                                         double *weights);
 
-VIO_BOOL replace_volume_data_with_ubyte(VIO_Volume data);
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : sweep_parameter
+@INPUT      : trans_info - transformation parameters
+              i - parameter index (0..11, in the order of the weights)
+              quater - TRUE if the rotations are quaternions
+@OUTPUT     : 
+@RETURNS    : pointer to parameter i in trans_info
+@DESCRIPTION: 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static double *sweep_parameter(Program_Transformation *trans_info, int i, VIO_BOOL quater)
+{
+  if (i < 3) 
+    return(&trans_info->translations[i]);
+  else if (i < 6) 
+    return(quater ? &trans_info->quaternions[i-3] 
+                  : &trans_info->rotations[i-3]);
+  else if (i < 9) 
+    return(&trans_info->scales[i-6]);
+  else
+    return(&trans_info->shears[i-9]);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : parse_sweep_names
+@INPUT      : names - comma separated parameter names (tx,ty,tz,rx,ry,rz,
+                 sx,sy,sz,shx,shy,shz), or NULL for all optimized parameters.
+                 Only optimized parameters can be named.
+              globals - command line info
+@OUTPUT     : index - index of each named parameter
+@RETURNS    : number of parameters
+@DESCRIPTION: 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static int parse_sweep_names(char *names, Arg_Data *globals, int index[])
+{
+  int  i, n, len;
+  char *name;
+
+  n = 0;
+
+  if (names == NULL) {
+    for(i=0; i<12; i++)
+      if (globals->trans_info.weights[i] != 0.0) 
+        index[n++] = i;
+    return(n);
+  }
+
+  name = names;
+  while (*name != '\0') {
+
+    len = (int)strcspn(name, ",");
+
+    for(i=0; i<12; i++)
+      if (strlen(Sweep_names[i]) == len && strncmp(name, Sweep_names[i], len) == 0)
+        break;
+
+    if (i == 12 || n == 12) 
+      print_error_and_line_num ("Cannot sweep parameter `%.*s' (in `%s').\n", 
+                                __FILE__, __LINE__, len, name, names);
+    if (globals->trans_info.weights[i] == 0.0) 
+      print_error_and_line_num ("Parameter `%s' is not optimized for this transformation type.\n", 
+                                __FILE__, __LINE__, Sweep_names[i]);
+    index[n++] = i;
+
+    name += len;
+    if (*name == ',') name++;
+  }
+
+  return(n);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : sweep_point_value
+@INPUT      : args - a copy of main_args from new_fit_args(), or NULL to
+                 evaluate with main_args (through the fit cache)
+              point - the 12 transformation parameters of the point
+              quater - TRUE if the rotations are quaternions
+@OUTPUT     : 
+@RETURNS    : the value of the objective function at point
+@DESCRIPTION: 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static float sweep_point_value(Arg_Data *args, double point[], VIO_BOOL quater)
+{
+  Program_Transformation trans_info;
+  float  p[13];
+  int    i;
+
+  trans_info = main_args.trans_info;
+  for(i=0; i<12; i++)
+    *sweep_parameter(&trans_info, i, quater) = point[i];
+
+  if (quater) 
+    parameters_to_vector_quater(trans_info.translations,
+                                trans_info.quaternions,
+                                trans_info.scales,
+                                trans_info.shears,
+                                p,
+                                trans_info.weights);
+  else 
+    parameters_to_vector(trans_info.translations,
+                         trans_info.rotations,
+                         trans_info.scales,
+                         trans_info.shears,
+                         p,
+                         trans_info.weights);
+
+  if (args != NULL)
+    return(fit_function_args(args, p, quater));
+
+  return(quater ? fit_function_quater(p) : fit_function(p));
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : evaluate_sweep_points
+@INPUT      : m - number of points
+              points - the 12 transformation parameters of each point
+              quater - TRUE if the rotations are quaternions
+              reentrant - TRUE to evaluate the points concurrently
+@OUTPUT     : values - the value of the objective function at each point
+@RETURNS    : nothing
+@DESCRIPTION: with objective_is_reentrant(), each thread evaluates its
+              points with its own copy of main_args, one point at a
+              time; otherwise, the points are evaluated in turn, each
+              over all the threads.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void evaluate_sweep_points(int m, double **points, double values[],
+                                  VIO_BOOL quater, VIO_BOOL reentrant)
+{
+  Arg_Data *args;
+  int      j;
+
+#ifdef _OPENMP
+#pragma omp parallel if (reentrant && m > 1) private(args)
+#endif
+  {
+    args = reentrant ? new_fit_args() : NULL;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for(j=0; j<m; j++)
+      values[j] = sweep_point_value(args, points[j], quater);
+
+    if (args != NULL)
+      delete_fit_args(args);
+  }
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : write_sweep_point
+@INPUT      : ofd - output file
+              n, index - the swept parameters
+              point - the 12 transformation parameters of the point
+              value - the objective function at point
+@OUTPUT     : 
+@RETURNS    : nothing
+@DESCRIPTION: write the swept parameters and the value as one line of
+              CSV, or as n+1 doubles with -sweep_binary.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void write_sweep_point(FILE *ofd, 
+                              int n, int index[], 
+                              double point[],
+                              double value)
+{
+  double row[13];
+  int    i;
+
+  for(i=0; i<n; i++)
+    row[i] = point[index[i]];
+  row[n] = value;
+
+  if (Sweep_binary) 
+    (void)fwrite(row, sizeof(double), n+1, ofd);
+  else {
+    for(i=0; i<n; i++)
+      (void)fprintf (ofd, "%.8g,", row[i]);
+    (void)fprintf (ofd, "%.8g\n", row[n]);
+  }
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : batch_sweep
+@INPUT      : globals - command line info, with the G* globals set up
+              quater - TRUE if the rotations are quaternions
+@OUTPUT     : 
+@RETURNS    : nothing
+@DESCRIPTION: evaluate the objective function on a batch of parameter 
+              vectors and write them to the -matlab file:
+                 -sweep_list: the vectors read from a file, one per line,
+                    with the values of the -sweep parameters (or of all
+                    the optimized parameters) in that order;
+                 -sweep: the Cartesian grid of -num_steps steps on each 
+                    side of the current value of each named parameter, 
+                    with the spacing used for the matlab curves.
+              The values are in the internal units: mm, radians (or 
+              quaternion components), scale factors and shears.  
+              Parameters that are not named keep their current value.
+
+              The source side of the lattice is computed once for the
+              whole batch (see begin_source_lattice_cache()).  The points
+              are taken SWEEP_BLOCK at a time and evaluated concurrently
+              (see evaluate_sweep_points()), then written in order; the
+              file is flushed after each block, so that long sweeps can
+              be followed while they run.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+#define SWEEP_BLOCK  256        /* points evaluated at once */
+
+static void batch_sweep(Arg_Data *globals, VIO_BOOL quater)
+{
+  VIO_Status
+    status;
+  FILE
+    *ofd, *ifd;
+  int
+    i, j, k, m, n, n_read,
+    index[12], 
+    counter[12];
+  double
+    saved[12], step[12], value,
+    **points, *values;
+  char
+    line[1024], *s, *end;
+  long
+    n_points;
+  VIO_BOOL
+    done, reentrant;
+
+  n = parse_sweep_names(Sweep_params, globals, index);
+  if (n == 0) 
+    print_error_and_line_num ("No parameter to sweep.\n", __FILE__, __LINE__);
+
+  for(i=0; i<12; i++)
+    saved[i] = *sweep_parameter(&globals->trans_info, i, quater);
+
+  status = open_file(  globals->filenames.matlab_file, WRITE_FILE, BINARY_FORMAT,  &ofd );
+  if ( status != OK ) 
+    print_error_and_line_num ("filename `%s' cannot be opened.", 
+                              __FILE__, __LINE__, globals->filenames.matlab_file);
+
+  if (!Sweep_binary) {
+    for(i=0; i<n; i++)
+      (void)fprintf (ofd, "%s,", Sweep_names[index[i]]);
+    (void)fprintf (ofd, "value\n");
+  }
+
+  ifd = NULL;
+  if (Sweep_list != NULL) {
+    status = open_file(  Sweep_list, READ_FILE, ASCII_FORMAT,  &ifd );
+    if ( status != OK ) 
+      print_error_and_line_num ("filename `%s' cannot be opened.", 
+                                __FILE__, __LINE__, Sweep_list);
+  }
+  else {
+                                /* odometer over the grid, the last 
+                                   parameter varying fastest */
+    for(i=0; i<n; i++) {
+      step[i] = globals->trans_info.weights[index[i]] * simplex_size / Matlab_num_steps;
+      counter[i] = -Matlab_num_steps;
+    }
+  }
+
+  ALLOC2D(points, SWEEP_BLOCK, 12);
+  ALLOC(values, SWEEP_BLOCK);
+
+  reentrant = objective_is_reentrant(globals);
+
+  begin_source_lattice_cache();
+
+  n_points = 0;
+  done = FALSE;
+
+  while (!done) {
+                                /* the next block of points */
+    m = 0;
+    while (m < SWEEP_BLOCK && !done) {
+
+      for(i=0; i<12; i++)
+        points[m][i] = saved[i];
+
+      if (ifd != NULL) {
+
+        if (fgets(line, sizeof(line), ifd) == NULL) {
+          done = TRUE;
+          break;
+        }
+
+        s = line;
+        while (*s == ' ' || *s == '\t') s++;
+        if (*s == '#' || *s == '\n' || *s == '\0') 
+          continue;
+
+        for(n_read=0; n_read<n; n_read++) {
+          while (*s == ' ' || *s == '\t' || *s == ',') s++;
+          value = strtod(s, &end);
+          if (end == s) 
+            break;
+          points[m][index[n_read]] = value;
+          s = end;
+        }
+        if (n_read != n) 
+          print_error_and_line_num ("expected %d values on line %ld of `%s'.\n", 
+                                    __FILE__, __LINE__, n, n_points+m+1, Sweep_list);
+      }
+      else {
+        for(i=0; i<n; i++)
+          points[m][index[i]] = saved[index[i]] + counter[i]*step[i];
+
+        for(k=n-1; k>=0; k--) {
+          if (counter[k] < Matlab_num_steps) {
+            counter[k]++;
+            break;
+          }
+          counter[k] = -Matlab_num_steps;
+        }
+        if (k < 0)
+          done = TRUE;
+      }
+
+      m++;
+    }
+
+    evaluate_sweep_points(m, points, values, quater, reentrant);
+
+    for(j=0; j<m; j++)
+      write_sweep_point(ofd, n, index, points[j], values[j]);
+    (void)fflush(ofd);
+
+    n_points += m;
+  }
+
+  end_source_lattice_cache();
+
+  FREE(values);
+  FREE2D(points);
+
+  if (ifd != NULL)
+    status = close_file(ifd);
+
+  status = close_file(ofd);
+  if ( status != OK ) 
+    print_error_and_line_num ("filename `%s' cannot be closed.", 
+                              __FILE__, __LINE__, globals->filenames.matlab_file);
+
+  if (globals->flags.verbose > 0) 
+    print ("%ld points written to %s\n", n_points, globals->filenames.matlab_file);
+}
+
 
 void make_matlab_data_file(VIO_Volume d1,
                                   VIO_Volume d2,
@@ -164,8 +531,6 @@ void make_matlab_data_file(VIO_Volume d1,
   VIO_Real
     start,step;
   double trans[3], quats[4], shears[3], scales[3],rots[3];
-  VIO_Data_types
-    data_type;
 
   start = 0.0;
   if (globals->obj_function == zscore_objective) { /* replace volume d1 and d2 by zscore volume  */
@@ -206,29 +571,6 @@ void make_matlab_data_file(VIO_Volume d1,
                                 /* Collignon's mutual information */
     {
 
-      if ( globals->groups != 256 ) {
-        print ("WARNING: -groups was %d, but will be forced to 256 in this run\n",globals->groups);
-        globals->groups = 256;
-      }
-
-      data_type = get_volume_data_type (d1);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: source volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d1)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
-      data_type = get_volume_data_type (d2);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: target volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d2)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
       ALLOC(   prob_fn1,   globals->groups);
       ALLOC(   prob_fn2,   globals->groups);
       ALLOC2D( prob_hash_table, globals->groups, globals->groups);
@@ -316,7 +658,9 @@ print ("scale: %10.5f %10.5f %10.5f \n",
        globals->trans_info.scales[0],globals->trans_info.scales[1],globals->trans_info.scales[2]);
 
 
-  if (ndim>0) {
+  if (ndim>0 && (Sweep_params != NULL || Sweep_list != NULL)) 
+    batch_sweep(globals, FALSE);
+  else if (ndim>0) {
 
     ALLOC(p,ndim+1); /* parameter values */
     
@@ -486,7 +830,9 @@ print ("scale: %10.5f %10.5f %10.5f \n",
        globals->trans_info.scales[0],globals->trans_info.scales[1],globals->trans_info.scales[2]);
 
 
-  if (ndim>0) {
+  if (ndim>0 && (Sweep_params != NULL || Sweep_list != NULL)) 
+    batch_sweep(globals, TRUE);
+  else if (ndim>0) {
 
     ALLOC(p,ndim+1); /* parameter values */
     
@@ -587,6 +933,7 @@ print ("scale: %10.5f %10.5f %10.5f \n",
       FREE(   prob_fn1 );
       FREE(   prob_fn2 );
       FREE2D( prob_hash_table);
+      free_mutual_information_bins();
     }
 
 
@@ -0,0 +1,299 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : measure_list.c
+@DESCRIPTION: score a list of transformations with the selected objective
+              function, for -measure_list.  The volumes are read, and the
+              lattice and the source side of the objective functions are
+              set up, once for the whole list.
+@COPYRIGHT  :
+              Copyright 1993 Louis Collins, McConnell Brain Imaging Centre,
+              Montreal Neurological Institute, McGill University.
+              Permission to use, copy, modify, and distribute this
+              software and its documentation for any purpose and without
+              fee is hereby granted, provided that the above copyright
+              notice appear in all copies.  The author and McGill University
+              make no representations about the suitability of this
+              software for any purpose.  It is provided "as is" without
+              express or implied warranty.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <string.h>
+#include <volume_io.h>
+
+#include "constants.h"
+#include "arg_data.h"
+#include "objectives.h"
+#include "segment_table.h"
+#include "deform_support.h"
+#include "Proglib.h"
+
+#include "local_macros.h"
+
+extern   VIO_Volume   Gdata1, Gdata2, Gmask1, Gmask2;
+extern   Segment_Table  *segment_table;
+
+extern VIO_Real            **prob_hash_table;
+extern VIO_Real            *prob_fn1;
+extern VIO_Real            *prob_fn2;
+
+void make_zscore_volume(VIO_Volume d1, VIO_Volume m1,
+                               VIO_Real *threshold);
+
+void add_speckle_to_volume(VIO_Volume d1,
+                                  float speckle,
+                                  double  *start, int *count, VectorR directions[]);
+
+static char *objective_name(Arg_Data *globals)
+{
+  switch (globals->obj_function_type) {
+  case XCORR:                         return("xcorr");
+  case ZSCORE:                        return("zscore");
+  case SSC:                           return("ssc");
+  case VR:                            return("vr");
+  case MUTUAL_INFORMATION:            return("mi");
+  case NORMALIZED_MUTUAL_INFORMATION: return("nmi");
+  default:                            return("value");
+  }
+}
+
+/* number of transformations read, scored and written at a time */
+#define MEASURE_BLOCK 32
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : measure_transform
+@INPUT      : args - a copy of the command line info, with its
+                 transformation set to the one to score
+              linear - TRUE if that transformation is linear
+@OUTPUT     :
+@RETURNS    : the value of the objective function for the transformation
+@DESCRIPTION: a linear transformation is scored by the selected objective
+              function, on the voxel-to-voxel lattice.  Any other one
+              (grid, thin-plate spline, concatenation) is scored by
+              sampling the lattice in world space through
+              general_transform_point(), with xcorr_objective_with_def();
+              only xcorr is available for those.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+static float measure_transform(Arg_Data *args, VIO_BOOL linear)
+{
+  if (linear)
+    return( (args->obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,args) );
+  else
+    return( xcorr_objective_with_def(Gdata1,Gdata2,Gmask1,Gmask2,args) );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : measure_transform_list
+@INPUT      : d1,d2,m1,m2 - the volumes, with the lattice already built by
+                 init_lattice()
+              list_file - text file with one transformation file name
+                 per line
+              output_file - name of the table to write
+              globals - command line info
+@OUTPUT     :
+@RETURNS    : OK if the table could be written
+@DESCRIPTION: each transformation is read and the selected objective
+              function is evaluated for it, as it is (the -lsq* type is
+              not imposed on it), and written as one CSV line of the
+              table: the file name and the value.  The volumes are
+              prepared for the objective function (z-scored, segmented,
+              ...) once, and the source side of the lattice is reused
+              from one transformation to the next.
+
+              Non-linear transformations are scored in world space (see
+              measure_transform()), with xcorr only; with any other
+              objective function their value is written as nan, with a
+              warning, as is that of a file that cannot be read.
+
+              The list is done in blocks of MEASURE_BLOCK files: they
+              are read one after the other, then, with
+              objective_is_reentrant(), scored concurrently, each thread
+              with its own copy of globals and the cached source lattice
+              shared read-only, and finally written in list order.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_Status measure_transform_list(VIO_Volume d1,
+                                  VIO_Volume d2,
+                                  VIO_Volume m1,
+                                  VIO_Volume m2,
+                                  char *list_file,
+                                  char *output_file,
+                                  Arg_Data *globals)
+{
+  VIO_Status
+    status;
+  FILE
+    *ifd, *ofd;
+  VIO_General_transform
+    xfm[MEASURE_BLOCK];
+  Arg_Data
+    args;
+  char
+    line[1024], *name, *end,
+    names[MEASURE_BLOCK][1024];
+  VIO_BOOL
+    reentrant, more,
+    scored[MEASURE_BLOCK],
+    linear[MEASURE_BLOCK];
+  float
+    values[MEASURE_BLOCK];
+  int
+    i, m, n_read;
+
+                                /* prepare the data once for all */
+
+  if (globals->obj_function == zscore_objective) {
+    make_zscore_volume(d1,m1,&globals->threshold[0]);
+    make_zscore_volume(d2,m2,&globals->threshold[1]);
+  }
+  else if (globals->obj_function == ssc_objective) {
+    make_zscore_volume(d1,m1,&globals->threshold[0]);
+    make_zscore_volume(d2,m2,&globals->threshold[1]);
+    if (globals->smallest_vol == 1)
+      add_speckle_to_volume(d1, globals->speckle,
+                            globals->start, globals->count, globals->directions);
+    else
+      add_speckle_to_volume(d2, globals->speckle,
+                            globals->start, globals->count, globals->directions);
+  }
+  else if (globals->obj_function == vr_objective) {
+    if (!build_segment_table(&segment_table,
+                             (globals->smallest_vol == 1) ? d1 : d2,
+                             globals->groups))
+      print_error_and_line_num("%s",__FILE__, __LINE__,"Could not build segment table\n");
+  }
+  else if (globals->obj_function == mutual_information_objective ||
+           globals->obj_function == normalized_mutual_information_objective) {
+    ALLOC(   prob_fn1,   globals->groups);
+    ALLOC(   prob_fn2,   globals->groups);
+    ALLOC2D( prob_hash_table, globals->groups, globals->groups);
+  }
+
+                                /* the objective functions map the
+                                   smallest volume into the other one */
+  if (globals->smallest_vol == 1) {
+    Gdata1 = d1; Gdata2 = d2;
+    Gmask1 = m1; Gmask2 = m2;
+  }
+  else {
+    Gdata1 = d2; Gdata2 = d1;
+    Gmask1 = m2; Gmask2 = m1;
+  }
+
+  status = open_file( list_file, READ_FILE, ASCII_FORMAT, &ifd );
+  if ( status != OK )
+    print_error_and_line_num ("filename `%s' cannot be opened.",
+                              __FILE__, __LINE__, list_file);
+
+  status = open_file( output_file, WRITE_FILE, ASCII_FORMAT, &ofd );
+  if ( status != OK )
+    print_error_and_line_num ("filename `%s' cannot be opened.",
+                              __FILE__, __LINE__, output_file);
+
+  (void)fprintf (ofd, "transform,%s\n", objective_name(globals));
+
+  reentrant = objective_is_reentrant(globals);
+  n_read = 0;
+
+  begin_source_lattice_cache();
+
+  do {
+                                /* read a block of transformations */
+    m = 0;
+    more = FALSE;
+    while (m < MEASURE_BLOCK && 
+           (more = (fgets(line, sizeof(line), ifd) != NULL))) {
+
+      name = line;              /* trim the file name */
+      while (*name == ' ' || *name == '\t') name++;
+      end = name + strlen(name);
+      while (end > name && (end[-1] == '\n' || end[-1] == '\r' ||
+                            end[-1] == ' '  || end[-1] == '\t'))
+        end--;
+      *end = '\0';
+
+      if (*name == '\0' || *name == '#')
+        continue;
+
+      n_read++;
+      (void)strcpy(names[m], name);
+      scored[m] = FALSE;
+
+      if (input_transform_file(name, &xfm[m]) != OK) {
+        (void)fprintf(stderr, "Warning: cannot read transformation `%s'.\n", name);
+        m++;
+        continue;
+      }
+
+      linear[m] = (get_transform_type(&xfm[m]) == LINEAR);
+      if (!linear[m] && globals->obj_function != xcorr_objective) {
+        (void)fprintf(stderr, "Warning: `%s' is not linear, it can only be scored with -xcorr.\n", name);
+        delete_general_transform(&xfm[m]);
+        m++;
+        continue;
+      }
+                                /* in place, without copying a grid */
+      if (globals->smallest_vol != 1)
+        invert_general_transform(&xfm[m]);
+
+      scored[m] = TRUE;
+      m++;
+    }
+
+                                /* score it */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(args) if (reentrant && m > 1)
+#endif
+    for(i=0; i<m; i++) {
+      if (scored[i]) {
+        args = *globals;
+        args.trans_info.transformation = &xfm[i];
+        values[i] = measure_transform(&args, linear[i]);
+      }
+    }
+
+                                /* and write it in list order */
+    for(i=0; i<m; i++) {
+      if (scored[i]) {
+        (void)fprintf (ofd, "%s,%f\n", names[i], values[i]);
+        delete_general_transform(&xfm[i]);
+      }
+      else
+        (void)fprintf (ofd, "%s,nan\n", names[i]);
+    }
+    (void)fflush(ofd);
+
+  } while (more);
+
+  end_source_lattice_cache();
+
+  (void)close_file(ifd);
+  status = close_file(ofd);
+  if ( status != OK )
+    print_error_and_line_num ("filename `%s' cannot be closed.",
+                              __FILE__, __LINE__, output_file);
+
+  if (globals->flags.verbose > 0)
+    print ("%d transformations scored into %s\n", n_read, output_file);
+
+                                /* clean up */
+
+  if (globals->obj_function == vr_objective) {
+    if (!free_segment_table(segment_table))
+      (void)fprintf(stderr, "Can't free segment table.\n");
+  }
+  else if (globals->obj_function == mutual_information_objective ||
+           globals->obj_function == normalized_mutual_information_objective) {
+    FREE(   prob_fn1 );
+    FREE(   prob_fn2 );
+    FREE2D( prob_hash_table);
+    free_mutual_information_bins();
+  }
+
+  return(status);
+}
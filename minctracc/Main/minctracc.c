@@ -623,6 +623,14 @@ int main ( int argc, char* argv[] )
   if (strlen(main_args.filenames.measure_file) != 0) 
     {
 
+      if (Measure_list != NULL) {
+        init_lattice( data, model, mask_data, mask_model, &main_args );
+        status = measure_transform_list( data, model, mask_data, mask_model, 
+                                         Measure_list, main_args.filenames.measure_file,
+                                         &main_args );
+        exit( status );
+      }
+
 #include "measure_code.c"
 
     /* measure code finishes with 
@@ -139,6 +139,8 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include "cov_to_praxes.h"
 #include "make_rots.h"
 #include "quaternion.h"
+#include "xcorr_fft.h"
+#include "interpolation.h"
 
 extern Arg_Data main_args;
 
@@ -152,6 +154,9 @@ VIO_BOOL rotmat_to_ang(float **rot, float *ang);
 int point_not_masked(VIO_Volume volume, 
                             VIO_Real wx, VIO_Real wy, VIO_Real wz);
 
+int voxel_point_not_masked(VIO_Volume volume, 
+                                  VIO_Real vx, VIO_Real vy, VIO_Real vz);
+
 void set_up_lattice(VIO_Volume data,       /* in: volume  */
                            double *user_step, /* in: user requested spacing for lattice */
                            double *start,     /* out:world starting position of lattice  in volume dircos coords*/
@@ -161,136 +166,256 @@ void set_up_lattice(VIO_Volume data,       /* in: volume  */
                            VectorR directions[]);/* out: vector directions for each index*/
 
 
-/* ----------------------------- MNI Header -----------------------------------
-@NAME       : vol_cog - get the center of gravity of a volume.
-@INPUT      : d1: one volume of data (already in memory).
-              m1: its corresponding mask volume
-              step: an 3 element array of step sizes in x,ya nd z directions
-                
-@OUTPUT     : centroid - vector giving centroid of points. This vector
-                         must be defined by the calling routine.
-@RETURNS    : TRUE if ok, FALSE if error.
-@DESCRIPTION: this routine does calculates the cog using 
-              volumetric subsampling in world space.
-              These world coordinates are mapped back into each 
-              data volume to get the actual value at the given location.
+/* The moments of a volume (sum of the values, and of the values times
+   the world coordinates and their products) are accumulated in a
+   single pass over a lattice laid on the volume, from which the COG
+   and the covariance matrix are both derived.  The lattice is affine
+   in world, d1 voxel and m1 voxel coordinates alike, so each node is
+   found from its indices in all three, without converting world
+   coordinates for every node.  The slices are done independently (in
+   parallel when built with OpenMP) and added in slice order, so that
+   the result does not depend on the number of threads. */
+
+typedef struct {
+  int      count[3];
+  VIO_Real world[4][3];         /* start, then slice, row and col steps */
+  VIO_Real voxel[4][3];         /* the same in the voxels of d1         */
+  VIO_Real mask[4][3];          /* the same in the voxels of m1         */
+} Moment_lattice;
+
+typedef struct {
+  VIO_Real s0;                  /* sum of values                        */
+  VIO_Real s1[3];               /* sum of values * x, y, z              */
+  VIO_Real s2[3][3];            /* sum of values * xx, xy, ...          */
+} Moment_sums;
+
+static void lattice_in_voxels(VIO_Volume volume, 
+                              VIO_Real world[4][3], 
+                              VIO_Real voxel[4][3])
+{
+  VIO_Real
+    vector[VIO_MAX_DIMENSIONS];
+  int 
+    i;
+
+  convert_3D_world_to_voxel(volume, world[0][0], world[0][1], world[0][2],
+                            &voxel[0][0], &voxel[0][1], &voxel[0][2]);
+  for(i=1; i<4; i++) {
+    convert_world_vector_to_voxel(volume, world[i][0], world[i][1], world[i][2], 
+                                  vector);
+    voxel[i][0] = vector[0];
+    voxel[i][1] = vector[1];
+    voxel[i][2] = vector[2];
+  }
+}
 
-@GLOBALS    : 
-@CALLS      : 
-@CREATED    : Wed Aug  2 12:05:39 MET DST 1995 LC
-@MODIFIED   : 
-              
----------------------------------------------------------------------------- */
-VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
+#define MOMENT_CHUNK 64
+
+static void moments_slice(Volume_descriptor *desc,
+                          VIO_Volume m1, 
+                          Moment_lattice *lattice,
+                          int s,
+                          Moment_sums *sums)
 {
+  VIO_Real
+    w[3], v[3],
+    vx[MOMENT_CHUNK], vy[MOMENT_CHUNK], vz[MOMENT_CHUNK],
+    true_value[MOMENT_CHUNK];
+  char
+    inside[MOMENT_CHUNK];
+  int
+    i,j,k,n,r,c0;
 
+  sums->s0 = 0.0;
+  for(i=0; i<3; i++) {
+    sums->s1[i] = 0.0;
+    for(j=0; j<3; j++) 
+      sums->s2[i][j] = 0.0;
+  }
 
-  VectorR
-    vector_step;
+  for(r=0; r<lattice->count[ROW_IND]; r++) {
+    for(c0=0; c0<lattice->count[COL_IND]; c0+=MOMENT_CHUNK) {
+
+      n = lattice->count[COL_IND] - c0;
+      if (n > MOMENT_CHUNK) n = MOMENT_CHUNK;
+
+                                /* the voxels of a chunk of the row,
+                                   interpolated all at once */
+      for(k=0; k<n; k++) {
+        vx[k] = lattice->voxel[0][0] + s*lattice->voxel[1+SLICE_IND][0] + 
+                r*lattice->voxel[1+ROW_IND][0] + (c0+k)*lattice->voxel[1+COL_IND][0];
+        vy[k] = lattice->voxel[0][1] + s*lattice->voxel[1+SLICE_IND][1] + 
+                r*lattice->voxel[1+ROW_IND][1] + (c0+k)*lattice->voxel[1+COL_IND][1];
+        vz[k] = lattice->voxel[0][2] + s*lattice->voxel[1+SLICE_IND][2] + 
+                r*lattice->voxel[1+ROW_IND][2] + (c0+k)*lattice->voxel[1+COL_IND][2];
+      }
 
-  PointR 
-    starting_position,
-    slice,
-    row,
-    col,
-    voxel;
+      (void)interpolate_points(desc, main_args.interpolant, 
+                               n, vx, vy, vz, true_value, inside, NULL);
 
-  VIO_Real
-    tx,ty,tz;
+      for(k=0; k<n; k++) {
 
-  int
-    i,
-    r,c,s;
+        if (!inside[k])         /* requested voxel is just outside volume., */
+          continue;             /* so ignore it */
 
-  float
-    sx,sy,sz,si; 
+        if (m1 != NULL) {
+          for(i=0; i<3; i++) 
+            v[i] = lattice->mask[0][i] + s*lattice->mask[1+SLICE_IND][i] + 
+                   r*lattice->mask[1+ROW_IND][i] + (c0+k)*lattice->mask[1+COL_IND][i];
+          if (!voxel_point_not_masked(m1, v[0], v[1], v[2]))
+            continue;
+        }
 
-  VIO_Real
-    true_value;
+        for(i=0; i<3; i++) 
+          w[i] = lattice->world[0][i] + s*lattice->world[1+SLICE_IND][i] + 
+                 r*lattice->world[1+ROW_IND][i] + (c0+k)*lattice->world[1+COL_IND][i];
+
+        sums->s0 += true_value[k];
+        for(i=0; i<3; i++) {
+          sums->s1[i] += w[i] * true_value[k];
+          for(j=i; j<3; j++) 
+            sums->s2[i][j] += w[i] * w[j] * true_value[k];
+        }
+      }
+    }
+  }
+}
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : vol_moments - get the zeroth, first and second order moments
+                 of a volume
+@INPUT      : d1: one volume of data (already in memory).
+              m1: its corresponding mask volume
+              step: an 3 element array of step sizes in x,ya nd z directions
+@OUTPUT     : sums - the moments, in world coordinates
+@RETURNS    : TRUE if the sum of the values is not zero
+@DESCRIPTION: one pass over a lattice on d1, for vol_cog(), vol_cov() and
+              vol_to_cov().
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL vol_moments(VIO_Volume d1, VIO_Volume m1, double *step, 
+                            Moment_sums *sums)
+{
+  Moment_lattice
+    lattice;
+  Moment_sums
+    *slice_sums;
+  Volume_descriptor
+    desc;
   int
-    count[ VIO_MAX_DIMENSIONS];
+    i,j,s;
   double 
     start[VIO_MAX_DIMENSIONS],
-    wstart[ VIO_MAX_DIMENSIONS],
-    local_step[ VIO_MAX_DIMENSIONS];
+    wstart[VIO_MAX_DIMENSIONS],
+    local_step[VIO_MAX_DIMENSIONS];
   VectorR
-    scaled_directions[VIO_MAX_DIMENSIONS],
-    directions[ VIO_MAX_DIMENSIONS];  
+    directions[VIO_MAX_DIMENSIONS];  
 
                                 /* build default sampling lattice info
                                    on the data set (d1)               */
-  set_up_lattice(d1, step,start, wstart, count, local_step, directions);
+  set_up_lattice(d1, step, start, wstart, lattice.count, local_step, directions);
 
-  
-   for(i=0; i<3; i++) {
-     Point_x(scaled_directions[i]) = Point_x(directions[i]) * local_step[i];
-     Point_y(scaled_directions[i]) = Point_y(directions[i]) * local_step[i];
-     Point_z(scaled_directions[i]) = Point_z(directions[i]) * local_step[i];
-   }
+  for(i=0; i<3; i++) {
+    lattice.world[0][i] = wstart[i];
+    lattice.world[1+i][0] = Point_x(directions[i]) * local_step[i];
+    lattice.world[1+i][1] = Point_y(directions[i]) * local_step[i];
+    lattice.world[1+i][2] = Point_z(directions[i]) * local_step[i];
+  }
 
-  fill_Point( starting_position, wstart[0], wstart[1], wstart[2]);
-  
-                                /* calculate centroids */
+  init_volume_descriptor(&desc, d1);
+  lattice_in_voxels(d1, lattice.world, lattice.voxel);
+  if (m1 != NULL)
+    lattice_in_voxels(m1, lattice.world, lattice.mask);
 
-  sx = 0.0;
-  sy = 0.0;
-  sz = 0.0;
-  si = 0.0;
+  ALLOC(slice_sums, lattice.count[SLICE_IND]+1);
 
- 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<lattice.count[SLICE_IND]; s++)
+    moments_slice(&desc, m1, &lattice, s, &slice_sums[s]);
+
+  sums->s0 = 0.0;
+  for(i=0; i<3; i++) {
+    sums->s1[i] = 0.0;
+    for(j=0; j<3; j++) 
+      sums->s2[i][j] = 0.0;
+  }
 
-  for(s=0; s<count[SLICE_IND]; s++) {
+  for(s=0; s<lattice.count[SLICE_IND]; s++) {
+    sums->s0 += slice_sums[s].s0;
+    for(i=0; i<3; i++) {
+      sums->s1[i] += slice_sums[s].s1[i];
+      for(j=i; j<3; j++) 
+        sums->s2[i][j] += slice_sums[s].s2[i][j];
+    }
+  }
 
-    SCALE_VECTOR( vector_step, scaled_directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+  for(i=0; i<3; i++)            /* fill the lower half */
+    for(j=0; j<i; j++) 
+      sums->s2[i][j] = sums->s2[j][i];
 
-    for(r=0; r<count[ROW_IND]; r++) {
+  FREE(slice_sums);
 
-      SCALE_VECTOR( vector_step, scaled_directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
+  return(sums->s0 != 0.0);
+}
 
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<count[COL_IND]; c++) {
+/* covariance of the moments about center (both in zero offset form) */
 
-        convert_3D_world_to_voxel(d1, Point_x(col), Point_y(col), Point_z(col), &tx, &ty, &tz);
+static void moments_to_cov(Moment_sums *sums, VIO_Real center[3], float **covar)
+{
+  VIO_Real
+    mean[3];
+  int
+    i,j;
 
+  for(i=0; i<3; i++)
+    mean[i] = sums->s1[i] / sums->s0;
 
-        fill_Point( voxel, tx, ty, tz ); /* build the voxel POINT */
-        
+  for(i=0; i<3; i++)
+    for(j=0; j<3; j++)
+      covar[i+1][j+1] = sums->s2[i][j] / sums->s0 
+        - center[i]*mean[j] - mean[i]*center[j] + center[i]*center[j];
+}
 
-        if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {        
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &true_value )) {
-            
 
-            sx +=  Point_x(col) * true_value;
-            sy +=  Point_y(col) * true_value;
-            sz +=  Point_z(col) * true_value;
-            
-            si += true_value;
-          }
-          /* else requested voxel is just outside volume., so ignore it */
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : vol_cog - get the center of gravity of a volume.
+@INPUT      : d1: one volume of data (already in memory).
+              m1: its corresponding mask volume
+              step: an 3 element array of step sizes in x,ya nd z directions
+                
+@OUTPUT     : centroid - vector giving centroid of points. This vector
+                         must be defined by the calling routine.
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: this routine does calculates the cog using 
+              volumetric subsampling in world space.
+              These world coordinates are mapped back into each 
+              data volume to get the actual value at the given location.
 
-        }
-        
-        ADD_POINT_VECTOR( col, col, scaled_directions[COL_IND] );
-        
-      }
-    }
-  }
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : Wed Aug  2 12:05:39 MET DST 1995 LC
+@MODIFIED   : computed from vol_moments()
+              
+---------------------------------------------------------------------------- */
+VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
+{
+  Moment_sums
+    sums;
+  int
+    i;
 
-  if (si!=0.0) {
-    centroid[1] = sx/ si;
-    centroid[2] = sy/ si;
-    centroid[3] = sz/ si;
-    
-    return(TRUE);
-    
-  }
-  else {
+  if (!vol_moments(d1, m1, step, &sums))
     return(FALSE);
-  }
+
+  for(i=0; i<3; i++)
+    centroid[i+1] = sums.s1[i] / sums.s0;
+    
+  return(TRUE);
 }
 
 
@@ -311,122 +436,32 @@ VIO_BOOL vol_cog(VIO_Volume d1, VIO_Volume m1, float *centroid, double *step)
               I use the header info and kernel size to calculate the
               positions of the sub-samples in each vol.
 
+              The covariance is taken about centroid, which need not be
+              the COG of the volume (see -center).
 @GLOBALS    : 
 @CALLS      : 
 @CREATED    : Wed Aug  2 12:05:39 MET DST 1995 LC
-@MODIFIED   : 
+@MODIFIED   : computed from vol_moments()
               
 ---------------------------------------------------------------------------- */
 VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, double *step)
 {
-
-
-  VectorR
-    vector_step;
-
-  PointR 
-    starting_position,
-    slice,
-    row,
-    col,
-    voxel;
-
-  VIO_Real
-    tx,ty,tz;
-
-  int
-    i,r,c,s;
-
-  float
-    sxx,syy,szz,
-    sxy,syz,sxz,
-    si; 
-
+  Moment_sums
+    sums;
   VIO_Real
-    true_value;
-
+    center[3];
   int
-    count[VIO_MAX_DIMENSIONS];
-  double 
-    start[VIO_MAX_DIMENSIONS],
-    wstart[VIO_MAX_DIMENSIONS],
-    local_step[VIO_MAX_DIMENSIONS];
-  VectorR
-    scaled_directions[VIO_MAX_DIMENSIONS],
-    directions[VIO_MAX_DIMENSIONS];  
-
-                                /* build default sampling lattice info
-                                   on the data set (d1)               */
+    i;
 
-  set_up_lattice(d1, step,
-                 start, wstart, count, local_step, directions);
+  if (!vol_moments(d1, m1, step, &sums))
+    return(FALSE);
 
-   for(i=0; i<3; i++) {
-     Point_x(scaled_directions[i]) = Point_x(directions[i]) * local_step[i];
-     Point_y(scaled_directions[i]) = Point_y(directions[i]) * local_step[i];
-     Point_z(scaled_directions[i]) = Point_z(directions[i]) * local_step[i];
-   }
+  for(i=0; i<3; i++)
+    center[i] = centroid[i+1];
 
-  
-  fill_Point( starting_position, wstart[0], wstart[1], wstart[2]);
-  
-  si = 0.0;
-  sxx = syy = szz = 0.0;
-  sxy = syz = sxz = 0.0;
+  moments_to_cov(&sums, center, covar);
     
-                                /* now calculate variances and co-variances */
-
-  for(s=0; s<count[SLICE_IND]; s++) {
-    
-    SCALE_VECTOR( vector_step, scaled_directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
-    
-    for(r=0; r<count[ROW_IND]; r++) {
-      
-      SCALE_VECTOR( vector_step, scaled_directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
-      
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<count[COL_IND]; c++) {
-        
-        
-        convert_3D_world_to_voxel(d1, Point_x(col), Point_y(col), Point_z(col), &tx, &ty, &tz);
-        
-        fill_Point( voxel, tx, ty, tz ); /* build the voxel POINT */
-        
-        if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {        
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &true_value )) {
-            
-            sxx += (Point_x( col )-centroid[1]) * (Point_x( col )-centroid[1]) * true_value;
-            syy += (Point_y( col )-centroid[2]) * (Point_y( col )-centroid[2]) * true_value;
-            szz += (Point_z( col )-centroid[3]) * (Point_z( col )-centroid[3]) * true_value;
-            sxy += (Point_x( col )-centroid[1]) * (Point_y( col )-centroid[2]) * true_value;
-            syz += (Point_y( col )-centroid[2]) * (Point_z( col )-centroid[3]) * true_value;
-            sxz += (Point_x( col )-centroid[1]) * (Point_z( col )-centroid[3]) * true_value;
-            si += true_value;
-          }
-          /* else requested voxel is just outside volume., so ignore it */
-          
-        } 
-        
-        ADD_POINT_VECTOR( col, col, scaled_directions[COL_IND] );
-        
-      }
-    }
-  }
-
-  if (si != 0.0) {
-    covar[1][1] = sxx/si; covar[1][2] = sxy/si; covar[1][3] = sxz/si;
-    covar[2][1] = sxy/si; covar[2][2] = syy/si; covar[2][3] = syz/si;
-    covar[3][1] = sxz/si; covar[3][2] = syz/si; covar[3][3] = szz/si;
-    
-    return(TRUE);
-    
-  }
-  else {
-    return(FALSE);
-  }
+  return(TRUE);
 }
 
 
@@ -448,6 +483,7 @@ VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, d
               I use the header info and kernel size to calculate the
               positions of the sub-samples in each vol.
 
+              Both come from a single pass over the volume.
 @GLOBALS    : 
 @CALLS      : 
 @CREATED    : Feb 5, 1992 lc
@@ -456,6 +492,10 @@ VIO_BOOL vol_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, d
 ---------------------------------------------------------------------------- */
 VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar, double *step)
 {
+  Moment_sums
+    sums;
+  VIO_Real
+    center[3];
   int
     i,count[VIO_MAX_DIMENSIONS];
   double 
@@ -482,15 +522,17 @@ VIO_BOOL vol_to_cov(VIO_Volume d1, VIO_Volume m1, float *centroid, float **covar
              Point_z(directions[i]));
   }
 
+  if (!vol_moments(d1, m1, step, &sums))
+    return(FALSE);
 
-  if ( vol_cog(d1, m1, centroid, step) )
-    
-    return ( vol_cov( d1, m1, centroid, covar, step) );
+  for(i=0; i<3; i++) {
+    center[i] = sums.s1[i] / sums.s0;
+    centroid[i+1] = center[i];
+  }
 
-  else
-    
-    return (FALSE);
+  moments_to_cov(&sums, center, covar);
 
+  return(TRUE);
 }
 
 
@@ -582,14 +624,15 @@ static  VIO_BOOL init_transformation(
 
   /* =========  calculate COG and COV for volume 1   =======  */
                                 /* if center already set, then don't recalculate */
-  if ( !forced_center) {
-    stat = vol_cog(d1, m1, c1, step);
+  if ( !forced_center) {         /* COG and COV in one pass */
+    stat = vol_to_cov(d1, m1, c1, cov1, step);
     if (verbose>0 && stat) print ("COG of v1: %f %f %f\n",c1[1],c1[2],c1[3]);
   }
   else {
     if (verbose>0) print ("COG of v1 forced: %f %f %f\n",c1[1],c1[2],c1[3]);
+    stat = vol_cov(d1, m1, c1, cov1, step );
   }
-  if (!stat || !vol_cov(d1, m1, c1, cov1, step ) ) {
+  if (!stat) {
     print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG or COV of volume 1.\n" );
     return(FALSE);
   }
@@ -895,15 +938,16 @@ static  VIO_BOOL init_transformation_quater(
   /* =========  calculate COG and COV for volume 1   =======  */
 
                                 /* if center already set, then don't recalculate */
-  if ( !forced_center) {
-    stat = vol_cog(d1, m1, c1, step);
+  if ( !forced_center) {         /* COG and COV in one pass */
+    stat = vol_to_cov(d1, m1, c1, cov1, step);
     if (verbose>0 && stat) print ("COG of v1: %f %f %f\n",c1[1],c1[2],c1[3]);
   }
   else {
     if (verbose>0) print ("COG of v1 forced: %f %f %f\n",c1[1],c1[2],c1[3]);
+    stat = vol_cov(d1, m1, c1, cov1, step );
   }
 
-  if (!stat || !vol_cov(d1, m1, c1, cov1, step ) ) {
+  if (!stat) {
     print_error_and_line_num("%s", __FILE__, __LINE__,"Cannot calculate the COG or COV of volume 1\n." );
     return(FALSE);
   }
@@ -1124,6 +1168,47 @@ static  VIO_BOOL init_transformation_quater(
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : build_initial_matrix
+@INPUT      : globals - with the initial parameters in trans_info
+@OUTPUT     : globals->trans_info.transformation
+@RETURNS    : 
+@DESCRIPTION: build the linear part of the transformation from the
+              parameters.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void build_initial_matrix(Arg_Data *globals)
+{
+  VIO_Transform
+    *lt;
+
+  if (get_transform_type(globals->trans_info.transformation) == CONCATENATED_TRANSFORM) {
+    lt = get_linear_transform_ptr(get_nth_general_transform(globals->trans_info.transformation,0));
+  }
+  else
+    lt = get_linear_transform_ptr(globals->trans_info.transformation);
+ 
+  if( globals->trans_info.rotation_type == TRANS_ROT)
+    build_transformation_matrix(lt,
+                                globals->trans_info.center,
+                                globals->trans_info.translations,
+                                globals->trans_info.scales,
+                                globals->trans_info.shears,
+                                globals->trans_info.rotations);
+
+  if( globals->trans_info.rotation_type == TRANS_QUAT)
+    {
+      globals->trans_info.quaternions[3]=sqrt(1-SQR(globals->trans_info.quaternions[0])-SQR(globals->trans_info.quaternions[1])-SQR(globals->trans_info.quaternions[2]));
+      build_transformation_matrix_quater(lt,
+                                         globals->trans_info.center,
+                                         globals->trans_info.translations,
+                                         globals->trans_info.scales,
+                                         globals->trans_info.shears,
+                                         globals->trans_info.quaternions);
+    }
+}
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : init_params
                 get the parameters necessary to map volume 1 to volume 2
@@ -1160,6 +1245,9 @@ VIO_BOOL init_params(VIO_Volume d1,
     *ang,
     *sc,
     quats3;
+
+  double
+    shift[3];
     
   int
     center_forced,i;
@@ -1500,31 +1588,32 @@ VIO_BOOL init_params(VIO_Volume d1,
     }
   
 
-  if (get_transform_type(globals->trans_info.transformation) == CONCATENATED_TRANSFORM) {
-    lt = get_linear_transform_ptr(get_nth_general_transform(globals->trans_info.transformation,0));
-  }
-  else
-    lt = get_linear_transform_ptr(globals->trans_info.transformation);
- 
-  if( globals->trans_info.rotation_type == TRANS_ROT)
-    build_transformation_matrix(lt,
-                                globals->trans_info.center,
-                                globals->trans_info.translations,
-                                globals->trans_info.scales,
-                                globals->trans_info.shears,
-                                globals->trans_info.rotations);
-
-  if( globals->trans_info.rotation_type == TRANS_QUAT)
-    {
-      globals->trans_info.quaternions[3]=sqrt(1-SQR(globals->trans_info.quaternions[0])-SQR(globals->trans_info.quaternions[1])-SQR(globals->trans_info.quaternions[2]));
-      build_transformation_matrix_quater(lt,
-                                         globals->trans_info.center,
-                                         globals->trans_info.translations,
-                                         globals->trans_info.scales,
-                                         globals->trans_info.shears,
-                                         globals->trans_info.quaternions);
+  build_initial_matrix(globals);
+
+                                /* replace the translation by the peak
+                                   of the FFT cross-correlation, if
+                                   requested */
+  if (globals->trans_flags.init_xcorr_fft) {
+    if (!xcorr_fft_translation(d1, d2, m1, m2, 
+                               globals->trans_info.transformation,
+                               globals->step, shift)) {
+      print_error_and_line_num("%s", __FILE__, __LINE__,
+                               "Cannot compute the FFT cross-correlation of the volumes.\n" );
+      return(FALSE);
     }
 
+    for(i=0; i<3; i++)
+      globals->trans_info.translations[i] += shift[i];
+
+    if (main_args.flags.debug) 
+      print ( "Transform trans    = %8.3f %8.3f %8.3f (xcorr fft)\n", 
+              main_args.trans_info.translations[0],
+              main_args.trans_info.translations[1],
+              main_args.trans_info.translations[2] );
+
+    build_initial_matrix(globals);
+  }
+
   return(TRUE);
 }
 
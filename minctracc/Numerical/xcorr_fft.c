@@ -0,0 +1,391 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : xcorr_fft.c
+@DESCRIPTION: estimate of the translation that best aligns two volumes,
+              from the peak of their cross-correlation computed with an
+              FFT on a common coarse grid.  Used by init_params() for
+              -init_xcorr_fft.
+@COPYRIGHT  :
+              Copyright 1993 Louis Collins, McConnell Brain Imaging Centre,
+              Montreal Neurological Institute, McGill University.
+              Permission to use, copy, modify, and distribute this
+              software and its documentation for any purpose and without
+              fee is hereby granted, provided that the above copyright
+              notice appear in all copies.  The author and McGill University
+              make no representations about the suitability of this
+              software for any purpose.  It is provided "as is" without
+              express or implied warranty.
+
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+
+#include "config.h"
+#include <float.h>
+#include <volume_io.h>
+
+#include "constants.h"
+#include "arg_data.h"
+#include "xcorr_fft.h"
+
+extern Arg_Data main_args;
+
+#include "local_macros.h"
+#include <Proglib.h>
+
+int point_not_masked(VIO_Volume volume,
+                     VIO_Real wx, VIO_Real wy, VIO_Real wz);
+
+/*
+   The grid is aligned with the world axes of the target volume, with
+   the same spacing along x, y and z.  Its samples are stored as
+   complex values, in the 1-offset, interleaved order expected by
+   fft1(), with z varying fastest; each axis is zero-padded to size
+   (at least twice the number of samples), so that the correlation
+   does not wrap around.
+*/
+
+typedef struct {
+  int    n[3];                  /* samples along x, y and z           */
+  int    size;                  /* padded length of each axis         */
+  double origin[3];             /* world position of sample (0,0,0)   */
+  double spacing;               /* in mm                              */
+} Fft_grid;
+
+#define FFT_INDEX(grid, i, j, k) \
+   (1 + 2*((((long)(i))*(grid)->size + (j))*(grid)->size + (k)))
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : extend_bounds
+@INPUT      : volume
+              transform - applied to the world coordinates, or NULL
+              min, max - current bounding box
+@OUTPUT     : min, max - extended to hold the corners of the volume
+@RETURNS    :
+@DESCRIPTION:
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+static void extend_bounds(VIO_Volume volume,
+                          VIO_General_transform *transform,
+                          double min[], double max[])
+{
+  int
+    sizes[VIO_MAX_DIMENSIONS],
+    c, i;
+  VIO_Real
+    voxel[VIO_N_DIMENSIONS],
+    world[VIO_N_DIMENSIONS];
+
+  get_volume_sizes(volume, sizes);
+
+  for(c=0; c<8; c++) {
+    for(i=0; i<3; i++)
+      voxel[i] = (c & (1<<i)) ? sizes[i]-1 : 0.0;
+
+    convert_3D_voxel_to_world(volume, voxel[0], voxel[1], voxel[2],
+                              &world[0], &world[1], &world[2]);
+    if (transform != NULL)
+      general_transform_point(transform, world[0], world[1], world[2],
+                              &world[0], &world[1], &world[2]);
+
+    for(i=0; i<3; i++) {
+      if (world[i] < min[i]) min[i] = world[i];
+      if (world[i] > max[i]) max[i] = world[i];
+    }
+  }
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : resample_on_grid
+@INPUT      : d, m - volume and its mask
+              transform - if not NULL, each grid point is mapped through
+                          its inverse before sampling d
+              grid
+@OUTPUT     : signal - d sampled on the grid, with its mean removed;
+                       points outside the volume or its mask are 0
+@RETURNS    : FALSE if no grid point falls in the volume
+@DESCRIPTION:
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+static VIO_BOOL resample_on_grid(VIO_Volume d, VIO_Volume m,
+                                 VIO_General_transform *transform,
+                                 Fft_grid *grid,
+                                 float *signal)
+{
+  unsigned char
+    *valid;
+  int
+    i, j, k;
+  long
+    n, count;
+  VIO_Real
+    x, y, z, tx, ty, tz,
+    value, sum, mean;
+  PointR
+    voxel;
+
+  ALLOC(valid, (long)grid->n[0]*grid->n[1]*grid->n[2]);
+
+  n = 0;
+  count = 0;
+  sum = 0.0;
+  for(i=0; i<grid->n[0]; i++)
+    for(j=0; j<grid->n[1]; j++)
+      for(k=0; k<grid->n[2]; k++) {
+
+        x = grid->origin[0] + i * grid->spacing;
+        y = grid->origin[1] + j * grid->spacing;
+        z = grid->origin[2] + k * grid->spacing;
+        if (transform != NULL)
+          general_inverse_transform_point(transform, x, y, z, &x, &y, &z);
+
+        valid[n] = FALSE;
+        if (point_not_masked(m, x, y, z)) {
+          convert_3D_world_to_voxel(d, x, y, z, &tx, &ty, &tz);
+          fill_Point( voxel, tx, ty, tz );
+          if (INTERPOLATE_TRUE_VALUE( d, &voxel, &value )) {
+            signal[FFT_INDEX(grid,i,j,k)] = (float)value;
+            valid[n] = TRUE;
+            sum += value;
+            count++;
+          }
+        }
+        n++;
+      }
+
+  if (count > 0) {
+    mean = sum / count;
+    n = 0;
+    for(i=0; i<grid->n[0]; i++)
+      for(j=0; j<grid->n[1]; j++)
+        for(k=0; k<grid->n[2]; k++) {
+          if (valid[n])
+            signal[FFT_INDEX(grid,i,j,k)] -= (float)mean;
+          n++;
+        }
+  }
+
+  FREE(valid);
+
+  return(count > 0);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fft3
+@INPUT      : signal - grid->size^3 complex values, see FFT_INDEX
+              direction - 1 (forward) or -1 (inverse, unnormalized)
+@OUTPUT     : signal - transformed in place
+@RETURNS    :
+@DESCRIPTION: separable 3D FFT: fft1() along every line of each axis in
+              turn, the lines of one axis being done in parallel.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+static void fft3(Fft_grid *grid, float *signal, int direction)
+{
+  int
+    axis, t, size;
+  long
+    line, n_lines, base, stride, index;
+
+  size = grid->size;
+  n_lines = (long)size * size;
+
+  for(axis=0; axis<3; axis++) {
+
+#ifdef _OPENMP
+#pragma omp parallel for private(t,base,stride,index)
+#endif
+    for(line=0; line<n_lines; line++) {
+      float vector[2*XCORR_FFT_MAX_SIZE+1];
+
+      if (axis==2) {            /* z: contiguous */
+        base   = line * size;
+        stride = 1;
+      }
+      else if (axis==1) {       /* y */
+        base   = (line / size) * size * size + line % size;
+        stride = size;
+      }
+      else {                    /* x */
+        base   = line;
+        stride = (long)size * size;
+      }
+
+      for(t=0; t<size; t++) {
+        index = 1 + 2*(base + t*stride);
+        vector[1+2*t] = signal[index];
+        vector[2+2*t] = signal[index+1];
+      }
+
+      fft1(vector, size, direction);
+
+      for(t=0; t<size; t++) {
+        index = 1 + 2*(base + t*stride);
+        signal[index]   = vector[1+2*t];
+        signal[index+1] = vector[2+2*t];
+      }
+    }
+  }
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : peak_offset
+@INPUT      : c0 - correlation at the peak
+              cm, cp - correlation at the previous and next grid points
+@OUTPUT     :
+@RETURNS    : sub-sample position of the peak, in [-0.5,0.5]
+@DESCRIPTION: vertex of the parabola through the three values.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+static double peak_offset(double cm, double c0, double cp)
+{
+  double denom, offset;
+
+  denom = cm - 2.0*c0 + cp;
+  if (denom >= 0.0)
+    return(0.0);
+
+  offset = 0.5*(cm - cp)/denom;
+  if (offset < -0.5) offset = -0.5;
+  if (offset >  0.5) offset =  0.5;
+
+  return(offset);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : xcorr_fft_translation
+@INPUT      : d1,d2 - source and target volumes
+              m1,m2 - their masks (or NULL)
+              transform - current mapping from d1 to d2 world coordinates
+              step - lattice step, sets the spacing of the grid
+@OUTPUT     : shift - translation (mm) to add after transform so that d1
+                      best matches d2
+@RETURNS    : TRUE if ok, FALSE if either volume has no sample on the grid
+@DESCRIPTION: the target, and the source mapped through the current
+              transformation, are resampled on a common grid covering
+              both; their mean is removed and the cross-correlation
+                 c(s) = sum_y  d1'(y) d2(y+s)
+              is computed for every shift s as the inverse FFT of
+              FFT(d2) times the conjugate of FFT(d1').  The peak, refined
+              to a fraction of the grid spacing by a parabolic fit along
+              each axis, gives the shift.
+
+              The spacing is the largest lattice step, increased if needed
+              to keep the padded grid at most XCORR_FFT_MAX_SIZE along
+              each axis.
+@CREATED    :
+@MODIFIED   :
+---------------------------------------------------------------------------- */
+VIO_BOOL xcorr_fft_translation(VIO_Volume d1,
+                               VIO_Volume d2,
+                               VIO_Volume m1,
+                               VIO_Volume m2,
+                               VIO_General_transform *transform,
+                               double *step,
+                               double shift[])
+{
+  Fft_grid
+    grid;
+  float
+    *source, *target,
+    sr, si, tr, ti;
+  double
+    min[3], max[3], extent,
+    best, cm, cp;
+  long
+    n, index, best_index;
+  int
+    i, j, k, size, peak[3], near[3];
+  VIO_BOOL
+    stat;
+
+  for(i=0; i<3; i++) {
+    min[i] =  DBL_MAX;
+    max[i] = -DBL_MAX;
+  }
+  extend_bounds(d2, NULL, min, max);
+  extend_bounds(d1, transform, min, max);
+
+                                /* choose the spacing and the FFT size */
+  grid.spacing = 0.0;
+  extent = 0.0;
+  for(i=0; i<3; i++) {
+    if (fabs(step[i]) > grid.spacing) grid.spacing = fabs(step[i]);
+    if (max[i] - min[i] > extent)     extent = max[i] - min[i];
+  }
+  if (grid.spacing <= 0.0) grid.spacing = 4.0;
+
+  if (2*((int)(extent / grid.spacing) + 1) > XCORR_FFT_MAX_SIZE)
+    grid.spacing = extent / (XCORR_FFT_MAX_SIZE/2 - 1);
+
+  size = 1;
+  for(i=0; i<3; i++) {
+    grid.origin[i] = min[i];
+    grid.n[i] = (int)((max[i] - min[i]) / grid.spacing) + 1;
+    while (size < 2*grid.n[i]) size <<= 1;
+  }
+  grid.size = size;
+  n = (long)size * size * size;
+
+  if (main_args.flags.debug)
+    print ("xcorr fft on a %d^3 grid, %d x %d x %d samples of %f mm\n",
+           size, grid.n[0], grid.n[1], grid.n[2], grid.spacing);
+
+  ALLOC(source, 2*n+1);
+  ALLOC(target, 2*n+1);
+  for(index=0; index<=2*n; index++) {
+    source[index] = 0.0;
+    target[index] = 0.0;
+  }
+
+  stat = resample_on_grid(d2, m2, NULL,      &grid, target) &&
+         resample_on_grid(d1, m1, transform, &grid, source);
+
+  if (stat) {
+    fft3(&grid, target, 1);
+    fft3(&grid, source, 1);
+                                /* target = FFT(d2) * conj(FFT(d1')) */
+    for(index=1; index<2*n; index+=2) {
+      tr = target[index]; ti = target[index+1];
+      sr = source[index]; si = source[index+1];
+      target[index]   = tr*sr + ti*si;
+      target[index+1] = ti*sr - tr*si;
+    }
+    fft3(&grid, target, -1);
+
+    best = -DBL_MAX;
+    best_index = 0;
+    for(index=0; index<n; index++)
+      if (target[1+2*index] > best) {
+        best = target[1+2*index];
+        best_index = index;
+      }
+
+    peak[0] = (int)(best_index / ((long)size*size));
+    peak[1] = (int)((best_index / size) % size);
+    peak[2] = (int)(best_index % size);
+
+    for(i=0; i<3; i++) {
+      for(j=0; j<3; j++) near[j] = peak[j];
+      near[i] = (peak[i] + size - 1) % size;
+      cm = target[FFT_INDEX(&grid, near[0], near[1], near[2])];
+      near[i] = (peak[i] + 1) % size;
+      cp = target[FFT_INDEX(&grid, near[0], near[1], near[2])];
+
+      k = (peak[i] > size/2) ? peak[i] - size : peak[i];
+      shift[i] = (k + peak_offset(cm, best, cp)) * grid.spacing;
+    }
+
+    if (main_args.flags.debug)
+      print ("xcorr fft peak at %d %d %d, shift %f %f %f\n",
+             peak[0], peak[1], peak[2], shift[0], shift[1], shift[2]);
+  }
+
+  FREE(source);
+  FREE(target);
+
+  return(stat);
+}
@@ -0,0 +1,374 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : deform_grid.c
+@DESCRIPTION: routines to build and manipulate the structure-of-arrays
+              copy of a deformation field (see deform_grid.h) that is
+              used while the field is optimized in
+              do_non_linear_optimization().
+
+              The smoothing, extrapolation and update routines below
+              are the Deform_grid equivalents of smooth_the_warp(),
+              extrapolate_to_unestimated_nodes() and
+              add_additional_warp_to_current() in deform_support.c,
+              and give the same results.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@COPYRIGHT  :
+              Copyright 1993 Louis Collins, McConnell Brain Imaging Centre, 
+              Montreal Neurological Institute, McGill University.
+              Permission to use, copy, modify, and distribute this
+              software and its documentation for any purpose and without
+              fee is hereby granted, provided that the above copyright
+              notice appear in all copies.  The author and McGill University
+              make no representations about the suitability of this
+              software for any purpose.  It is provided "as is" without
+              express or implied warranty.
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <Proglib.h>
+#include "local_macros.h"
+#include "deform_grid.h"
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+/* allocate a grid with the same number of nodes as the displacement
+   volume of *warp.  The grid values are not initialized. */
+
+Deform_grid *new_deform_grid(VIO_General_transform *warp)
+{
+  Deform_grid 
+    *grid;
+  int
+    i,
+    sizes[VIO_MAX_DIMENSIONS];
+
+  if (warp->type != GRID_TRANSFORM) {
+    print_error_and_line_num("new_deform_grid not called with GRID_TRANSFORM",
+                             __FILE__, __LINE__);
+  }
+
+  ALLOC(grid, 1);
+
+  get_volume_XYZV_indices(warp->displacement_volume, grid->xyzv);
+  get_volume_sizes(       warp->displacement_volume, sizes);
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    grid->count[i] = sizes[ grid->xyzv[i] ];
+
+  grid->stride  = ((grid->count[VIO_Z] + DEFORM_GRID_PAD - 1) / DEFORM_GRID_PAD) * DEFORM_GRID_PAD;
+  grid->n_nodes = (long)grid->count[VIO_X] * grid->count[VIO_Y] * grid->stride;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    ALLOC(grid->base[i], grid->n_nodes + DEFORM_GRID_PAD);
+    grid->d[i] = (double *)( ((size_t)grid->base[i] + DEFORM_GRID_ALIGN - 1) & 
+                             ~((size_t)DEFORM_GRID_ALIGN - 1) );
+  }
+
+  return(grid);
+}
+
+void delete_deform_grid(Deform_grid *grid)
+{
+  int i;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    FREE(grid->base[i]);
+
+  FREE(grid);
+}
+
+void zero_deform_grid(Deform_grid *grid)
+{
+  int i;
+  long n;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    for(n=0; n<grid->n_nodes; n++)
+      grid->d[i][n] = 0.0;
+}
+
+void copy_transform_to_deform_grid(VIO_General_transform *warp,
+                                   Deform_grid *grid)
+{
+  int
+    index[VIO_MAX_DIMENSIONS],
+    *xyzv;
+  long
+    n;
+
+  xyzv = grid->xyzv;
+  zero_deform_grid(grid);
+
+  for(n=0; n<VIO_MAX_DIMENSIONS; n++) index[n]=0;
+
+  for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<grid->count[VIO_X]; index[xyzv[VIO_X]]++)
+    for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<grid->count[VIO_Y]; index[xyzv[VIO_Y]]++)
+      for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<grid->count[VIO_Z]; index[xyzv[VIO_Z]]++) {
+
+        n = DEFORM_GRID_OFFSET(grid, index[xyzv[VIO_X]], index[xyzv[VIO_Y]], index[xyzv[VIO_Z]]);
+
+        for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<VIO_N_DIMENSIONS; index[xyzv[VIO_Z+1]]++) 
+          grid->d[ index[xyzv[VIO_Z+1]] ][n] = 
+            get_volume_real_value(warp->displacement_volume,
+                                  index[0],index[1],index[2],index[3],index[4]);
+        index[xyzv[VIO_Z+1]] = 0;
+      }
+}
+
+void copy_deform_grid_to_transform(Deform_grid *grid,
+                                   VIO_General_transform *warp)
+{
+  int
+    index[VIO_MAX_DIMENSIONS],
+    *xyzv;
+  long
+    n;
+
+  xyzv = grid->xyzv;
+
+  for(n=0; n<VIO_MAX_DIMENSIONS; n++) index[n]=0;
+
+  for(index[xyzv[VIO_X]]=0; index[xyzv[VIO_X]]<grid->count[VIO_X]; index[xyzv[VIO_X]]++)
+    for(index[xyzv[VIO_Y]]=0; index[xyzv[VIO_Y]]<grid->count[VIO_Y]; index[xyzv[VIO_Y]]++)
+      for(index[xyzv[VIO_Z]]=0; index[xyzv[VIO_Z]]<grid->count[VIO_Z]; index[xyzv[VIO_Z]]++) {
+
+        n = DEFORM_GRID_OFFSET(grid, index[xyzv[VIO_X]], index[xyzv[VIO_Y]], index[xyzv[VIO_Z]]);
+
+        for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<VIO_N_DIMENSIONS; index[xyzv[VIO_Z+1]]++) 
+          set_volume_real_value(warp->displacement_volume,
+                                index[0],index[1],index[2],index[3],index[4],
+                                grid->d[ index[xyzv[VIO_Z+1]] ][n]);
+        index[xyzv[VIO_Z+1]] = 0;
+      }
+}
+
+/* average deformation vector of the neighbours of node (x,y,z):
+     avg_type == 1 : the 6 face-connected neighbours
+     avg_type == 2 : the 26 neighbours in the 3x3x3 neighbourhood
+   (as in get_average_warp_vector_from_neighbours()) */
+
+VIO_BOOL get_deform_grid_average_of_neighbours(Deform_grid *grid,
+                                               int x, int y, int z,
+                                               int avg_type,
+                                               VIO_Real mean[])
+{
+  int
+    i, count,
+    node[VIO_N_DIMENSIONS],
+    start[VIO_N_DIMENSIONS],
+    end[VIO_N_DIMENSIONS],
+    i0, i1, i2;
+  long
+    n;
+
+  mean[VIO_X] = mean[VIO_Y] = mean[VIO_Z] = 0.0;
+  node[VIO_X] = x; node[VIO_Y] = y; node[VIO_Z] = z;
+  count = 0;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    if (node[i] < 0 || node[i] >= grid->count[i])
+      return(FALSE);
+
+  if (avg_type == 1) {
+
+    for(i=0; i<VIO_N_DIMENSIONS; i++) {
+      if (node[i]+1 < grid->count[i]) {
+        node[i]++;
+        n = DEFORM_GRID_OFFSET(grid, node[VIO_X], node[VIO_Y], node[VIO_Z]);
+        mean[VIO_X] += grid->d[VIO_X][n]; 
+        mean[VIO_Y] += grid->d[VIO_Y][n]; 
+        mean[VIO_Z] += grid->d[VIO_Z][n];
+        ++count;
+        node[i]--;
+      }
+      if (node[i]-1 >= 0) {
+        node[i]--;
+        n = DEFORM_GRID_OFFSET(grid, node[VIO_X], node[VIO_Y], node[VIO_Z]);
+        mean[VIO_X] += grid->d[VIO_X][n]; 
+        mean[VIO_Y] += grid->d[VIO_Y][n]; 
+        mean[VIO_Z] += grid->d[VIO_Z][n];
+        ++count;
+        node[i]++;
+      }
+    }
+
+  }
+  else {
+
+    for(i=0; i<VIO_N_DIMENSIONS; i++) {
+      start[i] = node[i] - 1;
+      if (start[i]<0) start[i]=0;
+      end[i] = node[i] + 1;
+      if (end[i]>grid->count[i]-1) end[i] = grid->count[i]-1;
+    }
+
+    for(i0=start[VIO_X]; i0<=end[VIO_X]; i0++)
+      for(i1=start[VIO_Y]; i1<=end[VIO_Y]; i1++) {
+        n = DEFORM_GRID_OFFSET(grid, i0, i1, start[VIO_Z]);
+        for(i2=start[VIO_Z]; i2<=end[VIO_Z]; i2++, n++) 
+          if (i0 != x || i1 != y || i2 != z) {
+            mean[VIO_X] += grid->d[VIO_X][n]; 
+            mean[VIO_Y] += grid->d[VIO_Y][n]; 
+            mean[VIO_Z] += grid->d[VIO_Z][n];
+            ++count;
+          }
+      }
+  }
+
+  if (count>0) {
+    for(i=0; i<VIO_N_DIMENSIONS; i++) 
+      mean[i] /= count;
+    return(TRUE);
+  }
+  else
+    return(FALSE);
+}
+
+/* additional = current + weight*additional */
+
+void add_additional_deform_grid_to_current(Deform_grid *additional,
+                                           Deform_grid *current,
+                                           VIO_Real weight)
+{
+  int
+    i;
+  long
+    n;
+  double
+    *a, *c;
+
+  if (additional->n_nodes != current->n_nodes) {
+    print_error_and_line_num("add_additional_deform_grid_to_current: dim count error",
+                             __FILE__, __LINE__);
+  }
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    a = additional->d[i];
+    c = current->d[i];
+    for(n=0; n<additional->n_nodes; n++)
+      a[n] = c[n] + a[n]*weight;
+  }
+}
+
+/* smoothed = (1-weight)*current + weight*mean(3x3x3 neighbours of current),
+   for all nodes within the loop limits start[] and end[] (XYZ order) */
+
+void smooth_the_deform_grid(Deform_grid *smoothed,
+                            Deform_grid *current,
+                            int start[], int end[],
+                            VIO_Real weight)
+{
+  int
+    x, y, z;
+  long
+    n;
+  VIO_Real
+    mean[VIO_N_DIMENSIONS];
+
+  if (smoothed->n_nodes != current->n_nodes) {
+    print_error_and_line_num("smooth_the_deform_grid: dim count error",
+                             __FILE__, __LINE__);
+  }
+
+  for(x=start[VIO_X]; x<end[VIO_X]; x++)
+    for(y=start[VIO_Y]; y<end[VIO_Y]; y++)
+      for(z=start[VIO_Z]; z<end[VIO_Z]; z++) {
+
+        n = DEFORM_GRID_OFFSET(current, x, y, z);
+
+        if (get_deform_grid_average_of_neighbours(current, x, y, z, 2, mean)) {
+          smoothed->d[VIO_X][n] = (1.0 - weight) * current->d[VIO_X][n] + weight * mean[VIO_X];
+          smoothed->d[VIO_Y][n] = (1.0 - weight) * current->d[VIO_Y][n] + weight * mean[VIO_Y];
+          smoothed->d[VIO_Z][n] = (1.0 - weight) * current->d[VIO_Z][n] + weight * mean[VIO_Z];
+        }
+        else {
+          smoothed->d[VIO_X][n] = current->d[VIO_X][n];
+          smoothed->d[VIO_Y][n] = current->d[VIO_Y][n];
+          smoothed->d[VIO_Z][n] = current->d[VIO_Z][n];
+        }
+      }
+}
+
+/* see extrapolate_to_unestimated_nodes() in deform_support.c.
+   estimated[] holds one flag per node, in the same order as the
+   grid arrays. */
+
+void extrapolate_deform_grid_to_unestimated_nodes(Deform_grid *current,
+                                                  Deform_grid *additional,
+                                                  unsigned char *estimated,
+                                                  int start[], int end[])
+{
+  int
+    many, total, extrapolated, count,
+    i, x, y, z, i0, i1, i2,
+    start2[VIO_N_DIMENSIONS],
+    end2[VIO_N_DIMENSIONS];
+  long
+    n, n2;
+  VIO_Real
+    additional_deform[VIO_N_DIMENSIONS],
+    mean[VIO_N_DIMENSIONS];
+
+  extrapolated = many = total = 0;
+
+  if (additional->n_nodes != current->n_nodes) {
+    print_error_and_line_num("extrapolate_deform_grid_to_unestimated_nodes: dim count error",
+                             __FILE__, __LINE__);
+  }
+
+  for(x=start[VIO_X]; x<end[VIO_X]; x++)
+    for(y=start[VIO_Y]; y<end[VIO_Y]; y++)
+      for(z=start[VIO_Z]; z<end[VIO_Z]; z++) {
+
+        total++;
+        n = DEFORM_GRID_OFFSET(current, x, y, z);
+
+        if (estimated[n]) 
+          continue;
+
+        many++;
+                                /* average of the estimated additional 
+                                   deformation of the 26 neighbours */
+        start2[VIO_X] = x-1; end2[VIO_X] = x+1;
+        start2[VIO_Y] = y-1; end2[VIO_Y] = y+1;
+        start2[VIO_Z] = z-1; end2[VIO_Z] = z+1;
+        for(i=0; i<VIO_N_DIMENSIONS; i++) {
+          if (start2[i]<0) start2[i]=0;
+          if (end2[i]>current->count[i]-1) end2[i] = current->count[i]-1;
+          additional_deform[i] = 0.0;
+        }
+        count = 0;
+
+        for(i0=start2[VIO_X]; i0<=end2[VIO_X]; i0++)
+          for(i1=start2[VIO_Y]; i1<=end2[VIO_Y]; i1++) {
+            n2 = DEFORM_GRID_OFFSET(current, i0, i1, start2[VIO_Z]);
+            for(i2=start2[VIO_Z]; i2<=end2[VIO_Z]; i2++, n2++) 
+              if (estimated[n2] && n2 != n) {
+                additional_deform[VIO_X] += additional->d[VIO_X][n2];
+                additional_deform[VIO_Y] += additional->d[VIO_Y][n2];
+                additional_deform[VIO_Z] += additional->d[VIO_Z][n2];
+                ++count;
+              }
+          }
+
+        if (count>0) {
+          extrapolated++;
+          for(i=0; i<VIO_N_DIMENSIONS; i++)
+            additional_deform[i] /= 26.0;
+        }
+
+                                /* additional_deform += sw*mean + (1-sw)*current - current
+                                   with sw = 0.5 */
+
+        if (get_deform_grid_average_of_neighbours(current, x, y, z, 2, mean)) 
+          for(i=0; i<VIO_N_DIMENSIONS; i++)
+            additional_deform[i] += (mean[i] - current->d[i][n])/2.0;
+
+        for(i=0; i<VIO_N_DIMENSIONS; i++)
+          additional->d[i][n] = additional_deform[i];
+      }
+
+  print ("There were %d out of %d extrapolated (%d left) (%d extrapolated)\n",many,total,total-many, extrapolated);
+}
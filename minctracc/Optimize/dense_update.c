@@ -0,0 +1,664 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : dense_update.c
+@DESCRIPTION: whole-grid estimation of the additional deformation for
+              feature sets that need no sub-lattice (optical flow and
+              chamfer features).
+
+              When every feature is NONLIN_OPTICALFLOW or NONLIN_CHAMFER,
+              the additional deformation of a node depends only on the
+              current warp and on the feature volumes, so all nodes can
+              be estimated independently in one sweep over the grid.  The
+              sweep reads the node positions (and, for chamfer features,
+              the source surface points) from arrays computed once,
+              samples the feature volumes directly from their voxel
+              arrays, and is split across threads when the program is
+              built with OpenMP.
+
+              The estimate for each node is the same as the one computed
+              by get_optical_flow_vector(), get_chamfer_vector() and
+              get_deformation_vector_for_node() in do_nonlinear.c, except
+              that the chamfer surface points are carried through the
+              current warp by tri-linear interpolation of the grid.
+@METHOD     :
+@GLOBALS    :
+@CALLS      :
+@COPYRIGHT  :
+              Copyright 1993 Louis Collins, McConnell Brain Imaging Centre,
+              Montreal Neurological Institute, McGill University.
+              Permission to use, copy, modify, and distribute this
+              software and its documentation for any purpose and without
+              fee is hereby granted, provided that the above copyright
+              notice appear in all copies.  The author and McGill University
+              make no representations about the suitability of this
+              software for any purpose.  It is provided "as is" without
+              express or implied warranty.
+---------------------------------------------------------------------------- */
+
+#include <config.h>
+#include <volume_io.h>
+#include <arg_data.h>
+#include <Proglib.h>
+#include "constants.h"
+#include "local_macros.h"
+#include "dense_update.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define Min_deriv  0.02         /* same as in get_optical_flow_vector() */
+#define MAX_CAPTURE 3.8         /* same as in get_chamfer_vector()      */
+#define Min_chamfer_deriv 0.1
+
+void get_volume_XYZV_indices(VIO_Volume data, int xyzv[]);
+
+int point_not_masked(VIO_Volume volume,
+                     VIO_Real wx, VIO_Real wy, VIO_Real wz);
+
+
+/* cache the voxel array and the (affine) world-to-voxel mapping of a
+   volume.  Returns FALSE if the volume cannot be sampled directly. */
+
+static VIO_BOOL init_dense_sampler(Dense_sampler *sampler, VIO_Volume volume)
+{
+  VIO_Real
+    origin[VIO_MAX_DIMENSIONS],
+    voxel[VIO_MAX_DIMENSIONS];
+  int
+    i, j,
+    sizes[VIO_MAX_DIMENSIONS];
+
+  sampler->volume = volume;
+  sampler->data   = NULL;
+
+  if (volume == NULL ||
+      get_volume_n_dimensions(volume) != 3 ||
+      get_volume_data_type(volume) != DOUBLE ||
+      VOXEL_DATA(volume) == NULL)
+    return(FALSE);
+
+  get_volume_sizes(volume, sizes);
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    sampler->sizes[i] = sizes[i];
+
+  sampler->data = VOXEL_DATA(volume);
+
+  convert_world_to_voxel(volume, 0.0, 0.0, 0.0, origin);
+
+  for(j=0; j<VIO_N_DIMENSIONS; j++) {
+    convert_world_to_voxel(volume,
+                           (j==VIO_X) ? 1.0 : 0.0,
+                           (j==VIO_Y) ? 1.0 : 0.0,
+                           (j==VIO_Z) ? 1.0 : 0.0,
+                           voxel);
+    for(i=0; i<VIO_N_DIMENSIONS; i++)
+      sampler->world_to_voxel[i][j] = voxel[i] - origin[i];
+  }
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    sampler->world_to_voxel[i][3] = origin[i];
+
+  return(TRUE);
+}
+
+/* tri-linear interpolation of the volume at world coordinate
+   (wx,wy,wz), and, if gradient != NULL, of its derivatives in world
+   coordinates.  Points within half a voxel of the edge are sampled
+   from the border voxels.  Returns FALSE (with a value and gradient of
+   zero) outside of the volume.  This routine has no static storage
+   and can be called from several threads. */
+
+static VIO_BOOL dense_sample(Dense_sampler *sampler,
+                             VIO_Real wx, VIO_Real wy, VIO_Real wz,
+                             VIO_Real *value,
+                             VIO_Real gradient[])
+{
+  VIO_Real
+    v, f[3], r[3], g[3],
+    v000, v001, v010, v011, v100, v101, v110, v111;
+  int
+    i, j,
+    ind[3], off[3];
+  double
+    *row00, *row01, *row10, *row11;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+
+    v = sampler->world_to_voxel[i][0] * wx +
+        sampler->world_to_voxel[i][1] * wy +
+        sampler->world_to_voxel[i][2] * wz +
+        sampler->world_to_voxel[i][3];
+
+    if (v < -0.5 || v >= sampler->sizes[i] - 0.5) {
+      *value = 0.0;
+      if (gradient != NULL)
+        gradient[0] = gradient[1] = gradient[2] = 0.0;
+      return(FALSE);
+    }
+
+    if (sampler->sizes[i] < 2) {
+      ind[i] = 0; off[i] = 0; f[i] = 0.0;
+    }
+    else {
+      ind[i] = (int)floor(v);
+      if (ind[i] < 0)                     ind[i] = 0;
+      if (ind[i] > sampler->sizes[i] - 2) ind[i] = sampler->sizes[i] - 2;
+      off[i] = 1;
+      f[i] = v - ind[i];
+      if (f[i] < 0.0) f[i] = 0.0;
+      if (f[i] > 1.0) f[i] = 1.0;
+    }
+    r[i] = 1.0 - f[i];
+  }
+
+  row00 = sampler->data[ind[0]       ][ind[1]       ] + ind[2];
+  row01 = sampler->data[ind[0]       ][ind[1]+off[1]] + ind[2];
+  row10 = sampler->data[ind[0]+off[0]][ind[1]       ] + ind[2];
+  row11 = sampler->data[ind[0]+off[0]][ind[1]+off[1]] + ind[2];
+
+  v000 = row00[0]; v001 = row00[off[2]];
+  v010 = row01[0]; v011 = row01[off[2]];
+  v100 = row10[0]; v101 = row10[off[2]];
+  v110 = row11[0]; v111 = row11[off[2]];
+
+  *value =
+    r[0] * (r[1] * (r[2]*v000 + f[2]*v001) + f[1] * (r[2]*v010 + f[2]*v011)) +
+    f[0] * (r[1] * (r[2]*v100 + f[2]*v101) + f[1] * (r[2]*v110 + f[2]*v111));
+
+  if (gradient != NULL) {
+                                /* derivatives along the voxel axes... */
+    g[0] = r[1]*r[2]*(v100-v000) + r[1]*f[2]*(v101-v001) +
+           f[1]*r[2]*(v110-v010) + f[1]*f[2]*(v111-v011);
+    g[1] = r[0]*r[2]*(v010-v000) + r[0]*f[2]*(v011-v001) +
+           f[0]*r[2]*(v110-v100) + f[0]*f[2]*(v111-v101);
+    g[2] = r[0]*r[1]*(v001-v000) + r[0]*f[1]*(v011-v010) +
+           f[0]*r[1]*(v101-v100) + f[0]*f[1]*(v111-v110);
+
+                                /* ...mapped to world coordinates */
+    for(j=0; j<VIO_N_DIMENSIONS; j++)
+      gradient[j] = g[0] * sampler->world_to_voxel[0][j] +
+                    g[1] * sampler->world_to_voxel[1][j] +
+                    g[2] * sampler->world_to_voxel[2][j];
+  }
+
+  return(TRUE);
+}
+
+/* tri-linear interpolation of the deformation stored in grid at world
+   coordinate (wx,wy,wz).  The displacement is zero outside of the
+   grid. */
+
+static void dense_grid_displacement(Dense_update_struct *dense,
+                                    Deform_grid *grid,
+                                    VIO_Real wx, VIO_Real wy, VIO_Real wz,
+                                    VIO_Real displacement[])
+{
+  VIO_Real
+    v, w, f[3];
+  int
+    i, a, b, c,
+    ind[3], off[3];
+  long
+    node;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    displacement[i] = 0.0;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+
+    v = dense->grid_world_to_voxel[i][0] * wx +
+        dense->grid_world_to_voxel[i][1] * wy +
+        dense->grid_world_to_voxel[i][2] * wz +
+        dense->grid_world_to_voxel[i][3];
+
+    if (v < -0.5 || v >= grid->count[i] - 0.5)
+      return;
+
+    if (grid->count[i] < 2) {
+      ind[i] = 0; off[i] = 0; f[i] = 0.0;
+    }
+    else {
+      ind[i] = (int)floor(v);
+      if (ind[i] < 0)                  ind[i] = 0;
+      if (ind[i] > grid->count[i] - 2) ind[i] = grid->count[i] - 2;
+      off[i] = 1;
+      f[i] = v - ind[i];
+      if (f[i] < 0.0) f[i] = 0.0;
+      if (f[i] > 1.0) f[i] = 1.0;
+    }
+  }
+
+  for(a=0; a<=off[VIO_X]; a++)
+    for(b=0; b<=off[VIO_Y]; b++)
+      for(c=0; c<=off[VIO_Z]; c++) {
+        w = (a ? f[VIO_X] : 1.0-f[VIO_X]) *
+            (b ? f[VIO_Y] : 1.0-f[VIO_Y]) *
+            (c ? f[VIO_Z] : 1.0-f[VIO_Z]);
+        node = DEFORM_GRID_OFFSET(grid, ind[VIO_X]+a, ind[VIO_Y]+b, ind[VIO_Z]+c);
+        for(i=0; i<VIO_N_DIMENSIONS; i++)
+          displacement[i] += w * grid->d[i][node];
+      }
+}
+
+/* find, for each node, where the nearest surface of the source chamfer
+   volume is, and how much the node's estimate is to be trusted.  This
+   is the source half of get_chamfer_vector(), done once per run since
+   the data chamfer volume never changes. */
+
+static void build_dense_chamfer(Dense_update_struct *dense,
+                                Dense_chamfer *chamfer,
+                                Dense_sampler *data,
+                                VIO_General_transform *current_warp,
+                                VIO_General_transform *linear,
+                                VIO_Real capture_limit)
+{
+  VIO_Real
+    dist, zero, mag,
+    gradient[3], s[3];
+  int
+    i, x, y, z;
+  long
+    node;
+
+  chamfer->surface = new_deform_grid(current_warp);
+  ALLOC(chamfer->state,  dense->target->n_nodes);
+  ALLOC(chamfer->weight, dense->target->n_nodes);
+
+  zero = convert_voxel_to_value(data->volume, 0.0);
+
+  for(x=dense->start[VIO_X]; x<dense->end[VIO_X]; x++)
+    for(y=dense->start[VIO_Y]; y<dense->end[VIO_Y]; y++)
+      for(z=dense->start[VIO_Z]; z<dense->end[VIO_Z]; z++) {
+
+        node = DEFORM_GRID_OFFSET(dense->target, x, y, z);
+
+        for(i=VIO_X; i<=VIO_Z; i++)
+          s[i] = dense->source->d[i][node];
+
+        dense_sample(data, s[VIO_X], s[VIO_Y], s[VIO_Z], &dist, gradient);
+
+        chamfer->state[node]  = DENSE_CHAMFER_FAR;
+        chamfer->weight[node] = 0.0;
+
+        if (dist > MAX_CAPTURE*capture_limit)
+          continue;
+
+        if (dist < capture_limit)
+          chamfer->weight[node] = 1.0;
+        else
+          chamfer->weight[node] = 1.0 - ((dist - capture_limit) / (capture_limit* (MAX_CAPTURE-1.0)));
+
+        chamfer->state[node] = DENSE_CHAMFER_AT_MEAN;
+
+        mag = sqrt(gradient[VIO_X]*gradient[VIO_X] +
+                   gradient[VIO_Y]*gradient[VIO_Y] +
+                   gradient[VIO_Z]*gradient[VIO_Z]);
+
+        if (dist != zero && mag > 0.0) {
+                                /* step to the closest surface point, and
+                                   keep it in the space of the warp  */
+          for(i=VIO_X; i<=VIO_Z; i++)
+            s[i] += -1.0 * dist * gradient[i] / mag;
+
+          general_transform_point(linear, s[VIO_X], s[VIO_Y], s[VIO_Z],
+                                  &s[VIO_X], &s[VIO_Y], &s[VIO_Z]);
+
+          for(i=VIO_X; i<=VIO_Z; i++)
+            chamfer->surface->d[i][node] = s[i];
+
+          chamfer->state[node] = DENSE_CHAMFER_AT_SURFACE;
+        }
+      }
+}
+
+static void delete_dense_chamfer(Dense_chamfer *chamfer)
+{
+  delete_deform_grid(chamfer->surface);
+  FREE(chamfer->state);
+  FREE(chamfer->weight);
+}
+
+
+/* set up the whole-grid estimation for the deformation field of
+   current_warp.  Returns NULL if one of the feature volumes cannot be
+   sampled directly, in which case the node-by-node estimation has to
+   be used. */
+
+Dense_update_struct *new_dense_update(Arg_Data *globals,
+                                      VIO_General_transform *current_warp,
+                                      VIO_General_transform *linear,
+                                      Deform_grid *current,
+                                      int start[], int end[],
+                                      int ndim)
+{
+  Dense_update_struct
+    *dense;
+  VIO_Real
+    voxel[VIO_MAX_DIMENSIONS],
+    origin[VIO_MAX_DIMENSIONS],
+    steps[VIO_MAX_DIMENSIONS],
+    wx, wy, wz;
+  VIO_BOOL
+    ok;
+  int
+    i, j, x, y, z;
+  long
+    node;
+
+  ALLOC(dense, 1);
+
+  dense->number_of_features = globals->features.number_of_features;
+  dense->obj_func           = globals->features.obj_func;
+  dense->ndim               = ndim;
+  dense->model_mask         = globals->features.model_mask;
+  dense->weight             = globals->features.weight;
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    dense->start[i] = start[i];
+    dense->end[i]   = end[i];
+  }
+
+  ALLOC(dense->data,  dense->number_of_features);
+  ALLOC(dense->model, dense->number_of_features);
+
+  ok = init_dense_sampler(&(dense->threshold_model), globals->features.model[0]);
+  for(i=0; i<dense->number_of_features; i++) {
+    ok = init_dense_sampler(&(dense->data[i]),  globals->features.data[i])  && ok;
+    ok = init_dense_sampler(&(dense->model[i]), globals->features.model[i]) && ok;
+  }
+
+  if (!ok) {
+    FREE(dense->data);
+    FREE(dense->model);
+    FREE(dense);
+    return(NULL);
+  }
+
+  dense->target = new_deform_grid(current_warp);
+  dense->source = new_deform_grid(current_warp);
+  ALLOC(dense->magnitude, current->n_nodes);
+  ALLOC(dense->n_funks,   current->n_nodes);
+
+                                /* node positions never change, so
+                                   compute them once.                 */
+  for(i=0; i<VIO_MAX_DIMENSIONS; i++) voxel[i] = 0.0;
+
+  for(x=start[VIO_X]; x<end[VIO_X]; x++)
+    for(y=start[VIO_Y]; y<end[VIO_Y]; y++)
+      for(z=start[VIO_Z]; z<end[VIO_Z]; z++) {
+
+        voxel[ current->xyzv[VIO_X] ] = x;
+        voxel[ current->xyzv[VIO_Y] ] = y;
+        voxel[ current->xyzv[VIO_Z] ] = z;
+
+        node = DEFORM_GRID_OFFSET(current, x, y, z);
+
+        convert_voxel_to_world(current_warp->displacement_volume, voxel, &wx, &wy, &wz);
+        dense->target->d[VIO_X][node] = wx;
+        dense->target->d[VIO_Y][node] = wy;
+        dense->target->d[VIO_Z][node] = wz;
+
+        general_inverse_transform_point(linear, wx, wy, wz, &wx, &wy, &wz);
+        dense->source->d[VIO_X][node] = wx;
+        dense->source->d[VIO_Y][node] = wy;
+        dense->source->d[VIO_Z][node] = wz;
+      }
+
+                                /* world to (X,Y,Z) node index mapping
+                                   of the grid, to carry points through
+                                   the current warp                   */
+  convert_world_to_voxel(current_warp->displacement_volume, 0.0, 0.0, 0.0, origin);
+  for(j=0; j<VIO_N_DIMENSIONS; j++) {
+    convert_world_to_voxel(current_warp->displacement_volume,
+                           (j==VIO_X) ? 1.0 : 0.0,
+                           (j==VIO_Y) ? 1.0 : 0.0,
+                           (j==VIO_Z) ? 1.0 : 0.0,
+                           voxel);
+    for(i=0; i<VIO_N_DIMENSIONS; i++)
+      dense->grid_world_to_voxel[i][j] = voxel[ current->xyzv[i] ] - origin[ current->xyzv[i] ];
+  }
+  for(i=0; i<VIO_N_DIMENSIONS; i++)
+    dense->grid_world_to_voxel[i][3] = origin[ current->xyzv[i] ];
+
+                                /* chamfer features are captured within
+                                   a distance based on the node spacing */
+  get_volume_separations(current_warp->displacement_volume, steps);
+
+  ALLOC(dense->chamfer, dense->number_of_features);
+  for(i=0; i<dense->number_of_features; i++)
+    if (dense->obj_func[i] == NONLIN_CHAMFER)
+      build_dense_chamfer(dense, &(dense->chamfer[i]), &(dense->data[i]),
+                          current_warp, linear, steps[ current->xyzv[VIO_X] ]);
+
+  return(dense);
+}
+
+void delete_dense_update(Dense_update_struct *dense)
+{
+  int i;
+
+  for(i=0; i<dense->number_of_features; i++)
+    if (dense->obj_func[i] == NONLIN_CHAMFER)
+      delete_dense_chamfer(&(dense->chamfer[i]));
+  FREE(dense->chamfer);
+
+  delete_deform_grid(dense->target);
+  delete_deform_grid(dense->source);
+  FREE(dense->magnitude);
+  FREE(dense->n_funks);
+  FREE(dense->data);
+  FREE(dense->model);
+  FREE(dense);
+}
+
+
+/* the optical flow deformation for one feature, as in
+   get_optical_flow_vector() */
+
+static void dense_optical_flow_def(Dense_update_struct *dense,
+                                   int ff,
+                                   VIO_Real deriv_thresh,
+                                   VIO_Real source[],
+                                   VIO_Real mean_target[],
+                                   VIO_Real def[])
+{
+  VIO_Real
+    d1, d2, gradient[3];
+  int
+    i;
+
+  dense_sample(&(dense->model[ff]),
+               mean_target[VIO_X], mean_target[VIO_Y], mean_target[VIO_Z],
+               &d2, gradient);
+  dense_sample(&(dense->data[ff]),
+               source[VIO_X], source[VIO_Y], source[VIO_Z],
+               &d1, NULL);
+
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    if (fabs(gradient[i]) > deriv_thresh && (i != VIO_Z || dense->ndim==3))
+      def[i] = (d1 - d2) / gradient[i];
+    else
+      def[i] = 0.0;
+  }
+}
+
+/* the chamfer deformation for one feature, as in get_chamfer_vector():
+   the target chamfer distance at the (warped) surface point, divided by
+   its gradient. */
+
+static void dense_chamfer_def(Dense_update_struct *dense,
+                              Deform_grid *current,
+                              int ff,
+                              long node,
+                              VIO_Real mean_target[],
+                              VIO_Real def[])
+{
+  Dense_chamfer
+    *chamfer;
+  VIO_Real
+    t[3], displacement[3], gradient[3],
+    val;
+  int
+    i;
+
+  chamfer = &(dense->chamfer[ff]);
+
+  for(i=VIO_X; i<=VIO_Z; i++)
+    def[i] = 0.0;
+
+  if (chamfer->state[node] == DENSE_CHAMFER_FAR)
+    return;
+
+  if (chamfer->state[node] == DENSE_CHAMFER_AT_SURFACE) {
+    for(i=VIO_X; i<=VIO_Z; i++)
+      t[i] = chamfer->surface->d[i][node];
+    dense_grid_displacement(dense, current, t[VIO_X], t[VIO_Y], t[VIO_Z], displacement);
+    for(i=VIO_X; i<=VIO_Z; i++)
+      t[i] += displacement[i];
+  }
+  else {
+    for(i=VIO_X; i<=VIO_Z; i++)
+      t[i] = mean_target[i];
+  }
+
+  dense_sample(&(dense->model[ff]), t[VIO_X], t[VIO_Y], t[VIO_Z], &val, gradient);
+
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    if (fabs(gradient[i]) > Min_chamfer_deriv && (i != VIO_Z || dense->ndim==3))
+      def[i] = -1.0 * chamfer->weight[node] * val / gradient[i];
+    else
+      def[i] = 0.0;
+  }
+}
+
+/* estimate the deformation of a single node.  Returns TRUE if the node
+   passes the masks and threshold (and so has been estimated), in which
+   case additional, magnitude[] and n_funks[] are set for the node. */
+
+static VIO_BOOL estimate_dense_node(Dense_update_struct *dense,
+                                    Deform_grid *current,
+                                    Deform_grid *additional,
+                                    VIO_Real deriv_thresh[],
+                                    VIO_Real threshold,
+                                    int x, int y, int z)
+{
+  VIO_Real
+    warped[3], mean[3], mean_target[3], source[3],
+    def[3], feature_def[3],
+    val, mag, total_weight;
+  int
+    i, ff, ff_count, nfunks;
+  long
+    node;
+
+  node = DEFORM_GRID_OFFSET(current, x, y, z);
+
+  for(i=VIO_X; i<=VIO_Z; i++)
+    warped[i] = dense->target->d[i][node] + current->d[i][node];
+
+  ff_count = 0;
+  for(ff=0; ff<dense->number_of_features; ff++)
+    if (point_not_masked(dense->model_mask[ff], warped[VIO_X], warped[VIO_Y], warped[VIO_Z]))
+      ff_count++;
+
+  if (!ff_count)
+    return(FALSE);
+
+  if (!dense_sample(&(dense->threshold_model),
+                    warped[VIO_X], warped[VIO_Y], warped[VIO_Z], &val, NULL) ||
+      val <= threshold)
+    return(FALSE);
+
+  if (!get_deform_grid_average_of_neighbours(current, x, y, z, 1, mean))
+    return(FALSE);
+
+  for(i=VIO_X; i<=VIO_Z; i++) {
+    mean_target[i] = dense->target->d[i][node] + mean[i];
+    source[i]      = dense->source->d[i][node];
+    def[i]         = 0.0;
+  }
+
+  total_weight = 0.0;
+  nfunks       = 0;
+
+  for(ff=0; ff<dense->number_of_features; ff++) {
+
+    if (dense->obj_func[ff] == NONLIN_OPTICALFLOW)
+      dense_optical_flow_def(dense, ff, deriv_thresh[ff],
+                             source, mean_target, feature_def);
+    else                        /* must be CHAMFER */
+      dense_chamfer_def(dense, current, ff, node, mean_target, feature_def);
+
+    mag = sqrt(feature_def[VIO_X]*feature_def[VIO_X] +
+               feature_def[VIO_Y]*feature_def[VIO_Y] +
+               feature_def[VIO_Z]*feature_def[VIO_Z]);
+
+    if (mag > 0.0) {
+      nfunks++;
+      total_weight += dense->weight[ff];
+      for(i=VIO_X; i<=VIO_Z; i++)
+        def[i] += feature_def[i] * dense->weight[ff];
+    }
+  }
+
+  if (total_weight > 0.0)
+    for(i=VIO_X; i<=VIO_Z; i++)
+      def[i] /= total_weight;
+
+  for(i=VIO_X; i<=VIO_Z; i++)
+    additional->d[i][node] = def[i];
+
+  dense->magnitude[node] = sqrt(def[VIO_X]*def[VIO_X] +
+                                def[VIO_Y]*def[VIO_Y] +
+                                def[VIO_Z]*def[VIO_Z]);
+  dense->n_funks[node]   = nfunks;
+
+  return(TRUE);
+}
+
+/* estimate the additional deformation for all nodes of the grid, in
+   one sweep.  Nodes that are estimated have their flag set in
+   estimated[], their additional deformation stored in additional, and
+   their magnitude in dense->magnitude[].  Returns the number of nodes
+   estimated. */
+
+long estimate_dense_deformation(Dense_update_struct *dense,
+                                Deform_grid *current,
+                                Deform_grid *additional,
+                                unsigned char *estimated,
+                                VIO_Real threshold)
+{
+  VIO_Real
+    *deriv_thresh;
+  long
+    node,
+    nodes_done;
+  int
+    ff, x, y, z;
+
+  ALLOC(deriv_thresh, dense->number_of_features);
+  for(ff=0; ff<dense->number_of_features; ff++)
+    deriv_thresh[ff] = Min_deriv * (get_volume_real_max(dense->data[ff].volume) -
+                                    get_volume_real_min(dense->data[ff].volume));
+
+  nodes_done = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for private(y,z,node) reduction(+:nodes_done) schedule(dynamic)
+#endif
+  for(x=dense->start[VIO_X]; x<dense->end[VIO_X]; x++)
+    for(y=dense->start[VIO_Y]; y<dense->end[VIO_Y]; y++)
+      for(z=dense->start[VIO_Z]; z<dense->end[VIO_Z]; z++) {
+
+        node = DEFORM_GRID_OFFSET(current, x, y, z);
+
+        if (estimate_dense_node(dense, current, additional,
+                                deriv_thresh, threshold, x, y, z)) {
+          estimated[node] = 1;
+          nodes_done++;
+        }
+      }
+
+  FREE(deriv_thresh);
+
+  return(nodes_done);
+}
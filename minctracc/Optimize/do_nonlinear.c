@@ -369,6 +369,8 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
                                    from deformation procedures.              */
 #include "constants.h"                /* internal constant definitions             */
 #include "interpolation.h"
+#include "deform_grid.h"
+#include "dense_update.h"
 #include "super_sample_def.h"
 #include <sys/types.h>                /* for timing the deformations               */
 #include <time.h>
@@ -446,9 +448,8 @@ VIO_Real     Gcost_radius=0.0;        /* constant used in the cost function
         /* Globals used to split the input transformation into a
            linear part and a super-sampled non-linear part */
 
-VIO_General_transform *Gsuper_sampled_warp = NULL;
+Lazy_super_sampled_def *Gsuper_sampled_def = NULL;
 VIO_General_transform *Glinear_transform = NULL;
-VIO_Volume  Gsuper_sampled_vol;
 
 
         /* VIO_Volume order definition for super sampled data */
@@ -659,18 +660,24 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 {
    VIO_General_transform
       *all_until_last,                /* will contain the first (linear) part of the xform  */
-      *additional_warp,                /* storage of estimates of the needed additional warp */
-      *another_warp,                /* storage of estimates of the needed additional warp */
 
       *current_warp;                /* pointer to  the current (best) warp so far          */
    
    VIO_Volume
-      estimated_flag_vol,        /* flags indicating node estimated or not             */
-      additional_vol,                /* volume pointer to additional_warp transform        */
-      another_vol,                /* volume pointer to additional_warp transform        */
       current_vol,                /* volume pointer to current_warp transform           */
       additional_mag;                /* volume storing mag of additional_warp vectors      */
 
+   Deform_grid
+      *current_grid,                /* structure-of-arrays copy of current_warp           */
+      *additional_grid,                /* storage of estimates of the needed additional warp */
+      *another_grid;                /* storage of estimates of the needed additional warp */
+
+   unsigned char
+      *estimated_flag;                /* flags indicating node estimated or not             */
+
+   Dense_update_struct
+      *dense_update;                /* set when all nodes can be estimated at once        */
+
   
    long
       iteration_start_time,        /* variables to time each iteration                   */
@@ -680,7 +687,7 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
    int 
      num_of_dims_to_optimize,
-      additional_count[VIO_MAX_DIMENSIONS], /* size (in voxels) of  additional_vol  */
+      additional_count[VIO_MAX_DIMENSIONS], /* size (in voxels) of  current_vol  */
       mag_count[VIO_MAX_DIMENSIONS],/* size (in voxels) of  additional_mag          */
       xyzv[VIO_MAX_DIMENSIONS],        /* order of voxel indices                       */
       index[VIO_MAX_DIMENSIONS],        /* used to step through all nodes of def field  */
@@ -694,6 +701,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
       nfunks, nfunk1, nodes1,
       sub_lattice_needed;
 
+   long
+      node;                        /* offset of the current node in the grids      */
+
    VIO_Real 
 
      step_magnitude[VIO_N_DIMENSIONS],
@@ -822,27 +832,23 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
             get_n_concated_transforms(all_until_last));
    }
 
-   /* make a copy of the current warp that will be used to store the
-      additional deformation needed to optimize the current warp.  */
-   ALLOC(additional_warp,1);  
-   copy_general_transform(current_warp, additional_warp);
    current_vol = current_warp->displacement_volume;
+   get_volume_sizes(current_vol, additional_count);
+   get_volume_XYZV_indices(current_vol, xyzv);
 
-   additional_vol = additional_warp->displacement_volume;
-   get_volume_sizes(additional_vol, additional_count);
-   get_volume_XYZV_indices(additional_vol, xyzv);
-   init_the_volume_to_zero(additional_vol);    /* reset it to zero */
-
-
-   /* build a debugging volume/xform */
-   ALLOC(another_warp,1);        
-   copy_general_transform(current_warp, another_warp);
-   another_vol = another_warp->displacement_volume;
-
+   /* the warps are optimized in structure-of-arrays form: current_grid
+      holds the current warp, additional_grid stores the additional warp
+      needed to optimize it and another_grid is used for debugging and
+      smoothing.  current_warp is refreshed from current_grid at the end
+      of each iteration. */
 
-   /* set_volume_real_range(another_vol, -1.0*globals->trans_info.max_def_magnitude, globals->trans_info.max_def_magnitude ); no longer needed, since we are now using doubles for defs */
+   current_grid    = new_deform_grid(current_warp);
+   additional_grid = new_deform_grid(current_warp);
+   another_grid    = new_deform_grid(current_warp);
 
-   init_the_volume_to_zero(another_vol);
+   copy_transform_to_deform_grid(current_warp, current_grid);
+   zero_deform_grid(additional_grid);
+   zero_deform_grid(another_grid);
 
    /* build a temporary volume that will be used to store the magnitude of
       the deformation at each iteration */
@@ -850,13 +856,13 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
    for(i=0; i<3; i++)
       mag_count[i] = additional_count[ xyzv[i] ];
    set_volume_sizes(additional_mag, mag_count);
-   get_volume_separations(additional_vol, steps);
+   get_volume_separations(current_vol, steps);
    for(i=0; i<3; i++)
       mag_steps[i] = steps[ xyzv[i] ];
    set_volume_separations(additional_mag, mag_steps);
    for(i=0; i<VIO_MAX_DIMENSIONS; i++)
       voxel[i] = 0.0;
-   convert_voxel_to_world(additional_vol, 
+   convert_voxel_to_world(current_vol, 
                           voxel,
                           &(target_node[VIO_X]), &(target_node[VIO_Y]), &(target_node[VIO_Z]));
    set_volume_translation(additional_mag, voxel, target_node);
@@ -866,20 +872,12 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                 /* reset additional mag to zero */
    init_the_volume_to_zero(additional_mag);
 
-   /* build a volume to flag all voxels where the deformation has been
-      estimated */
-   estimated_flag_vol = create_volume(3, my_XYZ_dim_names, NC_BYTE, FALSE, 0.0, 0.0);
-   for(i=0; i<3; i++)
-      mag_count[i] = additional_count[ xyzv[i] ];
-   set_volume_sizes(estimated_flag_vol, mag_count);
-   set_volume_separations(estimated_flag_vol, mag_steps);
-   set_volume_translation(estimated_flag_vol, voxel, target_node);
-   alloc_volume_data(estimated_flag_vol);
-   set_volume_real_range(estimated_flag_vol, 0.0, 1.0);
+   /* flag all nodes where the deformation has been estimated */
+   ALLOC(estimated_flag, current_grid->n_nodes);
 
    /* test simplex size against size of data voxels */
 
-   get_volume_separations(additional_vol, steps);
+   get_volume_separations(current_vol, steps);
    get_volume_separations(Gglobals->features.model[0], steps_data);
    
    if (steps_data[0]!=0.0) {
@@ -906,7 +904,7 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
                                    step through the deformation field,
                                    node by node.                        */
 
-  get_voxel_spatial_loop_limits(additional_vol, 
+  get_voxel_spatial_loop_limits(current_vol, 
                                 start, end);
 
                                 /* build a super-sampled version of the
@@ -914,10 +912,9 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
   if (globals->trans_info.use_super>0) {
 
-    globals->trans_info.use_super = 2; /* force super sampling to 2
-                                          until volume_io bug
-                                          evalue_value is worked
-                                          out */
+    if (globals->flags.debug) 
+      print ("Super-sampling the deformation field by %d\n",
+             globals->trans_info.use_super);
     
 
     if (globals->flags.debug) {
@@ -952,45 +949,40 @@ VIO_Status do_non_linear_optimization(Arg_Data *globals)
 
 
 
-    ALLOC(Gsuper_sampled_warp,1);
-    create_super_sampled_data_volumes(current_warp, 
-                                      Gsuper_sampled_warp,
-                                      globals->trans_info.use_super);
-    Gsuper_sampled_vol = Gsuper_sampled_warp->displacement_volume;
-
-
+    Gsuper_sampled_def = new_lazy_super_sampled_def(current_warp, 
+                                                     current_grid,
+                                                     globals->trans_info.use_super,
+                                                     LAZY_SUPER_MAX_TILES);
 
     if (globals->flags.debug) {
+      print ("After super sampling (computed on demand):\n");
+      print ("super sizes: %7d  %7d  %7d\n",
+             Gsuper_sampled_def->fine_count[VIO_X],
+             Gsuper_sampled_def->fine_count[VIO_Y],
+             Gsuper_sampled_def->fine_count[VIO_Z]);
+      print ("super tiles: %7d  (at most %d resident)\n",
+             Gsuper_sampled_def->total_tiles, Gsuper_sampled_def->max_tiles);
+    }
+  }
 
+                                /* when only optical flow and chamfer
+                                   features are used (and smoothing is
+                                   global), the nodes do not depend on each
+                                   other during estimation, so estimate
+                                   them all in one sweep                 */
+  dense_update = NULL;
 
-      for(i=0; i<VIO_MAX_DIMENSIONS; i++) {
-        voxel[i]=0.0;
-        debug_sizes[i]=0.0;
-        debug_steps[i]=0.0;
-        st[i]=0.0;
-        wst[i]=0.0;
-      }
+  if (!globals->trans_info.use_local_smoothing && !sub_lattice_needed) {
 
-      convert_voxel_to_world(Gsuper_sampled_warp->displacement_volume, 
-                             voxel,
-                             &wx, &wy, &wz);
-      get_volume_sizes(Gsuper_sampled_warp->displacement_volume, 
-                       debug_sizes);
-      get_volume_separations(Gsuper_sampled_warp->displacement_volume, 
-                             debug_steps);
-      get_volume_starts(Gsuper_sampled_warp->displacement_volume, st);
-      get_volume_translation(Gsuper_sampled_warp->displacement_volume, voxel, wst);
-      print ("After super sampling:\n");
-      print ("super sizes: %7d  %7d  %7d  %7d  %7d\n",
-             debug_sizes[0],debug_sizes[1],debug_sizes[2],debug_sizes[3],debug_sizes[4]);
-      print ("super steps: %7.2f  %7.2f  %7.2f  %7.2f  %7.2f\n",
-             debug_steps[0],debug_steps[1],debug_steps[2],debug_steps[3],debug_steps[4]);
-      print ("super start: %7.2f  %7.2f  %7.2f  %7.2f  %7.2f\n",
-              st[0],st[1],st[2],st[3],st[4]);
-      print ("vol trans  : %7.2f  %7.2f  %7.2f  %7.2f  %7.2f\n",
-              wst[0],wst[1],wst[2],wst[3],wst[4]);
-      print ("v[0,0,0] ->: %7.2f  %7.2f  %7.2f  \n", wx, wy, wz);
+    dense_update = new_dense_update(globals, current_warp, Glinear_transform,
+                                    current_grid, start, end,
+                                    num_of_dims_to_optimize);
 
+    if (globals->flags.debug) {
+      if (dense_update != NULL)
+        print ("Deformations will be estimated over the whole grid at once\n");
+      else
+        print ("Feature volumes are not DOUBLE, deformations will be estimated node by node\n");
     }
   }
 
@@ -1148,18 +1140,16 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
        if (globals->trans_info.use_super>0) 
          {
            
-           temp_start_time = time(NULL);
-           
-           interpolate_super_sampled_data_by2(current_warp,
-                                          Gsuper_sampled_warp);
-           if (globals->flags.debug){
-             report_time(temp_start_time, "TIME:Interpolating super-sampled data");
-             }
+           /* the super-sampled field is rebuilt lazily from the
+              current warp, as sub-lattice points are looked up */
+
+           flush_lazy_super_sampled_def(Gsuper_sampled_def);
 
          }  
 
        print("Initializing deformation grid to 0...\n");
-       init_the_volume_to_zero(estimated_flag_vol);
+       for(node=0; node<current_grid->n_nodes; node++) 
+         estimated_flag[node] = 0;
 
        print("Iteration %2d of %2d\n",iters+1, iteration_limit);
 
@@ -1198,6 +1188,45 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
        
        for(i=0; i<VIO_MAX_DIMENSIONS; i++) index[i]=0;
        
+       if (dense_update != NULL) 
+         {
+           /* estimate all nodes at once, then gather the stats */
+
+           estimate_dense_deformation(dense_update,
+                                      current_grid, additional_grid,
+                                      estimated_flag, threshold2);
+
+           for(index[xyzv[VIO_X]]=start[VIO_X]; index[xyzv[VIO_X]]<end[VIO_X]; index[xyzv[VIO_X]]++) 
+             for(index[xyzv[VIO_Y]]=start[VIO_Y]; index[xyzv[VIO_Y]]<end[VIO_Y]; index[xyzv[VIO_Y]]++) 
+               for(index[xyzv[VIO_Z]]=start[VIO_Z]; index[xyzv[VIO_Z]]<end[VIO_Z]; index[xyzv[VIO_Z]]++) 
+                 {
+                   nodes_seen++;
+
+                   node = DEFORM_GRID_OFFSET(current_grid, 
+                                             index[xyzv[VIO_X]], index[xyzv[VIO_Y]], index[xyzv[VIO_Z]]);
+
+                   if (estimated_flag[node]) 
+                     {
+                       result = dense_update->magnitude[node];
+                       nfunks = dense_update->n_funks[node];
+
+                       set_volume_real_value(additional_mag,
+                                             index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
+                                             result);
+
+                       if (fabs(result) > 0.95*steps[xyzv[VIO_X]]) over++;
+
+                       nfunk_total += nfunks;
+                       nodes_done++;
+
+                       tally_stats(&stat_def_mag,   result);
+                       tally_stats(&stat_num_funks, nfunks);
+                     }
+                 }
+         }
+       else
+         {
+
        /* step index[] through all the nodes in the deformation field. */
        
 
@@ -1222,10 +1251,11 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
                                           voxel,
                                           &(target_node[VIO_X]), &(target_node[VIO_Y]), &(target_node[VIO_Z]));
 
-                   for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) 
-                     current_def_vector[ index[ xyzv[VIO_Z+1] ] ] = 
-                     get_volume_real_value(current_vol,
-                                           index[0],index[1],index[2],index[3],index[4]);
+                   node = DEFORM_GRID_OFFSET(current_grid, 
+                                             index[xyzv[VIO_X]], index[xyzv[VIO_Y]], index[xyzv[VIO_Z]]);
+
+                   for(i=VIO_X; i<=VIO_Z; i++) 
+                     current_def_vector[i] = current_grid->d[i][node];
 
                                         /* add the warp to get the target 
                                            lattice position in world coords */
@@ -1249,15 +1279,16 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
                                          /* now get the mean warped position of 
                                             the target's neighbours */
                      
-                     index[ xyzv[VIO_Z+1] ] = 0;
-                     if (get_average_warp_of_neighbours(current_warp,
-                                                        index, mean_target)) {
+                     if (get_deform_grid_average_of_neighbours(current_grid,
+                                                               index[xyzv[VIO_X]], 
+                                                               index[xyzv[VIO_Y]], 
+                                                               index[xyzv[VIO_Z]],
+                                                               1, mean_vector)) {
                        
-                                        /* what is the offset to the mean_target? */
+                                        /* mean_vector is the offset to the mean_target */
                      
-                       // this is a tad dumb is it not?
                        for(i=VIO_X; i<=VIO_Z; i++)
-                         mean_vector[i] = mean_target[i] - target_node[i];
+                         mean_target[i] = target_node[i] + mean_vector[i];
                        
                                         /* get the targets homolog in the
                                            world coord system of the source
@@ -1307,25 +1338,19 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
                                                                   another_vector,
                                                                   voxel_displacement);
 
-                                            /* Remember that I can't modify current_vol just
-                                             yet, so I have to set additional_vol to a value,
-                                             that when added to current_vol (below) I will
+                                            /* Remember that I can't modify current_grid just
+                                             yet, so I have to set additional_grid to a value,
+                                             that when added to current_grid (below) I will
                                              have the correct result!  */
 
                                for(i=VIO_X; i<=VIO_Z; i++)
                                  result_def_vector[ i ] -= current_def_vector[ i ];
                                
 
-                               for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++)  
+                               for(i=VIO_X; i<=VIO_Z; i++) 
                                  {
-                                   set_volume_real_value(additional_vol,
-                                                         index[0],index[1],index[2],
-                                                         index[3],index[4],
-                                                         result_def_vector[index[ xyzv[VIO_Z+1]]]);
-                                   set_volume_real_value(another_vol,
-                                                         index[0],index[1],index[2],
-                                                         index[3],index[4],
-                                                         another_vector[ index[ xyzv[VIO_Z+1] ] ]);
+                                   additional_grid->d[i][node] = result_def_vector[i];
+                                   another_grid->d[i][node]    = another_vector[i];
                                  }
 
                              }
@@ -1334,11 +1359,8 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
                                            actually be done after all nodes 
                                            have been estimated  */
                                
-                               for(index[xyzv[VIO_Z+1]]=start[VIO_Z+1]; index[xyzv[VIO_Z+1]]<end[VIO_Z+1]; index[xyzv[VIO_Z+1]]++) 
-                                 set_volume_real_value(additional_vol,
-                                                       index[0],index[1],index[2],
-                                                       index[3],index[4],
-                                                       def_vector[ index[ xyzv[VIO_Z+1] ] ]);
+                               for(i=VIO_X; i<=VIO_Z; i++) 
+                                 additional_grid->d[i][node] = def_vector[i];
 
                              }
                                          /* store the def magnitude */
@@ -1347,9 +1369,7 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
                                                  index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
                                                  result);
                                          /* set the 'node estimated' flag */
-                           set_volume_real_value(estimated_flag_vol,
-                                                 index[xyzv[VIO_X]],index[xyzv[VIO_Y]],index[xyzv[VIO_Z]],0,0,
-                                                 1.0);
+                           estimated_flag[node] = 1;
                            
                                          /* tally up some statistics for this iteration */
                            if (fabs(result) > 0.95*steps[xyzv[VIO_X]]) over++;
@@ -1364,7 +1384,7 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
                            
                          } /* of else (result<0) */
 
-                     } /* if get_average_warp_of_neighbours */
+                     } /* if get_deform_grid_average_of_neighbours */
             
                    } /* point not masked and val in volume2 > threshold 2 */
           
@@ -1387,6 +1407,8 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
       
          } /* forless on X index */
 
+         } /* else estimate node by node */
+
        if (globals->flags.debug) 
          {
            
@@ -1458,16 +1480,17 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
        if (Gglobals->trans_info.use_local_smoothing) 
          {
            /* extrapolate (and smooth) the newly estimated deformation vectors
-              (stored in additional vol) to un-estimated nodes, leaving the
-              extrapolated result in additional_vol (note that it still has to
+              (stored in additional_grid) to un-estimated nodes, leaving the
+              extrapolated result in additional_grid (note that it still has to
               be added to current */
 
 
            temp_start_time = time(NULL);
            
-           extrapolate_to_unestimated_nodes(current_warp,
-                                            additional_warp,
-                                            estimated_flag_vol);
+           extrapolate_deform_grid_to_unestimated_nodes(current_grid,
+                                                        additional_grid,
+                                                        estimated_flag,
+                                                        start, end);
            if (globals->flags.debug) 
              report_time(temp_start_time, "TIME:Extrapolating the current warp");
            
@@ -1476,9 +1499,9 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
            
            temp_start_time = time(NULL);
            
-           add_additional_warp_to_current(current_warp,
-                                          additional_warp,
-                                          1.0);
+           add_additional_deform_grid_to_current(current_grid,
+                                                 additional_grid,
+                                                 1.0);
            if (globals->flags.debug) 
              report_time(temp_start_time, "TIME:Adding additional to current");
 
@@ -1491,9 +1514,9 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
               and then apply global  smoothing */
            
            temp_start_time = time(NULL);
-           add_additional_warp_to_current(additional_warp,
-                                          current_warp,
-                                           iteration_weight);
+           add_additional_deform_grid_to_current(additional_grid,
+                                                 current_grid,
+                                                 iteration_weight);
            if (globals->flags.debug) 
              report_time(temp_start_time, "TIME:Adding additional to current");
        
@@ -1505,13 +1528,13 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
 
            temp_start_time = time(NULL);
            
-           smooth_the_warp(another_warp, /* try smoothing twice to get better def fields? or we could smooth once, and then use Pierrick's nlmeans*/
-                           additional_warp,
-                            additional_mag, -1.0);
+           smooth_the_deform_grid(another_grid, /* try smoothing twice to get better def fields? or we could smooth once, and then use Pierrick's nlmeans*/
+                                  additional_grid,
+                                  start, end, smoothing_weight);
 
-           smooth_the_warp(current_warp,   
-                           another_warp,
-                            additional_mag, -1.0);
+           smooth_the_deform_grid(current_grid,   
+                                  another_grid,
+                                  start, end, smoothing_weight);
            
            if (globals->flags.debug) 
               report_time(temp_start_time, "TIME:Smoothing the current warp");
@@ -1522,8 +1545,12 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
        
                                /* reset the next iteration's warp. */
 
-       init_the_volume_to_zero(additional_vol);
+       zero_deform_grid(additional_grid);
        init_the_volume_to_zero(additional_mag);
+
+                               /* and bring current_warp up to date */
+
+       copy_deform_grid_to_transform(current_grid, current_warp);
  
  
        if (globals->flags.debug && 
@@ -1601,15 +1628,18 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
 
    if (globals->trans_info.use_super>0) 
      {
-       delete_general_transform(Gsuper_sampled_warp);
-       FREE(Gsuper_sampled_warp);
+       if (globals->flags.debug) 
+         print ("super-sampled tiles computed: %ld\n", Gsuper_sampled_def->n_filled);
+       delete_lazy_super_sampled_def(Gsuper_sampled_def);
      }
 
-   (void)delete_general_transform(additional_warp);
-   FREE(additional_warp); 
+   if (dense_update != NULL)
+     delete_dense_update(dense_update);
 
-   (void)delete_general_transform(another_warp);
-   FREE(another_warp); 
+   delete_deform_grid(current_grid);
+   delete_deform_grid(additional_grid);
+   delete_deform_grid(another_grid);
+   FREE(estimated_flag);
 
   
    if (Gglobals->features.number_of_features>0) 
@@ -1623,7 +1653,6 @@ print ("inside do_nonlinear: thresh: %10.4f %10.4f\n",globals->threshold[0],glob
    FREE(all_until_last);
    
    delete_volume(additional_mag);
-   delete_volume(estimated_flag_vol);
 
    FREE(TX );
    FREE(TY );
@@ -0,0 +1,246 @@
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : lbfgs.c
+@DESCRIPTION: limited memory BFGS minimization, for the linear registration
+              when the gradient of the objective function is available.
+@METHOD     : Nocedal & Wright, Numerical Optimization (1999), algorithm 9.1
+              (two loop recursion) with a backtracking line search on the
+              Armijo condition.
+@GLOBALS    : none
+@CALLS      : internal_volume_io library routines/macros
+@COPYRIGHT  :
+              Copyright 1993 Louis Collins, McConnell Brain Imaging Centre,
+              Montreal Neurological Institute, McGill University.
+              Permission to use, copy, modify, and distribute this
+              software and its documentation for any purpose and without
+              fee is hereby granted, provided that the above copyright
+              notice appear in all copies.  The author and McGill University
+              make no representations about the suitability of this
+              software for any purpose.  It is provided "as is" without
+              express or implied warranty.
+
+@CREATED    : 
+@MODIFIED   : 
+
+   lbfgs_minimize() is the only public function:
+
+   lbfgs_minimize(
+      int               n_parameters,     the number of free parameters
+      VIO_Real          parameters[],     the starting guess, replaced by
+                                          the minimum found
+      VIO_Real          initial_step,     the length of the first step,
+                                          along the steepest descent
+      lbfgs_function    function,         the objective function, which
+                                          returns its value and gradient
+      void              *function_data,   passed to the objective function
+      VIO_Real          tolerance,        the stopping tolerance
+      int               max_evaluations,  the maximum number of calls to
+                                          the objective function
+      VIO_Real          *value )          the value at the minimum found
+
+   It returns the number of calls made to the objective function.
+
+   The optimization stops when an iteration improves the objective
+   function by less than `tolerance', relative to its value, which is
+   the same test as the one used by perform_amoeba(), so that -tol has
+   the same meaning for both.
+---------------------------------------------------------------------------- */
+
+#include <volume_io.h>
+#include <lbfgs.h>
+
+#define  LBFGS_MEMORY      5       /* number of correction pairs kept     */
+#define  ARMIJO_C1         1e-4    /* sufficient decrease constant        */
+#define  MIN_BACKTRACK     0.1     /* bounds on the step reduction of     */
+#define  MAX_BACKTRACK     0.5     /*   one line search iteration         */
+#define  MAX_LINE_SEARCH   20
+
+static  VIO_Real  dot_product(
+    int       n,
+    VIO_Real  a[],
+    VIO_Real  b[] )
+{
+    int       i;
+    VIO_Real  sum;
+
+    sum = 0.0;
+    for(i=0; i<n; i++)
+        sum += a[i] * b[i];
+
+    return( sum );
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : lbfgs_direction
+@INPUT      : n, gradient
+              s, y, rho - the last n_pairs correction pairs, the oldest at
+                 index first, in a circular buffer of LBFGS_MEMORY
+@OUTPUT     : direction - the search direction, -H.gradient
+@RETURNS    : 
+@DESCRIPTION: two loop recursion, with the initial Hessian scaled by
+              s'y/y'y of the most recent pair.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static  void  lbfgs_direction(
+    int       n,
+    VIO_Real  gradient[],
+    VIO_Real  **s,
+    VIO_Real  **y,
+    VIO_Real  rho[],
+    int       first,
+    int       n_pairs,
+    VIO_Real  direction[] )
+{
+    int       i, k, m;
+    VIO_Real  alpha[LBFGS_MEMORY], beta, gamma;
+
+    for(i=0; i<n; i++)
+        direction[i] = -gradient[i];
+
+    for(k=n_pairs-1; k>=0; k--) {
+        m = (first + k) % LBFGS_MEMORY;
+        alpha[k] = rho[m] * dot_product(n, s[m], direction);
+        for(i=0; i<n; i++)
+            direction[i] -= alpha[k] * y[m][i];
+    }
+
+    if (n_pairs > 0) {
+        m = (first + n_pairs - 1) % LBFGS_MEMORY;
+        gamma = dot_product(n, s[m], y[m]) / dot_product(n, y[m], y[m]);
+        for(i=0; i<n; i++)
+            direction[i] *= gamma;
+    }
+
+    for(k=0; k<n_pairs; k++) {
+        m = (first + k) % LBFGS_MEMORY;
+        beta = rho[m] * dot_product(n, y[m], direction);
+        for(i=0; i<n; i++)
+            direction[i] += (alpha[k] - beta) * s[m][i];
+    }
+}
+
+int  lbfgs_minimize(
+    int               n_parameters,
+    VIO_Real          parameters[],
+    VIO_Real          initial_step,
+    lbfgs_function    function,
+    void              *function_data,
+    VIO_Real          tolerance,
+    int               max_evaluations,
+    VIO_Real          *value )
+{
+    int       i, n, n_evals, first, n_pairs, m, iter;
+    VIO_Real  **s, **y, rho[LBFGS_MEMORY];
+    VIO_Real  *gradient, *direction, *x_new, *gradient_new;
+    VIO_Real  f, f_new, slope, step, new_step, length, sy, yy;
+    VIO_BOOL  accepted, done;
+
+    n = n_parameters;
+
+    ALLOC2D( s, LBFGS_MEMORY, n );
+    ALLOC2D( y, LBFGS_MEMORY, n );
+    ALLOC( gradient, n );
+    ALLOC( gradient_new, n );
+    ALLOC( direction, n );
+    ALLOC( x_new, n );
+
+    f = (*function) ( function_data, parameters, gradient );
+    n_evals = 1;
+
+    first = 0;
+    n_pairs = 0;
+    done = FALSE;
+
+    while( !done && n_evals < max_evaluations )
+    {
+        lbfgs_direction( n, gradient, s, y, rho, first, n_pairs, direction );
+        slope = dot_product( n, direction, gradient );
+
+        if (slope >= 0.0) {          /* not a descent direction: restart */
+            n_pairs = 0;
+            for(i=0; i<n; i++)
+                direction[i] = -gradient[i];
+            slope = dot_product( n, direction, gradient );
+        }
+
+        length = sqrt( dot_product( n, direction, direction ) );
+        if (length == 0.0)
+            break;
+
+                                /* without curvature information, take
+                                   a step of the requested length */
+        step = (n_pairs == 0) ? initial_step / length : 1.0;
+
+        accepted = FALSE;
+        for(iter=0; iter<MAX_LINE_SEARCH && n_evals<max_evaluations; iter++)
+        {
+            for(i=0; i<n; i++)
+                x_new[i] = parameters[i] + step * direction[i];
+
+            f_new = (*function) ( function_data, x_new, gradient_new );
+            ++n_evals;
+
+            if (f_new <= f + ARMIJO_C1 * step * slope) {
+                accepted = TRUE;
+                break;
+            }
+                                /* minimum of the quadratic through f,
+                                   slope and f_new, within bounds */
+            new_step = -slope * step * step / (2.0 * (f_new - f - slope * step));
+            if (new_step < MIN_BACKTRACK * step || new_step != new_step)
+                new_step = MIN_BACKTRACK * step;
+            if (new_step > MAX_BACKTRACK * step)
+                new_step = MAX_BACKTRACK * step;
+            step = new_step;
+        }
+
+        if (!accepted) {
+            if (n_pairs == 0)   /* even steepest descent fails */
+                break;
+            n_pairs = 0;        /* try again from steepest descent */
+            continue;
+        }
+
+        if (2.0 * fabs(f - f_new) <= tolerance * (fabs(f) + fabs(f_new)))
+            done = TRUE;
+
+                                /* keep the correction pair, if it has
+                                   positive curvature (into the slot of
+                                   the oldest one when the memory is full) */
+        sy = 0.0;
+        yy = 0.0;
+        for(i=0; i<n; i++) {
+            sy += (x_new[i] - parameters[i]) * (gradient_new[i] - gradient[i]);
+            yy += (gradient_new[i] - gradient[i]) * (gradient_new[i] - gradient[i]);
+        }
+        if (sy > 1e-10 * yy && sy > 0.0) {
+            m = (first + n_pairs) % LBFGS_MEMORY;
+            for(i=0; i<n; i++) {
+                s[m][i] = x_new[i] - parameters[i];
+                y[m][i] = gradient_new[i] - gradient[i];
+            }
+            rho[m] = 1.0 / sy;
+            if (n_pairs < LBFGS_MEMORY)
+                ++n_pairs;
+            else
+                first = (first + 1) % LBFGS_MEMORY;
+        }
+
+        for(i=0; i<n; i++) {
+            parameters[i] = x_new[i];
+            gradient[i] = gradient_new[i];
+        }
+        f = f_new;
+    }
+
+    *value = f;
+
+    FREE2D( s );
+    FREE2D( y );
+    FREE( gradient );
+    FREE( gradient_new );
+    FREE( direction );
+    FREE( x_new );
+
+    return( n_evals );
+}
@@ -92,6 +92,9 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include "vox_space.h"
 #include "objectives.h"
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 extern Arg_Data main_args;
 
@@ -107,45 +110,151 @@ int voxel_point_not_masked(VIO_Volume volume,
 
                                 
 
+/* The mutual information is computed from histograms of bin indices,
+   not of intensities.  Each volume is binned once: the real value of
+   each voxel is mapped linearly onto 0..groups-1, between the volume's
+   real minimum and maximum, and kept in a compact array of bin
+   indices (any data type, any number of groups up to MI_MAX_GROUPS).
+
+   The partial volume interpolation weights are computed on a grid of
+   MI_PV_STEPS steps per voxel, so that the weights of the 8 corners
+   are integers adding up to MI_PV_ONE.  The histograms are then sums
+   of integers, which are exact, whatever the order in which they are
+   accumulated. */
+
+#define MI_MAX_GROUPS  65536
+#define MI_PV_STEPS    32
+#define MI_PV_ONE      (MI_PV_STEPS*MI_PV_STEPS*MI_PV_STEPS)
+
+typedef struct {
+  VIO_Volume     volume;        /* the volume binned                   */
+  int            groups;        /* the number of bins                  */
+  int            sizes[VIO_N_DIMENSIONS];
+  unsigned short *bin;          /* bin index of each voxel             */
+  VIO_Real       *bin_value;    /* real value represented by each bin  */
+} Mi_bins;
+
+static Mi_bins  mi_bins[2] = { {NULL, 0, {0,0,0}, NULL, NULL},
+                               {NULL, 0, {0,0,0}, NULL, NULL} };
+
+static void free_bins(Mi_bins *bins)
+{
+  if (bins->bin != NULL) {
+    FREE(bins->bin);
+    FREE(bins->bin_value);
+  }
+  bins->volume    = NULL;
+  bins->bin       = NULL;
+  bins->bin_value = NULL;
+}
+
+static VIO_BOOL build_bins(Mi_bins *bins, VIO_Volume volume, int groups)
+{
+  VIO_Real
+    min, max, scale;
+  long
+    n;
+  int
+    i,j,k,b;
+
+  if (get_volume_n_dimensions(volume) != 3) {
+    print_error_and_line_num("Volume must have 3 dimensions for -mi\n",
+                             __FILE__, __LINE__);
+    return(FALSE);
+  }
+  if (groups < 2 || groups > MI_MAX_GROUPS) {
+    print_error_and_line_num("-groups must be between 2 and %d for -mi\n",
+                             __FILE__, __LINE__, MI_MAX_GROUPS);
+    return(FALSE);
+  }
+
+  free_bins(bins);
+
+  bins->volume = volume;
+  bins->groups = groups;
+  get_volume_sizes(volume, bins->sizes);
+  get_volume_minimum_maximum_real_value(volume, &min, &max);
+
+  scale = (max > min) ? (groups-1) / (max - min) : 0.0;
+
+  ALLOC(bins->bin_value, groups);
+  for(b=0; b<groups; b++)
+    bins->bin_value[b] = (scale > 0.0) ? min + b / scale : min;
+
+  n = (long)bins->sizes[0] * bins->sizes[1] * bins->sizes[2];
+  ALLOC(bins->bin, n);
+
+#ifdef _OPENMP
+#pragma omp parallel for private(j,k,b)
+#endif
+  for(i=0; i<bins->sizes[0]; i++)
+    for(j=0; j<bins->sizes[1]; j++)
+      for(k=0; k<bins->sizes[2]; k++) {
+        b = ROUND( (get_volume_real_value(volume,i,j,k,0,0) - min) * scale );
+        if (b < 0)       b = 0;
+        if (b >= groups) b = groups-1;
+        bins->bin[((long)i*bins->sizes[1] + j)*bins->sizes[2] + k] = 
+          (unsigned short)b;
+      }
+
+  return(TRUE);
+}
+
+/* return the bins of a volume, building them if needed */
+
+static Mi_bins *get_bins(VIO_Volume volume, int groups)
+{
+  int i;
+
+  for(i=0; i<2; i++)
+    if (mi_bins[i].volume == volume && mi_bins[i].groups == groups)
+      return(&mi_bins[i]);
+
+  i = (mi_bins[0].volume == NULL) ? 0 : 1;
+  if (!build_bins(&mi_bins[i], volume, groups))
+    exit(EXIT_FAILURE);
+
+  return(&mi_bins[i]);
+}
+
 /* ----------------------------- MNI Header -----------------------------------
-@NAME       : partial_volume_interpolation
-@INPUT      : volume           - pointer to volume data
+@NAME       : partial_volume_bins
+@INPUT      : bins             - the binned volume
               coord[]          - voxel-coordinates of point to interpolate
-@OUTPUT     : intensity_vals[] - array of 8 voxel values from corners of
+@OUTPUT     : index[]          - bin indices of the 8 corners of the
                                  interpolation cube
-              intensity_vals[] - array of 8 fractional used used to interpolate
-                                 the desired value.
-              result           - the interpolated TRUE value.
-@RETURNS    : TRUE if wx, wy,wz is within the volume and can be interpolated, 
-              FALSE otherwise.
+              weight[]         - integer weight of each corner, the 8 adding
+                                 up to MI_PV_ONE
+              result           - the interpolated value of the bins
+@RETURNS    : TRUE if the coordinate is within the volume and can be 
+              interpolated, FALSE otherwise.
 @DESCRIPTION: procedure to compute the partial volume interpolation required
               to evaluate the mutual information objective function.
 @METHOD     : 
 @GLOBALS    : 
 @CALLS      : 
-@CREATED    : Tue Mar 12 09:37:44 MET 1996
+@CREATED    : Tue Mar 12 09:37:44 MET 1996 (as partial_volume_interpolation)
 @MODIFIED   : 
 ---------------------------------------------------------------------------- */
-VIO_BOOL partial_volume_interpolation(VIO_Volume data,
-                                            VIO_Real coord[],
-                                            VIO_Real intensity_vals[],
-                                            VIO_Real fractional_vals[],
-                                            VIO_Real *result)
+static VIO_BOOL partial_volume_bins(Mi_bins *bins,
+                                    VIO_Real coord[],
+                                    int index[],
+                                    long weight[],
+                                    VIO_Real *result)
 {
-  long ind0, ind1, ind2, max[3];
-  int sizes[3];
-  static double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  long 
+    ind0, ind1, ind2, 
+    offset, d0, d1;
+  long 
+    f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  int 
+    i;
   
   /* Check that the coordinate is inside the volume */
   
-  get_volume_sizes(data, sizes);
-  max[0]=sizes[0];
-  max[1]=sizes[1];
-  max[2]=sizes[2];
-  
-  if (( coord[VIO_X]  < 0) || ( coord[VIO_X]  >= max[0]-1) ||
-      ( coord[VIO_Y]  < 0) || ( coord[VIO_Y]  >= max[1]-1) ||
-      ( coord[VIO_Z]  < 0) || ( coord[VIO_Z]  >= max[2]-1)) {
+  if (( coord[VIO_X]  < 0) || ( coord[VIO_X]  >= bins->sizes[0]-1) ||
+      ( coord[VIO_Y]  < 0) || ( coord[VIO_Y]  >= bins->sizes[1]-1) ||
+      ( coord[VIO_Z]  < 0) || ( coord[VIO_Z]  >= bins->sizes[2]-1)) {
     
     return(FALSE);
   }
@@ -154,56 +263,49 @@ VIO_BOOL partial_volume_interpolation(VIO_Volume data,
   ind0 = (long)  coord[VIO_X] ;
   ind1 = (long)  coord[VIO_Y] ;
   ind2 = (long)  coord[VIO_Z] ;
-  if (ind0 >= max[0]-1) ind0 = max[0]-1;
-  if (ind1 >= max[1]-1) ind1 = max[1]-1;
-  if (ind2 >= max[2]-1) ind2 = max[2]-1;
-  
-  /* Get the relevant voxels */
-  GET_VOXEL_3D( intensity_vals[0] ,  data, ind0  , ind1  , ind2   ); 
-  GET_VOXEL_3D( intensity_vals[1] ,  data, ind0  , ind1  , ind2+1 ); 
-  GET_VOXEL_3D( intensity_vals[2] ,  data, ind0  , ind1+1, ind2   ); 
-  GET_VOXEL_3D( intensity_vals[3] ,  data, ind0  , ind1+1, ind2+1 ); 
-  GET_VOXEL_3D( intensity_vals[4] ,  data, ind0+1, ind1  , ind2   ); 
-  GET_VOXEL_3D( intensity_vals[5] ,  data, ind0+1, ind1  , ind2+1 ); 
-  GET_VOXEL_3D( intensity_vals[6] ,  data, ind0+1, ind1+1, ind2   ); 
-  GET_VOXEL_3D( intensity_vals[7] ,  data, ind0+1, ind1+1, ind2+1 ); 
-
-  /* Get the fraction parts */
-  f0 =  coord[VIO_X]  - ind0;
-  f1 =  coord[VIO_Y]  - ind1;
-  f2 =  coord[VIO_Z]  - ind2;
-  r0 = 1.0 - f0;
-  r1 = 1.0 - f1;
-  r2 = 1.0 - f2;
+
+  /* Get the relevant bins */
+  d1 = bins->sizes[2];
+  d0 = bins->sizes[1] * d1;
+  offset = ind0*d0 + ind1*d1 + ind2;
+
+  index[0] = bins->bin[ offset           ];
+  index[1] = bins->bin[ offset        +1 ];
+  index[2] = bins->bin[ offset     +d1   ];
+  index[3] = bins->bin[ offset     +d1+1 ];
+  index[4] = bins->bin[ offset+d0        ];
+  index[5] = bins->bin[ offset+d0     +1 ];
+  index[6] = bins->bin[ offset+d0  +d1   ];
+  index[7] = bins->bin[ offset+d0  +d1+1 ];
+
+  /* Get the fraction parts, in steps of 1/MI_PV_STEPS */
+  f0 = (long)( (coord[VIO_X] - ind0) * MI_PV_STEPS + 0.5 );
+  f1 = (long)( (coord[VIO_Y] - ind1) * MI_PV_STEPS + 0.5 );
+  f2 = (long)( (coord[VIO_Z] - ind2) * MI_PV_STEPS + 0.5 );
+  r0 = MI_PV_STEPS - f0;
+  r1 = MI_PV_STEPS - f1;
+  r2 = MI_PV_STEPS - f2;
   
   r1r2 = r1 * r2;
   r1f2 = r1 * f2;
   f1r2 = f1 * r2;
   f1f2 = f1 * f2;
 
-  fractional_vals[0] = r0 * r1r2;
-  fractional_vals[1] = r0 * r1f2;
-  fractional_vals[2] = r0 * f1r2;
-  fractional_vals[3] = r0 * f1f2;
-  fractional_vals[4] = f0 * r1r2;
-  fractional_vals[5] = f0 * r1f2;
-  fractional_vals[6] = f0 * f1r2;
-  fractional_vals[7] = f0 * f1f2;
+  weight[0] = r0 * r1r2;
+  weight[1] = r0 * r1f2;
+  weight[2] = r0 * f1r2;
+  weight[3] = r0 * f1f2;
+  weight[4] = f0 * r1r2;
+  weight[5] = f0 * r1f2;
+  weight[6] = f0 * f1r2;
+  weight[7] = f0 * f1f2;
 
   /* Do the interpolation */
 
-  *result =
-    r0 *  (r1r2 * intensity_vals[0] +
-           r1f2 * intensity_vals[1] +
-           f1r2 * intensity_vals[2] +
-           f1f2 * intensity_vals[3]);
-  *result +=
-    f0 *  (r1r2 * intensity_vals[4] +
-           r1f2 * intensity_vals[5] +
-           f1r2 * intensity_vals[6] +
-           f1f2 * intensity_vals[7]);
-
-  *result = CONVERT_VOXEL_TO_VALUE(data, *result);
+  *result = 0.0;
+  for(i=0; i<8; i++)
+    *result += weight[i] * bins->bin_value[ index[i] ];
+  *result /= MI_PV_ONE;
 
   return TRUE;
   
@@ -318,193 +420,351 @@ static void blur_jpdf (VIO_Real **hist, int blur_size, int pdf_length) {
 }
 
 
-/* this function will calculate the mutual information similarity
-   value based on the paper by Collignon, IPMI95, p 266 
-
-   limits/constraints/caveats:
-   - this version is limited to manipulation of byte volumes only
-   - globals->groups must = 256 (since only byte data supported)
-     (this is forced in optimize.c)
-   - all calculations are computed on voxel (byte) intensity values
-     (and _not_ the REAL value, as is done with all other obj functions)
-   - because of this, the input data vols should be appropriately set up
-     by the user
-   - ONLY partial volume interpolation is used: there is no support for
-     other interpolation methods.
+/* Each thread accumulates the lattice nodes it handles into its own
+   histograms, which are added together once the lattice has been
+   walked.  Since the counts are integers, the sum does not depend on
+   how the nodes were shared among the threads.
 
-*/
+   The rows of a thread's joint histogram are padded to a multiple of
+   MI_ROW_ALIGN bytes, and start on such a boundary, so that two
+   threads never write to the same cache line.  Only the rows that
+   were touched by the previous evaluation are cleared. */
 
-float mutual_information_objective(VIO_Volume d1,
-                                          VIO_Volume d2,
-                                          VIO_Volume m1,
-                                          VIO_Volume m2, 
-                                          Arg_Data *globals)
-{
+#define MI_ROW_ALIGN  64
 
-  VectorR                        /* these variables are used to step through */
-    vector_step;                /* the 3D lattice                           */
-  PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2;
-  VIO_Real
-    voxel_coord[3];
-  int
-    i,j,
-    count1,count2,                /* number of nodes in first vol, second vol */
-    index1[8],
-    index2[8],
-    r,c,s;
-  
-  VIO_Real
-    min_range1, max_range1, range1,
-    min_range2, max_range2, range2,
-    intensity_vals1[8],                /* voxel values to index into histogram */
-    intensity_vals2[8],
-    fractional_vals1[8],        /* fractional values to add to histo */
-    fractional_vals2[8],
-    value1, value2;
-  double
-    Hy, Hx, Ixy;		/* entropies */
-  double
-    product, Redundancy;
-  float 
-    mutual_info_result;                        
+#ifdef _OPENMP
+#define MI_THREAD_NUM   omp_get_thread_num()
+#define MI_MAX_THREADS  omp_get_max_threads()
+#else
+#define MI_THREAD_NUM   0
+#define MI_MAX_THREADS  1
+#endif
 
-  Voxel_space_struct *vox_space;
-  VIO_Transform          *trans;
+typedef struct {
+  int            groups;
+  int            stride;        /* padded length of a joint row        */
+  VIO_Real       *fn1, *fn2;    /* marginal histograms                 */
+  VIO_Real       *joint;        /* aligned, groups rows of stride      */
+  VIO_Real       *base;         /* joint, as allocated                 */
+  unsigned char  *row_touched;  /* row of joint is not all zero        */
+  int            *touched;      /* list of these rows                  */
+  int            n_touched;
+  int            count1, count2;
+} Mi_histogram;
+
+static Mi_histogram  *mi_histograms = NULL;
+static int           mi_n_histograms = 0;
+
+static void free_histograms(void)
+{
+  int t;
+
+  for(t=0; t<mi_n_histograms; t++) {
+    FREE(mi_histograms[t].fn1);
+    FREE(mi_histograms[t].fn2);
+    FREE(mi_histograms[t].base);
+    FREE(mi_histograms[t].row_touched);
+    FREE(mi_histograms[t].touched);
+  }
+  if (mi_histograms != NULL)
+    FREE(mi_histograms);
+  mi_histograms   = NULL;
+  mi_n_histograms = 0;
+}
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : free_mutual_information_bins
+@INPUT      : none
+@OUTPUT     : none
+@RETURNS    : nothing
+@DESCRIPTION: free the bin index volumes and the per-thread histograms built
+              by the mutual information objective functions.  To be called once the optimization is
+              done, or whenever the data volumes are changed.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void free_mutual_information_bins(void)
+{
+  free_bins(&mi_bins[0]);
+  free_bins(&mi_bins[1]);
+  free_histograms();
+}
 
-                                /* init any objective function specific
-                                   stuff here                           */
-  count1 = count2 = 0;
-  mutual_info_result = 0.0;
+/* get one cleared set of histograms per thread, and return the number
+   of sets */
 
-  for(i=0; i<globals->groups; i++) {
-    prob_fn1[i] = 0.0;
-    prob_fn2[i] = 0.0;
+static int clear_histograms(int groups)
+{
+  Mi_histogram *hist;
+  VIO_Real     *row;
+  int          t,i,j,pad;
+
+  if (mi_n_histograms != MI_MAX_THREADS ||
+      mi_histograms[0].groups != groups) {
+
+    free_histograms();
+
+    mi_n_histograms = MI_MAX_THREADS;
+    ALLOC(mi_histograms, mi_n_histograms);
+
+    pad = MI_ROW_ALIGN / sizeof(VIO_Real);
+
+    for(t=0; t<mi_n_histograms; t++) {
+      hist = &mi_histograms[t];
+      hist->groups = groups;
+      hist->stride = ((groups + pad - 1) / pad) * pad;
+      ALLOC(hist->fn1, groups);
+      ALLOC(hist->fn2, groups);
+      ALLOC(hist->base, (long)groups * hist->stride + pad);
+      hist->joint = (VIO_Real *)( ((size_t)hist->base + MI_ROW_ALIGN - 1) & 
+                                  ~((size_t)MI_ROW_ALIGN - 1) );
+      ALLOC(hist->row_touched, groups);
+      ALLOC(hist->touched, groups);
+
+      for(i=0; i<groups; i++) {
+        hist->row_touched[i] = TRUE;     /* so that all rows get cleared */
+        hist->touched[i] = i;
+      }
+      hist->n_touched = groups;
+    }
   }
 
-  for(i=0; i<globals->groups; i++) 
-    for(j=0; j<globals->groups; j++) 
-      prob_hash_table[i][j] = 0.0;
-
-  /*
-    this was here, but appears to be useless!  dlc 04/2009
+  for(t=0; t<mi_n_histograms; t++) {
+    hist = &mi_histograms[t];
 
-    get_volume_minimum_maximum_real_value(d1, &min_range1, &max_range1);
-    get_volume_minimum_maximum_real_value(d2, &min_range2, &max_range2);
-    
-    range1 = max_range1 - min_range1;
-    range2 = max_range2 - min_range2;
+    for(i=0; i<hist->n_touched; i++) {
+      row = &hist->joint[ (long)hist->touched[i] * hist->stride ];
+      for(j=0; j<groups; j++)
+        row[j] = 0.0;
+      hist->row_touched[ hist->touched[i] ] = FALSE;
+    }
+    hist->n_touched = 0;
 
-  */
+    for(i=0; i<groups; i++) {
+      hist->fn1[i] = 0.0;
+      hist->fn2[i] = 0.0;
+    }
+    hist->count1 = hist->count2 = 0;
+  }
 
+  return(mi_n_histograms);
+}
 
-                                /* prepare data for the voxel-to-voxel
-                                   space transformation (instead of the
-                                   general but inefficient world-world
-                                   computations. */
+/* add the n_hist per-thread histograms into prob_fn1, prob_fn2 and
+   prob_hash_table */
 
-  vox_space = new_voxel_space_struct();
-  get_into_voxel_space(globals, vox_space, d1, d2);
-  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+static void merge_histograms(int n_hist, int groups, int *count1, int *count2)
+{
+  Mi_histogram *hist;
+  VIO_Real     *row, *src;
+  int          t,i,j;
 
-                                /* get ready to step though the 3D lattice
-                                   */
+#ifdef _OPENMP
+#pragma omp parallel for private(t,j,row,src,hist)
+#endif
+  for(i=0; i<groups; i++) {
+    row = prob_hash_table[i];
+    for(j=0; j<groups; j++)
+      row[j] = 0.0;
+    prob_fn1[i] = prob_fn2[i] = 0.0;
+
+    for(t=0; t<n_hist; t++) {
+      hist = &mi_histograms[t];
+      prob_fn1[i] += hist->fn1[i];
+      prob_fn2[i] += hist->fn2[i];
+      if (hist->row_touched[i]) {
+        src = &hist->joint[ (long)i * hist->stride ];
+        for(j=0; j<groups; j++)
+          row[j] += src[j];
+      }
+    }
+  }
 
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+  *count1 = *count2 = 0;
+  for(t=0; t<n_hist; t++) {
+    *count1 += mi_histograms[t].count1;
+    *count2 += mi_histograms[t].count2;
+  }
+}
 
-  /* ---------- step through all slices of lattice ------------- */
-  for(s=0; s<globals->count[SLICE_IND]; s++) {
+/* accumulate the nodes of slice s of the lattice into hist */
+
+static void mi_slice(VIO_Volume m1,
+                     VIO_Volume m2, 
+                     Arg_Data *globals,
+                     Voxel_space_struct *vox_space,
+                     VIO_Transform *trans,
+                     Mi_bins *bins1,
+                     Mi_bins *bins2,
+                     int s,
+                     Mi_histogram *hist)
+{
+  VectorR
+    vector_step;
+  PointR
+    slice,
+    row,
+    col,
+    pos2;
+  VIO_Real
+    voxel_coord[3];
+  int
+    i,j,
+    index1[8],
+    index2[8],
+    r,c;
+  long
+    weight1[8],                        /* integer weights to add to histo */
+    weight2[8];
+  VIO_Real
+    value1, value2,
+    *joint_row;
 
-    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+  fill_Point( slice, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+  SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+  ADD_POINT_VECTOR( slice, slice, vector_step );
 
-    /* ---------- step through all rows of lattice ------------- */
-    for(r=0; r<globals->count[ROW_IND]; r++) {
+  /* ---------- step through all rows of lattice ------------- */
+  for(r=0; r<globals->count[ROW_IND]; r++) {
       
-      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
+    SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+    ADD_POINT_VECTOR( row, slice, vector_step );
       
-      SCALE_POINT( col, row, 1.0); /* init first col position */
+    SCALE_POINT( col, row, 1.0); /* init first col position */
 
-      /* ---------- step through all cols of lattice ------------- */
-      for(c=0; c<globals->count[COL_IND]; c++) {
+    /* ---------- step through all cols of lattice ------------- */
+    for(c=0; c<globals->count[COL_IND]; c++) {
         
                                    /* get the node value in volume 1,
                                       if it falls within the volume    */
 
-        if (voxel_point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {
+      if (voxel_point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {
           
-           voxel_coord[VIO_X] = Point_x(col);
-           voxel_coord[VIO_Y] = Point_y(col);
-           voxel_coord[VIO_Z] = Point_z(col);
+        voxel_coord[VIO_X] = Point_x(col);
+        voxel_coord[VIO_Y] = Point_y(col);
+        voxel_coord[VIO_Z] = Point_z(col);
            
+        if (partial_volume_bins(bins1, voxel_coord, index1, weight1, &value1 )) {
 
-          if (partial_volume_interpolation(d1, 
-                                           voxel_coord, 
-                                           intensity_vals1,
-                                           fractional_vals1,
-                                           &value1 )) {
-
-            if (value1 > globals->threshold[0]) { /* is the voxel in the thresholded region? */
+          if (value1 > globals->threshold[0]) { /* is the voxel in the thresholded region? */
 
-              count1++;
+            hist->count1++;
                                 /* transform the node coordinate into
                                    volume 2                             */
 
-              my_homogenous_transform_point(trans,
-                                            Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                            &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+            my_homogenous_transform_point(trans,
+                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
+                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
               
               /* get the node value in volume 2,
                  if it falls within the volume    */
               
-              if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) )) {
+            if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) )) {
                  
-                 voxel_coord[VIO_X] = Point_x(pos2);
-                 voxel_coord[VIO_Y] = Point_y(pos2);
-                 voxel_coord[VIO_Z] = Point_z(pos2);
+              voxel_coord[VIO_X] = Point_x(pos2);
+              voxel_coord[VIO_Y] = Point_y(pos2);
+              voxel_coord[VIO_Z] = Point_z(pos2);
                  
-                 if (partial_volume_interpolation(d2, 
-                                                  voxel_coord, 
-                                                  intensity_vals2,
-                                                  fractional_vals2,
-                                                  &value2 )) {
+              if (partial_volume_bins(bins2, voxel_coord, index2, weight2, &value2 )) {
                   
-                    if (value2 > globals->threshold[1]) { /* is the voxel in the thresholded region? */
+                if (value2 > globals->threshold[1]) { /* is the voxel in the thresholded region? */
 
-                       count2++;
-                       
-                       for(i=0; i<8; i++) {
-                          index1[i] = ROUND( intensity_vals1[i] );
-                          index2[i] = ROUND( intensity_vals2[i] );
-                          prob_fn1[ index1[i] ] += fractional_vals1[i];
-                          prob_fn2[ index2[i] ] += fractional_vals2[i];
-                       }
-                       for(i=0; i<8; i++) 
-                          for(j=0; j<8; j++) {
-                             prob_hash_table[ index1[i] ][ index2[j] ] += 
-                                fractional_vals1[i]*fractional_vals2[j];
-                          }
+                  hist->count2++;
                        
+                  for(i=0; i<8; i++) {
+                    hist->fn1[ index1[i] ] += weight1[i];
+                    hist->fn2[ index2[i] ] += weight2[i];
+                  }
+                  for(i=0; i<8; i++) 
+                    if (weight1[i] != 0) {
+                      if (!hist->row_touched[ index1[i] ]) {
+                        hist->row_touched[ index1[i] ] = TRUE;
+                        hist->touched[ hist->n_touched++ ] = index1[i];
+                      }
+                      joint_row = &hist->joint[ (long)index1[i] * hist->stride ];
+                      for(j=0; j<8; j++) 
+                        joint_row[ index2[j] ] += (VIO_Real)(weight1[i]*weight2[j]);
+                    }
                        
-                    } /* if value2>thres */
-                 } /* if voxel in d2 */
-              } /* if point in mask volume two */
-           } /* if value1>thres */
-         } /* if voxel in d1 */
-        } /* if point in mask volume one */
+                } /* if value2>thres */
+              } /* if voxel in d2 */
+            } /* if point in mask volume two */
+          } /* if value1>thres */
+        } /* if voxel in d1 */
+      } /* if point in mask volume one */
         
-        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+      ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
         
-      } /* for c */
-    } /* for r */
-  } /* for s */
+    } /* for c */
+  } /* for r */
+}
+
+
+/* this function will calculate the mutual information similarity
+   value based on the paper by Collignon, IPMI95, p 266 
+
+   limits/constraints/caveats:
+   - the histograms have globals->groups bins, and are computed on
+     the bin index volumes described above (globals->threshold is
+     compared to the real value represented by the interpolated bins)
+   - ONLY partial volume interpolation is used: there is no support for
+     other interpolation methods.
+
+*/
+
+float mutual_information_objective(VIO_Volume d1,
+                                          VIO_Volume d2,
+                                          VIO_Volume m1,
+                                          VIO_Volume m2, 
+                                          Arg_Data *globals)
+{
+
+  int
+    i,j,s,
+    n_hist,
+    count1,count2;                /* number of nodes in first vol, second vol */
+  double
+    Hy, Hx, Ixy;		/* entropies */
+  double
+    product, Redundancy;
+  float 
+    mutual_info_result;                        
+
+  Mi_bins *bins1, *bins2;
+
+  Voxel_space_struct *vox_space;
+  VIO_Transform          *trans;
+
+
+                                /* init any objective function specific
+                                   stuff here                           */
+  mutual_info_result = 0.0;
+
+  bins1 = get_bins(d1, globals->groups);
+  bins2 = get_bins(d2, globals->groups);
+
+  n_hist = clear_histograms(globals->groups);
+
+                                /* prepare data for the voxel-to-voxel
+                                   space transformation (instead of the
+                                   general but inefficient world-world
+                                   computations. */
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  /* ---------- step through all slices of lattice ------------- */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<globals->count[SLICE_IND]; s++) 
+    mi_slice(m1, m2, globals, vox_space, trans, bins1, bins2, s,
+             &mi_histograms[MI_THREAD_NUM]);
+
+  merge_histograms(n_hist, globals->groups, &count1, &count2);
 
+  delete_voxel_space_struct(vox_space);
 
 
   /* now that the data for the objective function has been accumulated
@@ -528,15 +788,19 @@ float mutual_information_objective(VIO_Volume d1,
 
   if (count2>0) {
 
-                                /* normalize to count2  */
+                                /* normalize to count2 (and to the
+                                   total weight of each node) */
     for(i=0; i<globals->groups; i++) {
-      prob_fn1[i] /= count2;
-      prob_fn2[i] /= count2;
+      prob_fn1[i] /= (double)count2 * MI_PV_ONE;
+      prob_fn2[i] /= (double)count2 * MI_PV_ONE;
     }
     
+                                /* rows with an empty marginal do
+                                   not contribute below */
     for(i=0; i<globals->groups; i++) 
-      for(j=0; j<globals->groups; j++) 
-        prob_hash_table[i][j] /= count2;
+      if (prob_fn1[i] > 0.0)
+        for(j=0; j<globals->groups; j++) 
+          prob_hash_table[i][j] /= (double)count2 * MI_PV_ONE * MI_PV_ONE;
     
 
 
@@ -580,7 +844,7 @@ float mutual_information_objective(VIO_Volume d1,
       }
       
       for(i=0; i<globals->groups; i++) {        /* compute mutual information */
-	for(j=0; j<globals->groups; j++) {
+	if (prob_fn1[i] > 0.0) for(j=0; j<globals->groups; j++) {
 	  product = prob_fn1[i]*prob_fn2[j] ;
 	  if (prob_hash_table[i][j]>0.0 && product>0.0) 
 	    Ixy += (double)prob_hash_table[i][j] *  log( (double)( prob_hash_table[i][j]/product));
@@ -597,7 +861,7 @@ float mutual_information_objective(VIO_Volume d1,
 
     } else {			/* this is the standard MI computation pre Oct 2008 (the -mi option for linear reg) */
       for(i=0; i<globals->groups; i++) 
-	for(j=0; j<globals->groups; j++) {
+	if (prob_fn1[i] > 0.0) for(j=0; j<globals->groups; j++) {
 	  
 	  if ( prob_fn1[i] > 0.0 &&  prob_fn2[j] > 0.0 && prob_hash_table[i][j]>0.0)
 	    /* this is the same as Ixy, just above */
@@ -110,6 +110,7 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #endif
 
 #include <volume_io.h>
+#include <stdlib.h>                /* for erand48() */
 #include "constants.h"
 #include "arg_data.h"
 #include "interpolation.h"
@@ -117,6 +118,7 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include "local_macros.h"
 #include <Proglib.h>
 #include "vox_space.h"
+#include "objectives.h"
 #include "interpolation.h"
 
 extern Arg_Data main_args;
@@ -131,6 +133,726 @@ int voxel_point_not_masked(VIO_Volume volume,
 
 
 
+/* partial sums accumulated over one slice of the lattice by the
+   objective functions below.  Each slice is done independently (and
+   in parallel when built with OpenMP); the slices are then combined
+   in slice order, so that the objective value does not depend on the
+   number of threads used. */
+
+typedef struct {
+  VIO_Real s1, s2, s3;
+  int      count1, count2, count3;
+} Slice_sums;
+
+static void init_slice_sums(Slice_sums *sums)
+{
+  sums->s1 = sums->s2 = sums->s3 = 0.0;
+  sums->count1 = sums->count2 = sums->count3 = 0;
+}
+
+static void add_slice_sums(Slice_sums *total, Slice_sums *sums)
+{
+  total->s1     += sums->s1;
+  total->s2     += sums->s2;
+  total->s3     += sums->s3;
+  total->count1 += sums->count1;
+  total->count2 += sums->count2;
+  total->count3 += sums->count3;
+}
+
+
+/* The part of each lattice node that depends only on the source volume
+   d1 (the m1 mask test, the value of d1 and the threshold[0] test)
+   does not change while the transformation is being optimized.  The
+   nodes that survive these tests are gathered once into a compact
+   list, slice by slice, so that each evaluation of the objective only
+   has to transform the node and sample d2.
+
+   The list is kept from one evaluation to the next between calls to
+   begin_source_lattice_cache() and end_source_lattice_cache(), as
+   long as the volumes, lattice and threshold it was built for do not
+   change.  Outside of these calls, it is built and thrown away for
+   each evaluation.
+
+   While set_source_lattice_sampling(TRUE) is in effect, and
+   -sample_count or -sample_fraction was given, only a fixed random
+   subset of the surviving nodes is used. */
+
+#define SOURCE_XCORR   0        /* NN value at the closest voxel center,
+                                   value1 > threshold[0]                */
+#define SOURCE_ZSCORE  1        /* interpolated value at the closest
+                                   voxel center, |value1|>threshold[0]  */
+#define SOURCE_VR      2        /* as zscore, value1 > threshold[0],
+                                   with the segment of value1           */
+
+typedef struct {
+  int           kind;
+  VIO_Volume    d1, m1;          /* what the list was built for...    */
+  VIO_Real      threshold;
+  VIO_Real      start[3];
+  VIO_Real      directions[3][3];
+  int           count[3];
+  Segment_Table *table;
+
+  int           n_slices;        /* ...and the list itself            */
+  long          *slice_start;    /* nodes of slice s are
+                                    slice_start[s]..slice_start[s+1]-1 */
+  long          *slice_row;      /* rows (that have nodes) of slice s
+                                    are slice_row[s]..slice_row[s+1]-1 */
+  int           *slice_count1;   /* nodes inside m1 and d1, per slice */
+  long          n_nodes;
+  long          n_rows;
+  long          *row_start;      /* nodes of each row, as slice_start */
+  int           *row_index;      /* lattice row index of each row     */
+  int           *col_index;      /* lattice col index of each node    */
+  VIO_Real      *coord;          /* voxel coord to be transformed (x3) */
+  VIO_Real      *value;          /* value1                            */
+  VIO_Real      *square;         /* value1*value1                     */
+  int           *segment;        /* segment of value1 (SOURCE_VR)     */
+} Source_lattice;
+
+static VIO_BOOL       source_lattice_cache_enabled = FALSE;
+static Source_lattice *source_lattice_cache = NULL;
+
+static VIO_BOOL       source_lattice_sampling = FALSE;
+static Source_lattice *source_sample_cache = NULL; /* subset of the above */
+static long           source_sample_count = 0;
+
+static void delete_source_lattice(Source_lattice *lattice)
+{
+  FREE(lattice->slice_start);
+  FREE(lattice->slice_row);
+  FREE(lattice->slice_count1);
+  FREE(lattice->row_start);
+  FREE(lattice->row_index);
+  FREE(lattice->col_index);
+  FREE(lattice->coord);
+  FREE(lattice->value);
+  FREE(lattice->square);
+  if (lattice->segment != NULL)
+    FREE(lattice->segment);
+  FREE(lattice);
+}
+
+static VIO_BOOL source_lattice_matches(Source_lattice *lattice,
+                                       int kind,
+                                       VIO_Volume d1,
+                                       VIO_Volume m1,
+                                       Arg_Data *globals,
+                                       Voxel_space_struct *vox_space)
+{
+  int i,j;
+
+  if (lattice->kind != kind || lattice->d1 != d1 || lattice->m1 != m1 ||
+      lattice->threshold != globals->threshold[0] ||
+      lattice->table != segment_table)
+    return(FALSE);
+
+  for(i=0; i<3; i++) {
+    if (lattice->start[i] != vox_space->start[i] ||
+        lattice->count[i] != globals->count[i])
+      return(FALSE);
+    for(j=0; j<3; j++)
+      if (lattice->directions[i][j] != Vector_coord(vox_space->directions[i],j))
+        return(FALSE);
+  }
+
+  return(TRUE);
+}
+
+/* walk slice s of the lattice and keep the nodes that survive the
+   source side tests.  When lattice->coord is NULL, the nodes and the
+   rows that have nodes are only counted (in *n_nodes and *n_rows);
+   otherwise they are stored from lattice->slice_start[s] and
+   lattice->slice_row[s] on. */
+
+static void source_lattice_slice(Source_lattice *lattice,
+                                 VIO_Volume d1,
+                                 VIO_Volume m1,
+                                 Arg_Data *globals,
+                                 Voxel_space_struct *vox_space,
+                                 int s,
+                                 int *count1,
+                                 long *n_nodes,
+                                 long *n_rows)
+{
+  VectorR
+    vector_step;
+
+  PointR
+    slice,
+    row,
+    col,
+    voxel;
+
+  int
+    r,c,keep;
+
+  long
+    n, n_row, m;
+
+  VIO_Real
+    value1, *p;
+
+  VIO_BOOL
+    store;
+
+  store = (lattice->coord != NULL);
+  n     = store ? lattice->slice_start[s] : 0;
+  m     = store ? lattice->slice_row[s]   : 0;
+  *count1 = 0;
+
+  fill_Point( slice, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+  SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
+  ADD_POINT_VECTOR( slice, slice, vector_step );
+
+  for(r=0; r<globals->count[ROW_IND]; r++) {
+      
+    SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
+    ADD_POINT_VECTOR( row, slice, vector_step );
+      
+    SCALE_POINT( col, row, 1.0); /* init first col position */
+
+    n_row = n;
+
+    for(c=0; c<globals->count[COL_IND]; c++) {
+                
+                                /* use the voxel center closest to this lattice
+                                   node. 
+                                */
+      fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
+
+      if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
+
+        if (lattice->kind == SOURCE_XCORR)
+          keep = nearest_neighbour_interpolant( d1, &voxel, &value1 );
+        else
+          keep = INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 );
+
+        if (keep) {
+
+          (*count1)++;
+
+          if (lattice->kind == SOURCE_ZSCORE)
+            keep = fabs(value1) > globals->threshold[0];
+          else
+            keep = value1 > globals->threshold[0];
+
+          if (keep) {
+
+            if (store) {
+
+                                /* xcorr maps the voxel center, the
+                                   others the lattice node itself */
+              p = &lattice->coord[3*n];
+              if (lattice->kind == SOURCE_XCORR) {
+                p[0] = Point_x(voxel); p[1] = Point_y(voxel); p[2] = Point_z(voxel);
+              }
+              else {
+                p[0] = Point_x(col); p[1] = Point_y(col); p[2] = Point_z(col);
+              }
+              lattice->col_index[n] = c;
+              lattice->value[n]     = value1;
+              lattice->square[n]    = value1*value1;
+              if (lattice->kind == SOURCE_VR)
+                lattice->segment[n] = (*segment_table->segment)
+                  ( CONVERT_VALUE_TO_VOXEL(d1,value1), segment_table);
+            }
+            n++;
+          }
+        } /* if voxel in d1 */
+      } /* if point in mask volume one */
+        
+      ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+        
+    } /* for c */
+
+    if (n > n_row) {            /* keep only the rows that have nodes */
+      if (store) {
+        lattice->row_start[m] = n_row;
+        lattice->row_index[m] = r;
+      }
+      m++;
+    }
+  } /* for r */
+
+  *n_nodes = store ? n - lattice->slice_start[s] : n;
+  *n_rows  = store ? m - lattice->slice_row[s]   : m;
+}
+
+static Source_lattice *build_source_lattice(int kind,
+                                            VIO_Volume d1,
+                                            VIO_Volume m1,
+                                            Arg_Data *globals,
+                                            Voxel_space_struct *vox_space)
+{
+  Source_lattice *lattice;
+  long           n_alloc, n_nodes, n_rows;
+  int            i,j,s;
+
+  ALLOC(lattice, 1);
+
+  lattice->kind      = kind;
+  lattice->d1        = d1;
+  lattice->m1        = m1;
+  lattice->threshold = globals->threshold[0];
+  lattice->table     = segment_table;
+  for(i=0; i<3; i++) {
+    lattice->start[i] = vox_space->start[i];
+    lattice->count[i] = globals->count[i];
+    for(j=0; j<3; j++)
+      lattice->directions[i][j] = Vector_coord(vox_space->directions[i],j);
+  }
+
+  lattice->n_slices = globals->count[SLICE_IND];
+  ALLOC(lattice->slice_start,  lattice->n_slices+1);
+  ALLOC(lattice->slice_row,    lattice->n_slices+1);
+  ALLOC(lattice->slice_count1, lattice->n_slices+1);
+  lattice->coord   = NULL;
+  lattice->segment = NULL;
+
+                                /* count the nodes and rows of each
+                                   slice... */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<lattice->n_slices; s++) 
+    source_lattice_slice(lattice, d1, m1, globals, vox_space, s, 
+                         &lattice->slice_count1[s],
+                         &lattice->slice_start[s+1], &lattice->slice_row[s+1]);
+
+  lattice->slice_start[0] = 0;
+  lattice->slice_row[0]   = 0;
+  for(s=0; s<lattice->n_slices; s++) {
+    lattice->slice_start[s+1] += lattice->slice_start[s];
+    lattice->slice_row[s+1]   += lattice->slice_row[s];
+  }
+  lattice->n_nodes = lattice->slice_start[lattice->n_slices];
+  lattice->n_rows  = lattice->slice_row[lattice->n_slices];
+
+                                /* ...then store them */
+  n_alloc = (lattice->n_nodes > 0) ? lattice->n_nodes : 1;
+  ALLOC(lattice->coord,     3*n_alloc);
+  ALLOC(lattice->col_index, n_alloc);
+  ALLOC(lattice->value,     n_alloc);
+  ALLOC(lattice->square,    n_alloc);
+  if (kind == SOURCE_VR)
+    ALLOC(lattice->segment, n_alloc);
+
+  ALLOC(lattice->row_start, lattice->n_rows+1);
+  ALLOC(lattice->row_index, lattice->n_rows+1);
+  lattice->row_start[lattice->n_rows] = lattice->n_nodes;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) private(n_nodes,n_rows)
+#endif
+  for(s=0; s<lattice->n_slices; s++) 
+    source_lattice_slice(lattice, d1, m1, globals, vox_space, s, 
+                         &lattice->slice_count1[s], &n_nodes, &n_rows);
+
+  return(lattice);
+}
+
+/* The voxel-to-voxel transformation is affine, so along a row of the
+   lattice the mapped position of a node advances by a constant vector
+   for each column.  Each row is anchored by mapping its origin; its
+   nodes are then at anchor + c * (mapped column step), computed a
+   chunk of SOURCE_CHUNK nodes at a time into small arrays, in a loop
+   that the compiler can vectorize.  The step is multiplied by the
+   column index rather than accumulated, so that the rounding error
+   does not grow along the row, and each row is re-anchored from the
+   lattice origin.
+
+   The voxel centers used by xcorr_objective() are not on a line; they
+   are mapped one by one, with the affine part of the matrix only. */
+
+#define SOURCE_CHUNK  64
+
+typedef struct {
+  VIO_Real  matrix[3][4];       /* the voxel-to-voxel transformation  */
+  VIO_Real  origin[3];          /* the mapped lattice start           */
+  VIO_Real  step[3][3];         /* the mapped slice, row & col steps  */
+  Volume_descriptor target;     /* d2, sampled by sample_target_nodes() */
+} Lattice_stepper;
+
+static void init_lattice_stepper(Lattice_stepper *stepper,
+                                 VIO_Transform *trans,
+                                 Source_lattice *lattice,
+                                 VIO_Volume d2)
+{
+  int i,j,d;
+
+  init_volume_descriptor(&stepper->target, d2);
+
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++)
+      stepper->matrix[i][j] = Transform_elem(*trans,i,j);
+
+  for(i=0; i<3; i++) {
+    stepper->origin[i] = stepper->matrix[i][3];
+    for(j=0; j<3; j++)
+      stepper->origin[i] += stepper->matrix[i][j] * lattice->start[j];
+  }
+
+  for(d=0; d<3; d++)
+    for(i=0; i<3; i++) {
+      stepper->step[d][i] = 0.0;
+      for(j=0; j<3; j++)
+        stepper->step[d][i] += stepper->matrix[i][j] * lattice->directions[d][j];
+    }
+}
+
+/* map the n (<= SOURCE_CHUNK) nodes of the source lattice that start
+   at node n0, in row `row' of slice s, into x[], y[] and z[] */
+
+static void map_source_nodes(Source_lattice *lattice,
+                             Lattice_stepper *stepper,
+                             int s,
+                             long row,
+                             long n0,
+                             int n,
+                             VIO_Real x[],
+                             VIO_Real y[],
+                             VIO_Real z[])
+{
+  VIO_Real
+    ax, ay, az,
+    cx, cy, cz,
+    *p;
+  int
+    k, r, *col;
+
+  if (lattice->kind == SOURCE_XCORR) {
+
+    VIO_Real (*m)[4] = stepper->matrix;
+
+    p = &lattice->coord[3*n0];
+    for(k=0; k<n; k++, p+=3) {
+      x[k] = m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3];
+      y[k] = m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3];
+      z[k] = m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3];
+    }
+  }
+  else {
+
+    r  = lattice->row_index[row];
+    ax = stepper->origin[0] + s*stepper->step[SLICE_IND][0] + r*stepper->step[ROW_IND][0];
+    ay = stepper->origin[1] + s*stepper->step[SLICE_IND][1] + r*stepper->step[ROW_IND][1];
+    az = stepper->origin[2] + s*stepper->step[SLICE_IND][2] + r*stepper->step[ROW_IND][2];
+    cx = stepper->step[COL_IND][0];
+    cy = stepper->step[COL_IND][1];
+    cz = stepper->step[COL_IND][2];
+
+    col = &lattice->col_index[n0];
+    for(k=0; k<n; k++) {
+      x[k] = ax + col[k]*cx;
+      y[k] = ay + col[k]*cy;
+      z[k] = az + col[k]*cz;
+    }
+  }
+}
+
+/* interpolate d2 at the n mapped nodes x[], y[] and z[], all at once,
+   with the interpolant in use, and the trilinear gradient of d2 too if
+   gradient is not NULL.  inside[k] is TRUE for the nodes that are in
+   d2 and not masked out by m2. */
+
+static void sample_target_nodes(Lattice_stepper *stepper,
+                                VIO_Volume m2,
+                                int n,
+                                VIO_Real x[],
+                                VIO_Real y[],
+                                VIO_Real z[],
+                                VIO_Real value2[],
+                                char inside[],
+                                VIO_Real (*gradient)[3])
+{
+  int
+    k;
+
+  (void)interpolate_points(&stepper->target, main_args.interpolant, 
+                           n, x, y, z, value2, inside, gradient);
+
+  if (m2 != NULL)
+    for(k=0; k<n; k++) 
+      if (inside[k] && !voxel_point_not_masked(m2, x[k], y[k], z[k]))
+        inside[k] = FALSE;
+}
+
+/* number of nodes to sample from the full source lattice, or 0 if
+   the full lattice is to be used */
+
+static long source_lattice_samples(Arg_Data *globals,
+                                   Source_lattice *full)
+{
+  long n_samples;
+
+  if (!source_lattice_sampling)
+    return(0);
+
+  if (globals->sample_count > 0)
+    n_samples = globals->sample_count;
+  else if (globals->sample_fraction > 0.0 && globals->sample_fraction < 1.0)
+    n_samples = (long)(globals->sample_fraction * full->n_nodes + 0.5);
+  else
+    return(0);
+
+  if (n_samples >= full->n_nodes)
+    return(0);
+  if (n_samples < 1)
+    n_samples = 1;
+
+  return(n_samples);
+}
+
+/* build a lattice with n_samples nodes of the full one, chosen at
+   random (but always with the same seed, so that the objective
+   function stays deterministic), keeping the slice and row order */
+
+static Source_lattice *sample_source_lattice(Source_lattice *full,
+                                             long n_samples)
+{
+  Source_lattice *lattice;
+  unsigned char  *keep;
+  unsigned short seed[3];
+  long           i, n, m, row, first, selected, n_alloc;
+  int            s;
+
+                                /* selection sampling (Knuth's
+                                   algorithm S): exactly n_samples
+                                   nodes, in order */
+  ALLOC(keep, full->n_nodes);
+  seed[0] = 0x330e; seed[1] = 0xabcd; seed[2] = 0x1234;
+  selected = 0;
+  for(i=0; i<full->n_nodes; i++) {
+    keep[i] = (erand48(seed) * (full->n_nodes - i) < (n_samples - selected));
+    if (keep[i]) selected++;
+  }
+
+  ALLOC(lattice, 1);
+  *lattice = *full;             /* the key and the slice counts */
+
+  ALLOC(lattice->slice_start,  lattice->n_slices+1);
+  ALLOC(lattice->slice_row,    lattice->n_slices+1);
+  ALLOC(lattice->slice_count1, lattice->n_slices+1);
+  for(s=0; s<lattice->n_slices; s++)
+    lattice->slice_count1[s] = full->slice_count1[s];
+
+  n_alloc = (selected > 0) ? selected : 1;
+  ALLOC(lattice->coord,     3*n_alloc);
+  ALLOC(lattice->col_index, n_alloc);
+  ALLOC(lattice->value,     n_alloc);
+  ALLOC(lattice->square,    n_alloc);
+  if (full->segment != NULL)
+    ALLOC(lattice->segment, n_alloc);
+  ALLOC(lattice->row_start, full->n_rows+1);
+  ALLOC(lattice->row_index, full->n_rows+1);
+
+  n = m = 0;
+  for(s=0; s<lattice->n_slices; s++) {
+    lattice->slice_start[s] = n;
+    lattice->slice_row[s]   = m;
+    for(row=full->slice_row[s]; row<full->slice_row[s+1]; row++) {
+      first = n;
+      for(i=full->row_start[row]; i<full->row_start[row+1]; i++) 
+        if (keep[i]) {
+          lattice->coord[3*n]   = full->coord[3*i];
+          lattice->coord[3*n+1] = full->coord[3*i+1];
+          lattice->coord[3*n+2] = full->coord[3*i+2];
+          lattice->col_index[n] = full->col_index[i];
+          lattice->value[n]     = full->value[i];
+          lattice->square[n]    = full->square[i];
+          if (full->segment != NULL)
+            lattice->segment[n] = full->segment[i];
+          n++;
+        }
+      if (n > first) {
+        lattice->row_start[m] = first;
+        lattice->row_index[m] = full->row_index[row];
+        m++;
+      }
+    }
+  }
+  lattice->slice_start[lattice->n_slices] = n;
+  lattice->slice_row[lattice->n_slices]   = m;
+  lattice->row_start[m] = n;
+  lattice->n_nodes = n;
+  lattice->n_rows  = m;
+
+  FREE(keep);
+
+  return(lattice);
+}
+
+/* return the source lattice to use for this evaluation.  The caller
+   must call release_source_lattice() when done with it. */
+
+static Source_lattice *get_source_lattice(int kind,
+                                          VIO_Volume d1,
+                                          VIO_Volume m1,
+                                          Arg_Data *globals,
+                                          Voxel_space_struct *vox_space)
+{
+  Source_lattice *full, *lattice;
+  long           n_samples;
+
+  if (!source_lattice_cache_enabled) {
+    full = build_source_lattice(kind, d1, m1, globals, vox_space);
+    n_samples = source_lattice_samples(globals, full);
+    if (n_samples == 0)
+      return(full);
+    lattice = sample_source_lattice(full, n_samples);
+    delete_source_lattice(full);
+    return(lattice);
+  }
+
+                                /* several transformations can be
+                                   evaluated at once (see
+                                   objective_is_reentrant()); they all
+                                   share the same lattice, which is only
+                                   built by the first of them */
+#ifdef _OPENMP
+#pragma omp critical (source_lattice_cache)
+#endif
+  {
+    if (source_lattice_cache == NULL ||
+        !source_lattice_matches(source_lattice_cache, kind, d1, m1, globals, vox_space)) {
+      if (source_lattice_cache != NULL)
+        delete_source_lattice(source_lattice_cache);
+      if (source_sample_cache != NULL)
+        delete_source_lattice(source_sample_cache);
+      source_sample_cache = NULL;
+      source_lattice_cache = build_source_lattice(kind, d1, m1, globals, vox_space);
+    }
+
+    n_samples = source_lattice_samples(globals, source_lattice_cache);
+    if (n_samples == 0)
+      lattice = source_lattice_cache;
+    else {
+      if (source_sample_cache == NULL || source_sample_count != n_samples) {
+        if (source_sample_cache != NULL)
+          delete_source_lattice(source_sample_cache);
+        source_sample_cache = sample_source_lattice(source_lattice_cache, n_samples);
+        source_sample_count = n_samples;
+      }
+      lattice = source_sample_cache;
+    }
+  }
+
+  return(lattice);
+}
+
+static void release_source_lattice(Source_lattice *lattice)
+{
+  if (lattice != source_lattice_cache && lattice != source_sample_cache)
+    delete_source_lattice(lattice);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : begin_source_lattice_cache, end_source_lattice_cache
+@INPUT      : none
+@OUTPUT     : none
+@RETURNS    : nothing
+@DESCRIPTION: bracket an optimization of the linear transformation, during
+              which the data and mask volumes are not modified, so that the
+              source side of the lattice is computed only once by the
+              xcorr, zscore and vr objective functions.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void begin_source_lattice_cache(void)
+{
+  end_source_lattice_cache();
+  source_lattice_cache_enabled = TRUE;
+}
+
+void end_source_lattice_cache(void)
+{
+  if (source_lattice_cache != NULL)
+    delete_source_lattice(source_lattice_cache);
+  if (source_sample_cache != NULL)
+    delete_source_lattice(source_sample_cache);
+  source_lattice_cache = NULL;
+  source_sample_cache  = NULL;
+  source_lattice_cache_enabled = FALSE;
+  source_lattice_sampling      = FALSE;
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : set_source_lattice_sampling
+@INPUT      : on - TRUE to have the xcorr, zscore and vr objective functions
+                   use only the subset of the lattice selected by
+                   -sample_count or -sample_fraction
+@OUTPUT     : none
+@RETURNS    : nothing
+@DESCRIPTION: used by the simplex optimization for its coarse phase; the 
+              subset is drawn with a fixed seed, so it is the same for every
+              evaluation (and for every run).
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void set_source_lattice_sampling(VIO_BOOL on)
+{
+  source_lattice_sampling = on;
+}
+
+/* accumulate the xcorr sums over slice s of the lattice */
+
+static void xcorr_slice(VIO_Volume d2,
+                        VIO_Volume m2, 
+                        Arg_Data *globals,
+                        Source_lattice *lattice,
+                        Lattice_stepper *stepper,
+                        int s,
+                        Slice_sums *sums)
+{
+  long
+    row, n0;
+
+  int
+    k, n;
+
+  VIO_Real
+    value2[SOURCE_CHUNK],
+    x[SOURCE_CHUNK], y[SOURCE_CHUNK], z[SOURCE_CHUNK];
+
+  char
+    inside[SOURCE_CHUNK];
+
+  init_slice_sums(sums);
+  sums->count1 = lattice->slice_count1[s];
+
+  /* ---------- step through the source nodes of this slice ------------- */
+  for(row=lattice->slice_row[s]; row<lattice->slice_row[s+1]; row++) {
+    for(n0=lattice->row_start[row]; n0<lattice->row_start[row+1]; n0+=SOURCE_CHUNK) {
+
+      n = (int)(lattice->row_start[row+1] - n0);
+      if (n > SOURCE_CHUNK) n = SOURCE_CHUNK;
+
+      map_source_nodes(lattice, stepper, s, row, n0, n, x, y, z);
+      sample_target_nodes(stepper, m2, n, x, y, z, value2, inside, NULL);
+
+      for(k=0; k<n; k++) {
+        
+        if (inside[k]) {                /* in d2, and not masked */
+
+          if (value2[k] > globals->threshold[1] ) {
+                
+            sums->count2++;
+
+            sums->s1 += lattice->value[n0+k]*value2[k];
+            sums->s2 += lattice->square[n0+k];
+            sums->s3 += value2[k]*value2[k];
+                
+          } 
+              
+        } /* if voxel in d2 and not masked */
+      } /* for k */
+    } /* for n0 */
+  } /* for row */
+}
+
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : xcorr_objective
 @INPUT      : volumetric data, for use in correlation.  
@@ -200,39 +922,21 @@ float xcorr_objective(VIO_Volume d1,
                              Arg_Data *globals)
 {
 
-  VectorR
-    vector_step;
-
-  PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
-
   int
-    r,c,s;
+    s;
 
-  VIO_Real
-    value1, value2;
-  
-  VIO_Real
-    s1,s2,s3;                   /* to store the sums for f1,f2,f3 */
+  Slice_sums
+    total,                      /* to store the sums for f1,f2,f3 */
+    *sums;                      /* and their value for each slice */
   float 
     result;                                /* the result */
-  int 
-    count1,count2;
-
 
   Voxel_space_struct *vox_space;
   VIO_Transform          *trans;
+  Source_lattice         *lattice;
+  Lattice_stepper        stepper;
 
 
-                                /* prepare counters for this objective
-                                   function */
-  s1 = s2 = s3 = 0.0;
-  count1 = count2 = 0;
                                 /* prepare data for the voxel-to-voxel
                                    space transformation (instead of the
                                    general but inefficient world-world
@@ -244,89 +948,116 @@ float xcorr_objective(VIO_Volume d1,
 
   trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
 
+  lattice = get_source_lattice(SOURCE_XCORR, d1, m1, globals, vox_space);
+  init_lattice_stepper(&stepper, trans, lattice, d2);
 
                                 /* loop through all nodes of the lattice */
-                                                                                                                              
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+
+  ALLOC(sums, globals->count[SLICE_IND]);
 
   /* ---------- step through all slices of lattice ------------- */
-  for(s=0; s<globals->count[SLICE_IND]; s++) { 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<globals->count[SLICE_IND]; s++)
+    xcorr_slice(d2, m2, globals, lattice, &stepper, s, &sums[s]);
 
-    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+  init_slice_sums(&total);
+  for(s=0; s<globals->count[SLICE_IND]; s++) 
+    add_slice_sums(&total, &sums[s]);
 
-    /* ---------- step through all rows of lattice ------------- */
-    for(r=0; r<globals->count[ROW_IND]; r++) {
-      
-      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
-      
-      SCALE_POINT( col, row, 1.0); /* init first col position */
+  FREE(sums);
+  
+  result = 1.0 - total.s1 / (sqrt((double)total.s2)*sqrt((double)total.s3));
+  
+  if (globals->flags.debug) (void)print ("%7d %7d -> %10.8f\n",total.count1,total.count2,result);
+
+  release_source_lattice(lattice);
+  delete_voxel_space_struct(vox_space);
+
+  return (result);
+  
+}
+
+
+/* the zero crossings counted by ssc_objective() depend on the sign of
+   the previous difference, which is carried from one line (and slice)
+   of the lattice to the next.  So that slices can be counted
+   independently, each one is counted for both possible starting
+   signs (index 0: greater==TRUE, 1: greater==FALSE), and the slices
+   are chained together in order afterwards. */
+
+typedef struct {
+  VIO_BOOL      greater[2];
+  unsigned long zero_crossings[2];
+  int           count1, count2;
+} Ssc_sums;
+
+static void ssc_sample(VIO_Volume d1,
+                       VIO_Volume d2,
+                       VIO_Volume m1,
+                       VIO_Volume m2, 
+                       VIO_Transform *trans,
+                       PointR *col,
+                       Ssc_sums *sums)
+{
+  PointR
+    pos2,
+    voxel;
+  VIO_Real
+    value1, value2;
+  int
+    i;
 
-      /* ---------- step through all cols of lattice ------------- */
-      for(c=0; c<globals->count[COL_IND]; c++) {
-                
                                 /* use the voxel center closest to this lattice
                                    node. 
                                 */
-        fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
-
-
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
+  fill_Point( voxel, ROUND(Point_x(*col)), ROUND(Point_y(*col)), ROUND(Point_z(*col)) ); 
+        
+  if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
           
-          if (nearest_neighbour_interpolant( d1, &voxel, &value1 )) {
+    if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
 
-            count1++;
+      sums->count1++;
 
-            my_homogenous_transform_point(trans,
-                                          Point_x(voxel), Point_y(voxel), Point_z(voxel), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
+      my_homogenous_transform_point(trans,
+                                    Point_x(*col), Point_y(*col), Point_z(*col), 1.0,
+                                    &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
 
-         
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
+            
+      fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
         
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
+      if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
               
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
+        if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
 
+          sums->count2++;
 
-                if (value1 > globals->threshold[0] && value2 > globals->threshold[1] ) {
-                  
-                  count2++;
-
-                  s1 += value1*value2;
-                  s2 += value1*value1;
-                  s3 += value2*value2;
-                  
-                } 
+          for(i=0; i<2; i++) 
+            if (!((sums->greater[i] && value1>value2) || (!sums->greater[i] && value1<value2))) {
+              sums->greater[i] = !sums->greater[i];
+              sums->zero_crossings[i]++;
+            } 
                 
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
-        
-        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
-        
-      } /* for c */
-    } /* for r */
-  } /* for s */
-  
-  result = 1.0 - s1 / (sqrt((double)s2)*sqrt((double)s3));
-  
-  if (globals->flags.debug) (void)print ("%7d %7d -> %10.8f\n",count1,count2,result);
-
-  delete_voxel_space_struct(vox_space);
-
-  return (result);
-  
+        } /* if voxel in d2 */
+      } /* if point in mask volume two */
+    } /* if voxel in d1 */
+  } /* if point in mask volume one */
 }
 
-
-float ssc_objective(VIO_Volume d1,
-                           VIO_Volume d2,
-                           VIO_Volume m1,
-                           VIO_Volume m2, 
-                           Arg_Data *globals)
+/* count the zero crossings in slice (or column, for pass 2) `outer' of
+   the lattice, for pass 0, 1 or 2 of ssc_objective() */
+
+static void ssc_slice(VIO_Volume d1,
+                      VIO_Volume d2,
+                      VIO_Volume m1,
+                      VIO_Volume m2, 
+                      Arg_Data *globals,
+                      Voxel_space_struct *vox_space,
+                      VIO_Transform *trans,
+                      int pass,
+                      int outer,
+                      Ssc_sums *sums)
 {
   VectorR
     vector_step;
@@ -335,47 +1066,23 @@ float ssc_objective(VIO_Volume d1,
     starting_position,
     slice,
     row,
-    col,
-    pos2,
-    voxel;
+    col;
 
   int
     r,c,s;
 
-  VIO_Real
-    value1, value2;
-  
-  float 
-    result;                                /* the result */
-  int 
-    count1, count2,
-    greater;
-  unsigned  long
-    zero_crossings;
-  Voxel_space_struct *vox_space;
-  VIO_Transform          *trans;
-
-                                /* prepare counters for this objective
-                                   function */
-  greater = TRUE;
-  zero_crossings = count1 = count2 = 0;
-
-                                /* prepare data for the voxel-to-voxel
-                                   space transformation (instead of the
-                                   general but inefficient world-world
-                                   computations. */
-
-  vox_space = new_voxel_space_struct();
-  get_into_voxel_space(globals, vox_space, d1, d2);
-  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+  sums->greater[0] = TRUE;
+  sums->greater[1] = FALSE;
+  sums->zero_crossings[0] = sums->zero_crossings[1] = 0;
+  sums->count1 = sums->count2 = 0;
 
   fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
 
-  /* ------------------------  count along rows (fastest=col) first ------------------- */
+  switch (pass) {
 
+  case 0:         /* count along rows (fastest=col) first */
 
-  for(s=0; s<globals->count[SLICE_IND]; s++) {
-
+    s = outer;
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
@@ -387,50 +1094,17 @@ float ssc_objective(VIO_Volume d1,
       SCALE_POINT( col, row, 1.0); /* init first col position */
       for(c=0; c<globals->count[COL_IND]; c++) {
         
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
-
-            count1++;
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-        
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
-                count2++;
-
-                if (!((greater && value1>value2) || (!greater && value1<value2))) {
-                  greater = !greater;
-                  zero_crossings++;
-                } 
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
+        ssc_sample(d1, d2, m1, m2, trans, &col, sums);
         
         ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
         
       } /* for c */
     } /* for r */
-  } /* for s */
-
-  /* ------------------------  count along cols second  --(fastest=row)--------------- */
+    break;
 
-  for(s=0; s<globals->count[SLICE_IND]; s++) {
+  case 1:         /* count along cols second  (fastest=row) */
 
+    s = outer;
     SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
     ADD_POINT_VECTOR( slice, starting_position, vector_step );
 
@@ -443,53 +1117,17 @@ float ssc_objective(VIO_Volume d1,
 
       for(r=0; r<globals->count[ROW_IND]; r++) {
 
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
-
-            count1++;
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-        
-            if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
-                count2++;
-
-                if (!((greater && value1>value2) || (!greater && value1<value2))) {
-                  greater = !greater;
-                  zero_crossings++;
-                } 
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
+        ssc_sample(d1, d2, m1, m2, trans, &col, sums);
         
         ADD_POINT_VECTOR( row, row, vox_space->directions[ROW_IND] );
         
-      } /* for c */
-    } /* for r */
-  } /* for s */
-
-
-
+      } /* for r */
+    } /* for c */
+    break;
 
-  /* ------------------------  count along slices last ------------------------ */
+  default:        /* count along slices last */
 
-
-  for(c=0; c<globals->count[COL_IND]; c++) {
-    
+    c = outer;
     SCALE_VECTOR( vector_step, vox_space->directions[COL_IND], c);
     ADD_POINT_VECTOR( col, starting_position, vector_step );
 
@@ -502,45 +1140,84 @@ float ssc_objective(VIO_Volume d1,
 
       for(s=0; s<globals->count[SLICE_IND]; s++) {
         
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
+        ssc_sample(d1, d2, m1, m2, trans, &col, sums);
         
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+        ADD_POINT_VECTOR( slice, slice, vox_space->directions[SLICE_IND] );
+        
+      } /* for s */
+    } /* for r */
+    break;
+  }
+}
 
-            count1++;
+float ssc_objective(VIO_Volume d1,
+                           VIO_Volume d2,
+                           VIO_Volume m1,
+                           VIO_Volume m2, 
+                           Arg_Data *globals)
+{
+  int
+    pass, i, n_outer;
 
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
+  float 
+    result;                                /* the result */
+  int 
+    count1, count2,
+    greater;
+  unsigned  long
+    zero_crossings;
+  Ssc_sums
+    *sums;
+  Voxel_space_struct *vox_space;
+  VIO_Transform          *trans;
 
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
+                                /* prepare counters for this objective
+                                   function */
+  greater = TRUE;
+  zero_crossings = count1 = count2 = 0;
 
-                count2++;
+                                /* prepare data for the voxel-to-voxel
+                                   space transformation (instead of the
+                                   general but inefficient world-world
+                                   computations. */
 
-                if (!((greater && value1>value2) || (!greater && value1<value2))) {
-                  greater = !greater;
-                  zero_crossings++;
-                } 
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
-        
-        ADD_POINT_VECTOR( slice, slice, vox_space->directions[SLICE_IND] );
-        
-      } /* for c */
-    } /* for r */
-  } /* for s */
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  n_outer = globals->count[SLICE_IND];
+  if (n_outer < globals->count[COL_IND])
+    n_outer = globals->count[COL_IND];
+  ALLOC(sums, n_outer);
+
+  /* count along rows first, then along cols and along slices last,
+     chaining the slices (cols for the last pass) in order */
+
+  for(pass=0; pass<3; pass++) {
+
+    n_outer = (pass < 2) ? globals->count[SLICE_IND] : globals->count[COL_IND];
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for(i=0; i<n_outer; i++) 
+      ssc_slice(d1, d2, m1, m2, globals, vox_space, trans, pass, i, &sums[i]);
+
+    for(i=0; i<n_outer; i++) {
+      if (greater) {
+        zero_crossings += sums[i].zero_crossings[0];
+        greater         = sums[i].greater[0];
+      }
+      else {
+        zero_crossings += sums[i].zero_crossings[1];
+        greater         = sums[i].greater[1];
+      }
+      count1 += sums[i].count1;
+      count2 += sums[i].count2;
+    }
+  }
 
+  FREE(sums);
 
   result = -1.0 * (float)zero_crossings;
 
@@ -550,37 +1227,77 @@ float ssc_objective(VIO_Volume d1,
   
 }
 
+/* accumulate the zscore sums over slice s of the lattice */
+
+static void zscore_slice(VIO_Volume d2,
+                         VIO_Volume m2, 
+                         Arg_Data *globals,
+                         Source_lattice *lattice,
+                         Lattice_stepper *stepper,
+                         int s,
+                         Slice_sums *sums)
+{
+  long
+    row, n0;
+
+  int
+    k, n;
+
+  VIO_Real
+    value1, value2[SOURCE_CHUNK],
+    x[SOURCE_CHUNK], y[SOURCE_CHUNK], z[SOURCE_CHUNK];
+
+  char
+    inside[SOURCE_CHUNK];
+
+  init_slice_sums(sums);
+  sums->count1 = lattice->slice_count1[s];
+
+  for(row=lattice->slice_row[s]; row<lattice->slice_row[s+1]; row++) {
+    for(n0=lattice->row_start[row]; n0<lattice->row_start[row+1]; n0+=SOURCE_CHUNK) {
+
+      n = (int)(lattice->row_start[row+1] - n0);
+      if (n > SOURCE_CHUNK) n = SOURCE_CHUNK;
+
+      map_source_nodes(lattice, stepper, s, row, n0, n, x, y, z);
+      sample_target_nodes(stepper, m2, n, x, y, z, value2, inside, NULL);
+
+      for(k=0; k<n; k++) {
+        
+        if (inside[k]) {                /* in d2, and not masked */
+
+          sums->count2++;
+
+          if (fabs(value2[k]) > globals->threshold[1] ) {
+            value1 = lattice->value[n0+k];
+            sums->count3++;
+            sums->s1 +=  (value1-value2[k])*(value1-value2[k]);
+          } 
+              
+        } /* if voxel in d2 and not masked */
+      } /* for k */
+    } /* for n0 */
+  } /* for row */
+}
+
 float zscore_objective(VIO_Volume d1,
                            VIO_Volume d2,
                            VIO_Volume m1,
                            VIO_Volume m2, 
                            Arg_Data *globals)
 {
-  VectorR
-    vector_step;
-
-  PointR 
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
-
   int
-    r,c,s;
+    s;
 
-  VIO_Real
-    value1, value2;
-  
-  VIO_Real
-    z2_sum;
+  Slice_sums
+    total,                      /* z2_sum is total.s1 */
+    *sums;
   float 
     result;                                /* the result */
-  int 
-    count1,count2,count3;
   Voxel_space_struct *vox_space;
   VIO_Transform          *trans;
+  Source_lattice         *lattice;
+  Lattice_stepper        stepper;
 
 
                                 /* prepare data for the voxel-to-voxel
@@ -592,77 +1309,378 @@ float zscore_objective(VIO_Volume d1,
   get_into_voxel_space(globals, vox_space, d1, d2);
   trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
 
+  lattice = get_source_lattice(SOURCE_ZSCORE, d1, m1, globals, vox_space);
+  init_lattice_stepper(&stepper, trans, lattice, d2);
 
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
+  ALLOC(sums, globals->count[SLICE_IND]);
 
-  z2_sum = 0.0;
-  count1 = count2 = count3 = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<globals->count[SLICE_IND]; s++) 
+    zscore_slice(d2, m2, globals, lattice, &stepper, s, &sums[s]);
 
-  for(s=0; s<globals->count[SLICE_IND]; s++) {
+  init_slice_sums(&total);
+  for(s=0; s<globals->count[SLICE_IND]; s++) 
+    add_slice_sums(&total, &sums[s]);
 
-    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
+  FREE(sums);
 
-    for(r=0; r<globals->count[ROW_IND]; r++) {
-      
-      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
-      
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<globals->count[COL_IND]; c++) {
-        
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
+  if (total.count3 > 0)
+    result = sqrt((double)total.s1) / total.count3;
+  else
+    result = sqrt((double)total.s1);
 
-            count1++;
+  if (globals->flags.debug) (void)print ("%7d %7d %7d -> %10.8f\n",total.count1,total.count2,total.count3,result);
 
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-        
-            if (voxel_point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
+  release_source_lattice(lattice);
+  delete_voxel_space_struct(vox_space);
+  
+  return (result);
+  
+}
 
-                count2++;
 
-                if (fabs(value1) > globals->threshold[0] && fabs(value2) > globals->threshold[1] ) {
-                  count3++;
-                  z2_sum +=  (value1-value2)*(value1-value2);
-                } 
-        
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
-        
-        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
+
+/* The gradient of the xcorr and zscore objective functions with
+   respect to the voxel-to-voxel matrix M (3x4), computed in the same
+   lattice pass as the value, for the gradient based optimization of
+   the linear transformation.  A node x of the source lattice is
+   mapped to M.(x,1) in d2, so the derivative of value2 with respect
+   to M[i][j] is g[i]*(x,1)[j], where g is the gradient of d2 (in
+   voxel units) at the mapped node.  g comes from the trilinear
+   interpolant whichever interpolant is in use, and the masks and
+   thresholds, which only switch nodes on or off, are taken as
+   constant.
+
+   a[][] and b[][] hold the sums of (the derivative of value2) times
+   value1 and value2 for xcorr, and times value1-value2 for zscore. */
+
+typedef struct {
+  Slice_sums sums;
+  VIO_Real   a[3][4], b[3][4];
+} Gradient_sums;
+
+static void gradient_slice(int kind,
+                           VIO_Volume d2,
+                           VIO_Volume m2, 
+                           Arg_Data *globals,
+                           Source_lattice *lattice,
+                           Lattice_stepper *stepper,
+                           int s,
+                           Gradient_sums *grad)
+{
+  long
+    row, n0;
+
+  int
+    i, k, n;
+
+  VIO_Real
+    value1, wa, wb, *p, *g,
+    value2[SOURCE_CHUNK],
+    gradient[SOURCE_CHUNK][3],
+    x[SOURCE_CHUNK], y[SOURCE_CHUNK], z[SOURCE_CHUNK];
+
+  char
+    inside[SOURCE_CHUNK];
+
+  init_slice_sums(&grad->sums);
+  grad->sums.count1 = lattice->slice_count1[s];
+  for(i=0; i<3; i++)
+    for(k=0; k<4; k++)
+      grad->a[i][k] = grad->b[i][k] = 0.0;
+
+  for(row=lattice->slice_row[s]; row<lattice->slice_row[s+1]; row++) {
+    for(n0=lattice->row_start[row]; n0<lattice->row_start[row+1]; n0+=SOURCE_CHUNK) {
+
+      n = (int)(lattice->row_start[row+1] - n0);
+      if (n > SOURCE_CHUNK) n = SOURCE_CHUNK;
+
+      map_source_nodes(lattice, stepper, s, row, n0, n, x, y, z);
+      sample_target_nodes(stepper, m2, n, x, y, z, value2, inside, gradient);
+
+      for(k=0; k<n; k++) {
         
-      } /* for c */
-    } /* for r */
-  } /* for s */
+        if (!inside[k])         /* outside d2, or masked out by m2 */
+          continue;
+
+        value1 = lattice->value[n0+k];
+        wa = wb = 0.0;
+
+        if (kind == SOURCE_XCORR) {
+          if (value2[k] > globals->threshold[1]) {
+            grad->sums.count2++;
+            grad->sums.s1 += value1*value2[k];
+            grad->sums.s2 += lattice->square[n0+k];
+            grad->sums.s3 += value2[k]*value2[k];
+            wa = value1;
+            wb = value2[k];
+          }
+        }
+        else {
+          grad->sums.count2++;
+          if (fabs(value2[k]) > globals->threshold[1]) {
+            grad->sums.count3++;
+            grad->sums.s1 += (value1-value2[k])*(value1-value2[k]);
+            wa = value1-value2[k];
+          }
+        }
+
+        if (wa != 0.0 || wb != 0.0) {
+          p = &lattice->coord[3*(n0+k)];
+          g = gradient[k];
+          for(i=0; i<3; i++) {
+            grad->a[i][0] += wa*g[i]*p[0];
+            grad->a[i][1] += wa*g[i]*p[1];
+            grad->a[i][2] += wa*g[i]*p[2];
+            grad->a[i][3] += wa*g[i];
+            grad->b[i][0] += wb*g[i]*p[0];
+            grad->b[i][1] += wb*g[i]*p[1];
+            grad->b[i][2] += wb*g[i]*p[2];
+            grad->b[i][3] += wb*g[i];
+          }
+        }
+      } /* for k */
+    } /* for n0 */
+  } /* for row */
+}
 
-  if (count3 > 0)
-    result = sqrt((double)z2_sum) / count3;
-  else
-    result = sqrt((double)z2_sum);
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : objective_has_gradient
+@INPUT      : globals - command line info
+@OUTPUT     : 
+@RETURNS    : TRUE if objective_gradient() can be used for the selected
+              objective function (-xcorr and -zscore)
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+VIO_BOOL objective_has_gradient(Arg_Data *globals)
+{
+  return(globals->obj_function_type == XCORR ||
+         globals->obj_function_type == ZSCORE);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : objective_is_reentrant
+@INPUT      : globals - command line info
+@OUTPUT     : 
+@RETURNS    : TRUE if the selected objective function can be called from
+              several threads at once, each with its own copy of globals
+              and of its transformation (-xcorr, -zscore, -ssc and -vr)
+@DESCRIPTION: these objective functions keep no state between calls but
+              the cached source lattice, which all the calls share
+              read-only.  The mutual information ones keep their
+              histograms in static storage.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+VIO_BOOL objective_is_reentrant(Arg_Data *globals)
+{
+  return(globals->obj_function_type == XCORR ||
+         globals->obj_function_type == ZSCORE ||
+         globals->obj_function_type == SSC ||
+         globals->obj_function_type == VR);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : objective_gradient
+@INPUT      : d1,d2,m1,m2 - as for xcorr_objective() and zscore_objective()
+              globals - command line info, with the current transformation
+@OUTPUT     : dfdm - derivative of the objective function with respect to
+                 each element of the 3x4 voxel-to-voxel matrix (from d1
+                 voxels to d2 voxels, as built by get_into_voxel_space())
+@RETURNS    : the value of the objective function, as returned by
+              xcorr_objective() or zscore_objective()
+@DESCRIPTION: value and gradient are computed in a single pass over the
+              lattice; the source lattice is cached and sampled as for
+              the objective functions themselves.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+float objective_gradient(VIO_Volume d1,
+                         VIO_Volume d2,
+                         VIO_Volume m1,
+                         VIO_Volume m2, 
+                         Arg_Data *globals,
+                         VIO_Real dfdm[3][4])
+{
+  int
+    kind, s, i, j;
+
+  Gradient_sums
+    *grad;
+  Slice_sums
+    total;
+  VIO_Real
+    a[3][4], b[3][4],
+    norm;
+  float 
+    result;
+
+  Voxel_space_struct *vox_space;
+  VIO_Transform          *trans;
+  Source_lattice         *lattice;
+  Lattice_stepper        stepper;
+
+  kind = (globals->obj_function_type == XCORR) ? SOURCE_XCORR : SOURCE_ZSCORE;
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(globals, vox_space, d1, d2);
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  lattice = get_source_lattice(kind, d1, m1, globals, vox_space);
+  init_lattice_stepper(&stepper, trans, lattice, d2);
+
+  ALLOC(grad, globals->count[SLICE_IND]);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<globals->count[SLICE_IND]; s++) 
+    gradient_slice(kind, d2, m2, globals, lattice, &stepper, s, &grad[s]);
+
+  init_slice_sums(&total);
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++)
+      a[i][j] = b[i][j] = 0.0;
+
+  for(s=0; s<globals->count[SLICE_IND]; s++) {
+    add_slice_sums(&total, &grad[s].sums);
+    for(i=0; i<3; i++)
+      for(j=0; j<4; j++) {
+        a[i][j] += grad[s].a[i][j];
+        b[i][j] += grad[s].b[i][j];
+      }
+  }
+
+  FREE(grad);
+
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++)
+      dfdm[i][j] = 0.0;
+
+  if (kind == SOURCE_XCORR) {
+
+    result = 1.0 - total.s1 / (sqrt((double)total.s2)*sqrt((double)total.s3));
+
+                                /* f = 1 - s1 / sqrt(s2*s3) */
+    if (total.s2 > 0.0 && total.s3 > 0.0) {
+      norm = sqrt((double)total.s2)*sqrt((double)total.s3);
+      for(i=0; i<3; i++)
+        for(j=0; j<4; j++)
+          dfdm[i][j] = -a[i][j]/norm + total.s1*b[i][j]/(norm*total.s3);
+    }
+
+    if (globals->flags.debug) (void)print ("%7d %7d -> %10.8f\n",total.count1,total.count2,result);
+  }
+  else {
+
+    norm = (total.count3 > 0) ? total.count3 : 1.0;
+    result = sqrt((double)total.s1) / norm;
+
+                                /* f = sqrt(s1) / count3 */
+    if (total.s1 > 0.0)
+      for(i=0; i<3; i++)
+        for(j=0; j<4; j++)
+          dfdm[i][j] = -a[i][j] / (sqrt((double)total.s1)*norm);
+
+    if (globals->flags.debug) (void)print ("%7d %7d %7d -> %10.8f\n",total.count1,total.count2,total.count3,result);
+  }
+
+  release_source_lattice(lattice);
+  delete_voxel_space_struct(vox_space);
 
-  if (globals->flags.debug) (void)print ("%7d %7d %7d -> %10.8f\n",count1,count2,count3,result);
-  
   return (result);
-  
 }
 
 
+/* the ratio sums of one segment, kept together so that each sample
+   updates a single cache line */
+
+typedef struct {
+  double        sum;
+  double        sum2;
+  unsigned long count;
+} Vr_group_sums;
+
+/* accumulate the per-segment ratio sums of vr_objective() over slice s
+   of the lattice.  groups is indexed 1..groups */
+
+static void vr_slice(VIO_Volume d2,
+                     VIO_Volume m2, 
+                     Arg_Data *globals,
+                     Source_lattice *lattice,
+                     Lattice_stepper *stepper,
+                     int s,
+                     Vr_group_sums *groups,
+                     Slice_sums *sums)
+{
+  long
+    row, n0;
+
+  int
+    i,k,n,index;
+
+  VIO_Real
+    value2[SOURCE_CHUNK],
+    x[SOURCE_CHUNK], y[SOURCE_CHUNK], z[SOURCE_CHUNK];
+
+  char
+    inside[SOURCE_CHUNK];
+  
+  double
+    rat;
+
+  init_slice_sums(sums);
+  sums->count1 = lattice->slice_count1[s];
+
+  for(i=1; i<=segment_table->groups; i++) {
+    groups[i].sum   = 0.0;
+    groups[i].sum2  = 0.0;
+    groups[i].count = 0;
+  }
+
+  for(row=lattice->slice_row[s]; row<lattice->slice_row[s+1]; row++) {
+    for(n0=lattice->row_start[row]; n0<lattice->row_start[row+1]; n0+=SOURCE_CHUNK) {
+
+      n = (int)(lattice->row_start[row+1] - n0);
+      if (n > SOURCE_CHUNK) n = SOURCE_CHUNK;
+
+      map_source_nodes(lattice, stepper, s, row, n0, n, x, y, z);
+      sample_target_nodes(stepper, m2, n, x, y, z, value2, inside, NULL);
+
+      for(k=0; k<n; k++) {
+        
+        if (inside[k]) {                /* in d2, and not masked */
+
+          sums->count2++;
+
+          if (value2[k] > globals->threshold[1] && value2[k] != 0.0)  {
+
+            index = lattice->segment[n0+k];
+
+            if (index>0) {
+              rat = lattice->value[n0+k] / value2[k];
+              groups[index].count++;
+              groups[index].sum  += rat;
+              groups[index].sum2 += rat*rat;
+            }
+            else {
+              print_error_and_line_num("Cannot segment voxel value %f into one of %d groups.", 
+                                       __FILE__, __LINE__, 
+                                       CONVERT_VALUE_TO_VOXEL(lattice->d1, lattice->value[n0+k]),
+                                       segment_table->groups );
+              exit(EXIT_FAILURE);
+
+            }
+          } 
+              
+        } /* if voxel in d2 and not masked */
+      } /* for k */
+    } /* for n0 */
+  } /* for row */
+}
 
 float vr_objective(VIO_Volume d1,
                           VIO_Volume d2,
@@ -670,52 +1688,42 @@ float vr_objective(VIO_Volume d1,
                           VIO_Volume m2, 
                           Arg_Data *globals)
 {
-  VectorR
-    vector_step;
-
-  PointR
-    starting_position,
-    slice,
-    row,
-    col,
-    pos2,
-    voxel;
-
   int
-    r,c,s;
+    s;
 
-  VIO_Real
-    value1, value2,
-    voxel_value1;
-  
-  float
-    rat,
+  double
     total_variance,
-    *limits,
-    *rat_sum,
-    *rat2_sum,
-    *var;
+    var;
   unsigned long
-    total_count,
-    *count3;
+    total_count;
+
+  Vr_group_sums
+    *groups,
+    **slice_groups;
+
+  Slice_sums
+    total,
+    *sums;
 
   float 
     result;                                /* the result */
   int 
-    index,i,count1,count2;
+    index;
   Voxel_space_struct *vox_space;
   VIO_Transform          *trans;
+  Source_lattice         *lattice;
+  Lattice_stepper        stepper;
 
 
 
-                                /* build segmentation info!  */
+                                /* the segment of each source node is
+                                   computed once, with the source lattice;
+                                   here only the sums of each group, for
+                                   the whole lattice and for each slice */
 
-  ALLOC(rat_sum  ,1+segment_table->groups);
-  ALLOC(rat2_sum ,1+segment_table->groups);
-  ALLOC(var      ,1+segment_table->groups);
-  ALLOC(limits   ,1+segment_table->groups);
-
-  ALLOC(count3, (segment_table->groups+1));
+  ALLOC(groups, 1+segment_table->groups);
+  ALLOC2D(slice_groups, globals->count[SLICE_IND], 1+segment_table->groups);
+  ALLOC(sums, globals->count[SLICE_IND]);
 
                                 /* prepare data for the voxel-to-voxel
                                    space transformation (instead of the
@@ -726,109 +1734,58 @@ float vr_objective(VIO_Volume d1,
   get_into_voxel_space(globals, vox_space, d1, d2);
   trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
 
+  lattice = get_source_lattice(SOURCE_VR, d1, m1, globals, vox_space);
+  init_lattice_stepper(&stepper, trans, lattice, d2);
 
+                                /* loop through each slice of lattice */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<globals->count[SLICE_IND]; s++) 
+    vr_slice(d2, m2, globals, lattice, &stepper, s, slice_groups[s], &sums[s]);
 
-  fill_Point( starting_position, vox_space->start[VIO_X], vox_space->start[VIO_Y], vox_space->start[VIO_Z]);
-
-                                /* init running sums and counters. */
-  for(i=1; i<=segment_table->groups; i++) {
-    rat_sum[i] = 0.0;
-    rat2_sum[i] = 0.0;
-    count3[i]   = 0;
-    var[i] = 0.0;
+                                /* init running sums and counters, and
+                                   add up the slices in order */
+  for(index=1; index<=segment_table->groups; index++) {
+    groups[index].sum   = 0.0;
+    groups[index].sum2  = 0.0;
+    groups[index].count = 0;
   }
-  count1 = count2 = 0;
+  init_slice_sums(&total);
 
-                                /* loop through each node of lattice */
   for(s=0; s<globals->count[SLICE_IND]; s++) {
+    for(index=1; index<=segment_table->groups; index++) {
+      groups[index].sum   += slice_groups[s][index].sum;
+      groups[index].sum2  += slice_groups[s][index].sum2;
+      groups[index].count += slice_groups[s][index].count;
+    }
+    add_slice_sums(&total, &sums[s]);
+  }
 
-    SCALE_VECTOR( vector_step, vox_space->directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
-
-    for(r=0; r<globals->count[ROW_IND]; r++) {
-      
-      SCALE_VECTOR( vector_step, vox_space->directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
-      
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<globals->count[COL_IND]; c++) {
-        
-                                /* use the voxel center closest to this lattice
-                                   node. 
-                                */
-        fill_Point( voxel, ROUND(Point_x(col)), ROUND(Point_y(col)), ROUND(Point_z(col)) ); 
-        
-        if (voxel_point_not_masked(m1, Point_x(voxel), Point_y(voxel), Point_z(voxel))) {
-          
-          if (INTERPOLATE_TRUE_VALUE( d1, &voxel, &value1 )) {
-
-            count1++;
-            voxel_value1 = CONVERT_VALUE_TO_VOXEL(d1,value1 );
-
-
-            my_homogenous_transform_point(trans,
-                                          Point_x(col), Point_y(col), Point_z(col), 1.0,
-                                          &Point_x(pos2), &Point_y(pos2), &Point_z(pos2));
-            
-            fill_Point( voxel, Point_x(pos2), Point_y(pos2), Point_z(pos2) ); /* build the voxel POINT */
-        
-            if (voxel_point_not_masked(m2,Point_x(pos2), Point_y(pos2), Point_z(pos2) )) {
-              
-              if (INTERPOLATE_TRUE_VALUE( d2, &voxel, &value2 )) {
-
-                count2++;
-                /* voxel_value2 = CONVERT_VALUE_TO_VOXEL(d1,value2 ); */
-
-                if (value1 > globals->threshold[0] && value2 > globals->threshold[1]
-                    && value2 != 0.0)  {
-
-                  index = (*segment_table->segment)( voxel_value1, segment_table);
-
-                  if (index>0) {
-                    count3[index]++;
-                    rat = value1 / value2;
-                    rat_sum[index] += rat;
-                    rat2_sum[index] +=  rat*rat;
-                  }
-                  else {
-                    print_error_and_line_num("Cannot segment voxel value %d into one of %d groups.", 
-                                __FILE__, __LINE__, voxel_value1,segment_table->groups );
-                    exit(EXIT_FAILURE);
+  FREE2D(slice_groups);
+  FREE(sums);
 
-                  }
-                } 
-                
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
-        
-        ADD_POINT_VECTOR( col, col, vox_space->directions[COL_IND] );
-        
-      } /* for c */
-    } /* for r */
-  } /* for s */
+  release_source_lattice(lattice);
+  delete_voxel_space_struct(vox_space);
 
 
   total_variance = 0.0;
   total_count = 0;
 
   for(index=1; index<=segment_table->groups; index++) {
-    if (count3[index] > 1) 
-      total_count += count3[index];
+    if (groups[index].count > 1) 
+      total_count += groups[index].count;
   }
 
   if (total_count > 1) {
     for(index=1; index<=segment_table->groups; index++) {
-      if (count3[index] > 1) {
-        var[index]  = ((double)count3[index]*rat2_sum[index] - rat_sum[index]*rat_sum[index]) / 
-          ((double)count3[index]*((double)count3[index]-1.0));
+      if (groups[index].count > 1) {
+        var  = ((double)groups[index].count*groups[index].sum2 - 
+                groups[index].sum*groups[index].sum) / 
+          ((double)groups[index].count*((double)groups[index].count-1.0));
         
-        total_variance += ((double)count3[index]/(double)total_count) * var[index];
+        total_variance += ((double)groups[index].count/(double)total_count) * var;
       }
-      else
-        var[index] = 0.0;
     }
   }
   else
@@ -836,15 +1793,9 @@ float vr_objective(VIO_Volume d1,
 
   result = total_variance;
 
-  if (globals->flags.debug) print ("%7d %7d %7d -> %10.8f\n",count1,count2,count3[1],result);
-
-  FREE(rat_sum);
-  FREE(rat2_sum);
-  FREE(var);
-  FREE(limits);
-  FREE(count3);
-
+  if (globals->flags.debug) print ("%7d %7d %7d -> %10.8f\n",total.count1,total.count2,(int)groups[1].count,result);
 
+  FREE(groups);
 
   return (result);
   
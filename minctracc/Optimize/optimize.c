@@ -167,9 +167,11 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #endif
 
 #include <config.h>
+#include <string.h>
 #include <volume_io.h>
 #include <Proglib.h>
 #include <amoeba.h>
+#include <lbfgs.h>
 
 #include "constants.h"
 #include "arg_data.h"
@@ -177,6 +179,8 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include "make_rots.h"
 #include "segment_table.h"
 #include "quaternion.h"
+#include "vox_space.h"
+#include "interpolation.h"
 
 #include "local_macros.h"
 
@@ -188,6 +192,7 @@ int      Ginverse_mapping_flag, Gndim;
 extern   double   ftol ;        
 extern   double   simplex_size ;
 extern   VIO_Real     initial_corr, final_corr;
+extern   int      Brick_volumes;
 
          Segment_Table  *segment_table;        /* for variance of ratios */
 
@@ -363,6 +368,179 @@ inline static VIO_BOOL in_limits(double x,double lower,double upper)
     return lower <= x && x <= upper;
 }
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit cache
+@DESCRIPTION: the simplex asks for the objective function at points it
+              has already evaluated: the vertices it starts from, the
+              best point it ends on, and the restarts done by
+              -multi_start and -sample_*.  Between begin_fit_cache() and
+              end_fit_cache(), fit_function() and fit_function_quater()
+              remember their values in a direct-mapped table, keyed on the
+              parameter vector and on the stage (full lattice or subset).
+
+              The key is the float vector passed to the fit functions,
+              bit for bit: nothing finer changes the transformation, and
+              anything coarser would change the result of the simplex.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+#define FIT_CACHE_SIZE  2048    /* entries, a power of two */
+
+typedef struct {
+  int      stage;               /* -1 if the entry is empty */
+  float    params[12];
+  VIO_Real value;
+} Fit_cache_entry;
+
+static Fit_cache_entry *fit_cache = NULL;
+static int              fit_cache_ndim;
+static int              fit_cache_stage;
+static long             fit_cache_hits, fit_cache_misses;
+
+static void begin_fit_cache(Arg_Data *globals)
+{
+  int i;
+
+  ALLOC(fit_cache, FIT_CACHE_SIZE);
+  for(i=0; i<FIT_CACHE_SIZE; i++)
+    fit_cache[i].stage = -1;
+
+  fit_cache_ndim = 0;
+  for(i=0; i<12; i++)
+    if (globals->trans_info.weights[i] != 0.0) fit_cache_ndim++;
+
+  fit_cache_stage  = 0;
+  fit_cache_hits   = 0;
+  fit_cache_misses = 0;
+}
+
+static void end_fit_cache(Arg_Data *globals)
+{
+  if (globals->flags.debug) 
+    (void)print("fit cache: %ld hits, %ld misses\n", 
+                fit_cache_hits, fit_cache_misses);
+
+  FREE(fit_cache);
+  fit_cache = NULL;
+}
+
+static Fit_cache_entry *fit_cache_entry(float *params)
+{
+  unsigned char *byte;
+  unsigned long hash;
+  int i;
+
+  hash = 2166136261UL ^ (unsigned long)fit_cache_stage;
+  byte = (unsigned char *)&params[1];
+  for(i=0; i<fit_cache_ndim*(int)sizeof(float); i++) {
+    hash ^= byte[i];
+    hash *= 16777619UL;
+  }
+
+  return(&fit_cache[hash & (FIT_CACHE_SIZE-1)]);
+}
+
+/* the value for params[1..ndim], if it is in the cache */
+static VIO_BOOL fit_cache_lookup(float *params, float *value)
+{
+  Fit_cache_entry *entry;
+
+  if (fit_cache == NULL)
+    return(FALSE);
+
+  entry = fit_cache_entry(params);
+  if (entry->stage == fit_cache_stage &&
+      memcmp(entry->params, &params[1], fit_cache_ndim*sizeof(float)) == 0) {
+    fit_cache_hits++;
+    *value = (float)entry->value;
+    return(TRUE);
+  }
+
+  fit_cache_misses++;
+  return(FALSE);
+}
+
+static void fit_cache_store(float *params, float value)
+{
+  Fit_cache_entry *entry;
+
+  if (fit_cache == NULL)
+    return;
+
+  entry = fit_cache_entry(params);
+  entry->stage = fit_cache_stage;
+  (void)memcpy(entry->params, &params[1], fit_cache_ndim*sizeof(float));
+  entry->value = value;
+}
+
+/* switch the objective functions between the lattice subset of -sample_*
+   and the full lattice; the two stages are cached separately */
+static void set_lattice_sampling(VIO_BOOL on)
+{
+  set_source_lattice_sampling(on);
+  fit_cache_stage = on ? 1 : 0;
+}
+
+static VIO_BOOL fit_transformation(Arg_Data *args, float *params, VIO_BOOL report);
+static VIO_BOOL fit_transformation_quater(Arg_Data *args, float *params, VIO_BOOL report);
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : new_fit_args, delete_fit_args
+@INPUT      : args - (delete_fit_args) a copy from new_fit_args()
+@OUTPUT     : 
+@RETURNS    : (new_fit_args) a copy of main_args with its own transformation
+@DESCRIPTION: the state of one of several evaluations of the objective
+              function run at once, when objective_is_reentrant().  Only
+              the transformation is copied: the volumes, the features and
+              the cached source lattice are shared read-only.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+Arg_Data *new_fit_args(void)
+{
+  Arg_Data *args;
+
+  ALLOC(args, 1);
+  *args = main_args;
+  ALLOC(args->trans_info.transformation, 1);
+  copy_general_transform(main_args.trans_info.transformation, 
+                         args->trans_info.transformation);
+
+  return(args);
+}
+
+void delete_fit_args(Arg_Data *args)
+{
+  delete_general_transform(args->trans_info.transformation);
+  FREE(args->trans_info.transformation);
+  FREE(args);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_function_args
+@INPUT      : args - a copy of main_args from new_fit_args()
+              params - a variable length array of floats
+              quater - TRUE if the rotations are given as quaternions
+@OUTPUT     : 
+@RETURNS    : the value of fit_function() or fit_function_quater() for
+              params, computed with the transformation of args
+@DESCRIPTION: for the evaluations run concurrently; the fit cache is not
+              used, as it is not shared between threads.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+float fit_function_args(Arg_Data *args, float *params, VIO_BOOL quater)
+{
+  VIO_BOOL ok;
+
+  ok = quater ? fit_transformation_quater(args, params, FALSE) : 
+                fit_transformation(args, params, FALSE);
+  if (!ok)
+    return(1e10);
+
+  return( (args->obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,args) );
+}
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : fit_function
 @INPUT      : params - a variable length array of floats
@@ -378,11 +556,43 @@ inline static VIO_BOOL in_limits(double x,double lower,double upper)
 ---------------------------------------------------------------------------- */
 
 float fit_function(float *params) 
+{
+  float r;
+
+  if (fit_cache_lookup(params, &r))
+    return(r);
+
+  if (fit_transformation(&main_args, params, TRUE))
+    r = (main_args.obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,&main_args);
+  else
+    r = 1e10;
+
+  fit_cache_store(params, r);
+
+  return(r);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_transformation
+@INPUT      : args - main_args, or a copy from new_fit_args()
+              params - a variable length array of floats
+              report - TRUE to print the parameters found out of limits
+@OUTPUT     : 
+@RETURNS    : FALSE if the parameters are out of limits, TRUE otherwise
+@DESCRIPTION: build the transformation for params into
+              args->trans_info.transformation, for fit_function()
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+
+static VIO_BOOL fit_transformation(Arg_Data *args, float *params, VIO_BOOL report) 
 {
 
   VIO_Transform *mat;
   int i;
-  float r;
 
 
   double trans[3];
@@ -392,19 +602,19 @@ float fit_function(float *params)
   double shear[6];
 
 
-  for(i=0; i<3; i++) {                /* set default values from GLOBAL MAIN_ARGS */
-    shear[i] = main_args.trans_info.shears[i];
-    scale[i] = main_args.trans_info.scales[i];
-    trans[i] = main_args.trans_info.translations[i];
-    rots[i]  = main_args.trans_info.rotations[i];
-    cent[i]  = main_args.trans_info.center[i];
+  for(i=0; i<3; i++) {                /* set default values from args */
+    shear[i] = args->trans_info.shears[i];
+    scale[i] = args->trans_info.scales[i];
+    trans[i] = args->trans_info.translations[i];
+    rots[i]  = args->trans_info.rotations[i];
+    cent[i]  = args->trans_info.center[i];
   }
 
 
                                 /* modify the parameters to be optimized */
-  vector_to_parameters(trans, rots, scale, shear, params, main_args.trans_info.weights);
+  vector_to_parameters(trans, rots, scale, shear, params, args->trans_info.weights);
   
-  if (main_args.trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
+  if (args->trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
                                                          /* if 7 parameter fit.  */
     scale[1] = scale[0];
     scale[2] = scale[0];
@@ -422,7 +632,8 @@ float fit_function(float *params)
 
     {
 
- (void)printf("out : %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c \n",
+    if (report)
+      (void)printf("out : %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c \n",
        rots[0], in_limits(rots[0], (double)-3.1415927/2.0, (double)3.1415927/2.0) ? 'T': 'F' , 
        rots[1], in_limits(rots[1], (double)-3.1415927/2.0, (double)3.1415927/2.0) ? 'T': 'F' , 
        rots[2], in_limits(rots[2], (double)-3.1415927/2.0, (double)3.1415927/2.0) ? 'T': 'F' , 
@@ -433,33 +644,32 @@ float fit_function(float *params)
        shear[1],in_limits(shear[1], (double)-2.0, (double)2.0)? 'T': 'F' , 
        shear[2],in_limits(shear[2], (double)-2.0, (double)2.0)? 'T': 'F' );
 
-    r = 1e10;
+    return(FALSE);
   }
   else {
                                 /* get the linear transformation ptr */
 
-    if (get_transform_type(main_args.trans_info.transformation) == CONCATENATED_TRANSFORM) {
+    if (get_transform_type(args->trans_info.transformation) == CONCATENATED_TRANSFORM) {
       mat = get_linear_transform_ptr(
-             get_nth_general_transform(main_args.trans_info.transformation,0));
+             get_nth_general_transform(args->trans_info.transformation,0));
     }
     else
-      mat = get_linear_transform_ptr(main_args.trans_info.transformation);
+      mat = get_linear_transform_ptr(args->trans_info.transformation);
     
     if (Ginverse_mapping_flag)
       build_inverse_transformation_matrix(mat, cent, trans, scale, shear, rots);
     else
       build_transformation_matrix(mat, cent, trans, scale, shear, rots);
-    
-    /* call the needed objective function */
-    
-    r = (main_args.obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,&main_args);
   }
 
-  return(r);
+  return(TRUE);
 }
 
 
-VIO_Real amoeba_obj_function(void *dummy, float d[])
+/* the amoeba functions evaluate the objective for main_args, through
+   the fit cache, unless they are given the Arg_Data of a thread */
+
+VIO_Real amoeba_obj_function(void *data, float d[])
 {
   int i;
   float p[13];
@@ -467,6 +677,9 @@ VIO_Real amoeba_obj_function(void *dummy, float d[])
   for(i=0; i<Gndim; i++)
     p[i+1] = d[i];
   
+  if (data != NULL)
+    return ( (VIO_Real)fit_function_args((Arg_Data *)data, p, FALSE) );
+
   return ( (VIO_Real)fit_function(p) );
 }
 
@@ -485,11 +698,42 @@ VIO_Real amoeba_obj_function(void *dummy, float d[])
 ---------------------------------------------------------------------------- */
 
 float fit_function_quater(float *params) 
+{
+  float r;
+
+  if (fit_cache_lookup(params, &r))
+    return(r);
+
+  if (fit_transformation_quater(&main_args, params, TRUE))
+    r = (main_args.obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,&main_args);
+  else
+    r = 1e10;
+
+  fit_cache_store(params, r);
+
+  return(r);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_transformation_quater
+@INPUT      : args - main_args, or a copy from new_fit_args()
+              params - a variable length array of floats
+              report - TRUE to print the parameters found out of limits
+@OUTPUT     : 
+@RETURNS    : FALSE if the parameters are out of limits, TRUE otherwise
+@DESCRIPTION: same as fit_transformation but with quaternions
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+
+static VIO_BOOL fit_transformation_quater(Arg_Data *args, float *params, VIO_BOOL report) 
 {
 
   VIO_Transform *mat;
   int i;
-  float r;
 
 
   double trans[3];
@@ -499,19 +743,19 @@ float fit_function_quater(float *params)
   double quats[4];
 
 
-  for(i=0; i<3; i++) {                /* set default values from GLOBAL MAIN_ARGS */
-    shear[i] = main_args.trans_info.shears[i];
-    scale[i] = main_args.trans_info.scales[i];
-    trans[i] = main_args.trans_info.translations[i];
-    cent[i]  = main_args.trans_info.center[i];
-    quats[i] = main_args.trans_info.quaternions[i];
+  for(i=0; i<3; i++) {                /* set default values from args */
+    shear[i] = args->trans_info.shears[i];
+    scale[i] = args->trans_info.scales[i];
+    trans[i] = args->trans_info.translations[i];
+    cent[i]  = args->trans_info.center[i];
+    quats[i] = args->trans_info.quaternions[i];
   }
 
 
                                 /* modify the parameters to be optimized */
-  vector_to_parameters_quater(trans, quats, scale, shear, params, main_args.trans_info.weights);
+  vector_to_parameters_quater(trans, quats, scale, shear, params, args->trans_info.weights);
   
-  if (main_args.trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
+  if (args->trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
                                                          /* if 7 parameter fit.  */
     scale[1] = scale[0];
     scale[2] = scale[0];
@@ -529,7 +773,8 @@ float fit_function_quater(float *params)
 
     {
 
- (void)printf("out : %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c \n",
+    if (report)
+      (void)printf("out : %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c   %7.4f=%c %7.4f=%c %7.4f=%c \n",
        quats[0], in_limits(quats[0], (double)-2.0, (double)2.0) ? 'T': 'F' , 
        quats[1], in_limits(quats[1], (double)-2.0, (double)2.0) ? 'T': 'F' , 
        quats[2], in_limits(quats[2], (double)-2.0, (double)2.0) ? 'T': 'F' , 
@@ -540,35 +785,31 @@ float fit_function_quater(float *params)
        shear[1],in_limits(shear[1], (double)-2.0, (double)2.0)? 'T': 'F' , 
        shear[2],in_limits(shear[2], (double)-2.0, (double)2.0)? 'T': 'F' );
 
-    r = 1e10;
+    return(FALSE);
   }
   else {
     quats[3]=sqrt(1-SQR(quats[0])-SQR(quats[1])-SQR(quats[2]));
 
                                 /* get the linear transformation ptr */
 
-    if (get_transform_type(main_args.trans_info.transformation) == CONCATENATED_TRANSFORM) {
+    if (get_transform_type(args->trans_info.transformation) == CONCATENATED_TRANSFORM) {
       mat = get_linear_transform_ptr(
-             get_nth_general_transform(main_args.trans_info.transformation,0));
+             get_nth_general_transform(args->trans_info.transformation,0));
     }
     else
-      mat = get_linear_transform_ptr(main_args.trans_info.transformation);
+      mat = get_linear_transform_ptr(args->trans_info.transformation);
     
     if (Ginverse_mapping_flag)
       build_inverse_transformation_matrix_quater(mat, cent, trans, scale, shear, quats);
     else
       build_transformation_matrix_quater(mat, cent, trans, scale, shear, quats);
-    
-    /* call the needed objective function */
-    
-    r = (main_args.obj_function)(Gdata1,Gdata2,Gmask1,Gmask2,&main_args);
   }
 
-  return(r);
+  return(TRUE);
 }
 
 
-VIO_Real amoeba_obj_function_quater(void *dummy, float d[])
+VIO_Real amoeba_obj_function_quater(void *data, float d[])
 {
   int i;
   float p[13];
@@ -576,10 +817,478 @@ VIO_Real amoeba_obj_function_quater(void *dummy, float d[])
   for(i=0; i<Gndim; i++)
     p[i+1] = d[i];
   
+  if (data != NULL)
+    return ( (VIO_Real)fit_function_args((Arg_Data *)data, p, TRUE) );
+
   return ( (VIO_Real)fit_function_quater(p) );
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : fit_voxel_matrix
+@INPUT      : none - uses the transformation in main_args
+@OUTPUT     : m - the voxel-to-voxel matrix from Gdata1 to Gdata2
+@RETURNS    : nothing
+@DESCRIPTION: the matrix used by the objective functions to map the
+              lattice, for the current transformation.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void fit_voxel_matrix(VIO_Real m[3][4])
+{
+  Voxel_space_struct *vox_space;
+  VIO_Transform      *trans;
+  int                i,j;
+
+  vox_space = new_voxel_space_struct();
+  get_into_voxel_space(&main_args, vox_space, Gdata1, Gdata2);
+  trans = get_linear_transform_ptr(vox_space->voxel_to_voxel_space);
+
+  for(i=0; i<3; i++)
+    for(j=0; j<4; j++)
+      m[i][j] = Transform_elem(*trans,i,j);
+
+  delete_voxel_space_struct(vox_space);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : lbfgs_fit
+@INPUT      : d - parameters [0..Gndim-1]
+              quater - TRUE for the quaternion parameters
+@OUTPUT     : gradient - derivative of the objective function with respect
+                 to each parameter
+@RETURNS    : the value of the objective function, as fit_function()
+@DESCRIPTION: objective_gradient() gives the value and the derivatives with
+              respect to the voxel-to-voxel matrix in one pass over the
+              lattice.  These are chained to the parameters with central
+              differences of the matrix, which only needs the matrix to be
+              rebuilt, not the lattice to be sampled again.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+#define LBFGS_MATRIX_STEP 0.05  /* parameter step for the matrix derivatives */
+
+static VIO_Real lbfgs_fit(VIO_Real d[], VIO_Real gradient[], VIO_BOOL quater)
+{
+  int 
+    i,j,k;
+  float
+    p[13], p_plus, p_minus;
+  VIO_Real
+    r,
+    dfdm[3][4], m_plus[3][4], m_minus[3][4],
+    sum;
+  VIO_BOOL
+    ok;
+
+  for(i=0; i<Gndim; i++) {
+    p[i+1] = d[i];
+    gradient[i] = 0.0;
+  }
+
+  ok = quater ? fit_transformation_quater(&main_args, p, TRUE) : fit_transformation(&main_args, p, TRUE);
+  if (!ok)
+    return(1e10);
+
+  r = objective_gradient(Gdata1,Gdata2,Gmask1,Gmask2,&main_args,dfdm);
+
+  for(k=1; k<=Gndim; k++) {
+
+    p_plus  = p[k] + LBFGS_MATRIX_STEP;
+    p_minus = p[k] - LBFGS_MATRIX_STEP;
+
+    p[k] = p_plus;
+    ok = quater ? fit_transformation_quater(&main_args, p, FALSE) : fit_transformation(&main_args, p, FALSE);
+    if (ok) {
+      fit_voxel_matrix(m_plus);
+      p[k] = p_minus;
+      ok = quater ? fit_transformation_quater(&main_args, p, FALSE) : fit_transformation(&main_args, p, FALSE);
+    }
+    if (ok) {
+      fit_voxel_matrix(m_minus);
+      sum = 0.0;
+      for(i=0; i<3; i++)
+        for(j=0; j<4; j++)
+          sum += dfdm[i][j] * (m_plus[i][j] - m_minus[i][j]);
+      gradient[k-1] = sum / ((VIO_Real)p_plus - (VIO_Real)p_minus);
+    }
+
+    p[k] = d[k-1];
+  }
+                                /* leave the transformation at d[] */
+  if (quater)
+    (void)fit_transformation_quater(&main_args, p, FALSE);
+  else
+    (void)fit_transformation(&main_args, p, FALSE);
+
+  return(r);
+}
+
+static VIO_Real lbfgs_obj_function(void *dummy, VIO_Real d[], VIO_Real gradient[])
+{
+  return( lbfgs_fit(d, gradient, FALSE) );
+}
+
+static VIO_Real lbfgs_obj_function_quater(void *dummy, VIO_Real d[], VIO_Real gradient[])
+{
+  return( lbfgs_fit(d, gradient, TRUE) );
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : lattice_sampling_requested
+@INPUT      : globals - command line info
+@OUTPUT     : 
+@RETURNS    : TRUE if the coarse optimization steps should use a subset of
+              the lattice
+@DESCRIPTION: -sample_count or -sample_fraction was given, for one of the
+              objective functions that use the source lattice (-xcorr,
+              -zscore and -vr).
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL lattice_sampling_requested(Arg_Data *globals)
+{
+  return((globals->sample_count > 0 || 
+          (globals->sample_fraction > 0.0 && globals->sample_fraction < 1.0)) &&
+         (globals->obj_function == xcorr_objective ||
+          globals->obj_function == zscore_objective ||
+          globals->obj_function == vr_objective));
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : sampled_simplex
+@INPUT      : ndim - number of parameters
+              parameters - starting point of the simplex [0..ndim-1]
+              function - amoeba_obj_function or amoeba_obj_function_quater
+              globals - command line info
+@OUTPUT     : parameters - best point found on the lattice subset
+@RETURNS    : the simplex radius for the final optimization
+@DESCRIPTION: when -sample_count or -sample_fraction was given for one of the
+              objective functions that use the source lattice (-xcorr, -zscore
+              and -vr), the simplex is first run on a fixed random subset of
+              the lattice nodes.  The final optimization, down to ftol, is then
+              done on the full lattice, starting from the point found, with a
+              smaller simplex.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_Real sampled_simplex(int ndim,
+                                VIO_Real parameters[],
+                                amoeba_function function,
+                                Arg_Data *globals)
+{
+  amoeba_struct 
+    the_amoeba;
+  int 
+    iteration_number;
+
+  if (!lattice_sampling_requested(globals))
+    return(simplex_size);
+
+  set_lattice_sampling(TRUE);
+
+  initialize_amoeba(&the_amoeba, ndim, parameters, 
+                    simplex_size, function, 
+                    NULL, (VIO_Real)ftol);
+
+  iteration_number = 0;
+  while ( iteration_number<400 && perform_amoeba(&the_amoeba, &iteration_number) ) 
+    /* empty */ ;
+
+  (void)get_amoeba_parameters(&the_amoeba,parameters);
+  terminate_amoeba(&the_amoeba);
+
+  set_lattice_sampling(FALSE);
+
+  if (globals->flags.debug) 
+    (void)print("done with sub-sampled simplex after %d iterations\n",iteration_number);
+
+  return(simplex_size * 0.5);
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : start_rotation_offsets
+@INPUT      : step, max - spacing and extent of the rotation grid, in degrees
+              weight - optimization weight of the rotation
+@OUTPUT     : offsets - 0, +-step, +-2*step, ... up to +-max, in radians
+@RETURNS    : number of offsets
+@DESCRIPTION: offsets tried about one axis by multi_start_simplex().  Only
+              the null offset is returned for a rotation that is not
+              optimized.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+#define MULTI_START_MAX_STEPS 6    /* grid offsets on each side of an axis */
+#define MULTI_START_ITERS   100    /* simplex iterations for a refined start */
+
+static int start_rotation_offsets(double step, 
+                                  double max, 
+                                  double weight,
+                                  double offsets[])
+{
+  int i, n;
+
+  n = 0;
+  offsets[n++] = 0.0;
+  if (weight != 0.0 && step > 0.0)
+    for(i=1; i<=MULTI_START_MAX_STEPS && i*step <= max*(1.0+1e-6); i++) {
+      offsets[n++] =  i * step * 3.1415927/180.0;
+      offsets[n++] = -i * step * 3.1415927/180.0;
+    }
+
+  return(n);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : multi_start_simplex
+@INPUT      : ndim - number of parameters
+              parameters - starting point of the simplex [0..ndim-1]
+              function - amoeba_obj_function or amoeba_obj_function_quater
+              globals - command line info
+              quater - TRUE if the rotations are given as quaternions
+@OUTPUT     : parameters - best of the refined starting points
+@RETURNS    : 
+@DESCRIPTION: with -multi_start K, a set of starting points is generated
+              around the initial transformation: a grid of rotations
+              (-start_rotations), quarter turns about each axis
+              (-start_flips) and translation offsets along each axis
+              (-start_translations).  The objective is evaluated once at
+              each start, on the lattice subset of -sample_count or
+              -sample_fraction when one is given, and a short simplex is
+              run from the K best of them.  The initial transformation is
+              always among the refined starts.  The best point found
+              replaces the initial parameters.
+
+              When objective_is_reentrant(), the starts are evaluated
+              concurrently, and the K refinements run at the same time,
+              one per thread, each with its own copy of main_args (see
+              new_fit_args()); the source lattice is shared.  Otherwise,
+              the starts are evaluated one after the other, each
+              evaluation being spread over the threads.
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static void multi_start_simplex(int ndim,
+                                VIO_Real parameters[],
+                                amoeba_function function,
+                                Arg_Data *globals,
+                                VIO_BOOL quater)
+{
+  amoeba_struct 
+    the_amoeba;
+  Arg_Data
+    *args;
+  int 
+    iteration_number,
+    n_offsets[3], n_rots, n_shifts, n_starts, n_refine,
+    i, j, k, a, best, *order, *iterations;
+  double 
+    offsets[3][2*MULTI_START_MAX_STEPS+1],
+    shifts[7][3],
+    **rots,
+    trans[3], rot[3], quats[4], scale[3], shear[6],
+    dq[4], axis[3], mag;
+  VIO_Real 
+    **starts, *values, **refined, *refined_values;
+  float 
+    *p, q[12];
+  VIO_BOOL 
+    sampling, reentrant, *skip;
+
+                                /* rotations: the grid, then the flips */
+  for(a=0; a<3; a++)
+    n_offsets[a] = start_rotation_offsets(globals->start_rotations[0],
+                                          globals->start_rotations[1],
+                                          globals->trans_info.weights[3+a],
+                                          offsets[a]);
+
+  n_rots = n_offsets[0] * n_offsets[1] * n_offsets[2];
+  ALLOC2D(rots, n_rots + 6, 3);
+  k = 0;
+  for(i=0; i<n_offsets[0]; i++)
+    for(j=0; j<n_offsets[1]; j++)
+      for(a=0; a<n_offsets[2]; a++) {
+        rots[k][0] = offsets[0][i];
+        rots[k][1] = offsets[1][j];
+        rots[k][2] = offsets[2][a];
+        k++;
+      }
+  if (globals->start_flips && globals->start_rotations[1] < 90.0)
+    for(a=0; a<3; a++)
+      if (globals->trans_info.weights[3+a] != 0.0) 
+        for(i=-1; i<=1; i+=2) {
+          rots[k][0] = rots[k][1] = rots[k][2] = 0.0;
+          rots[k][a] = i * 3.1415927/2.0;
+          k++;
+        }
+  n_rots = k;
+                                /* translations along each axis */
+  n_shifts = 1;
+  shifts[0][0] = shifts[0][1] = shifts[0][2] = 0.0;
+  if (globals->start_jitter > 0.0)
+    for(a=0; a<3; a++)
+      if (globals->trans_info.weights[a] != 0.0) 
+        for(i=-1; i<=1; i+=2) {
+          shifts[n_shifts][0] = shifts[n_shifts][1] = shifts[n_shifts][2] = 0.0;
+          shifts[n_shifts][a] = i * globals->start_jitter;
+          n_shifts++;
+        }
+
+  n_starts = n_rots * n_shifts;
+  ALLOC2D(starts, n_starts, ndim);
+  ALLOC(values, n_starts);
+  ALLOC(order, n_starts);
+  ALLOC(skip, n_starts);
+  ALLOC(p, ndim+1+1);
+
+  sampling = lattice_sampling_requested(globals);
+  if (sampling)
+    set_lattice_sampling(TRUE);
+
+  reentrant = objective_is_reentrant(globals);
+
+                                /* the starting points; start 0 is the
+                                   initial transformation */
+  for(k=0; k<n_starts; k++) {
+    for(i=0; i<3; i++) {
+      trans[i] = globals->trans_info.translations[i] + shifts[k % n_shifts][i];
+      rot[i]   = globals->trans_info.rotations[i] + rots[k / n_shifts][i];
+      quats[i] = globals->trans_info.quaternions[i];
+      scale[i] = globals->trans_info.scales[i];
+      shear[i] = globals->trans_info.shears[i];
+      shear[i+3] = 0.0;
+    }
+
+    if (quater) {
+      quats[3] = sqrt(1-SQR(quats[0])-SQR(quats[1])-SQR(quats[2]));
+      for(a=0; a<3; a++) 
+        if (rots[k / n_shifts][a] != 0.0) {
+          axis[0] = axis[1] = axis[2] = 0.0;
+          axis[a] = 1.0;
+          axis_to_quat(axis, rots[k / n_shifts][a], dq);
+          add_quats(dq, quats, quats);
+        }
+      mag = sqrt(SQR(quats[0])+SQR(quats[1])+SQR(quats[2])+SQR(quats[3]));
+      if (quats[3] < 0.0) mag = -mag;
+      for(i=0; i<4; i++) 
+        quats[i] /= mag;
+      parameters_to_vector_quater(trans, quats, scale, shear, p, 
+                                  globals->trans_info.weights);
+    }
+    else {
+      parameters_to_vector(trans, rot, scale, shear, p, 
+                           globals->trans_info.weights);
+    }
+
+    for(i=0; i<ndim; i++)
+      starts[k][i] = (VIO_Real)p[i+1];
+
+                                /* fit_function() refuses rotations
+                                   beyond +-90 degrees */
+    skip[k] = (!quater && (fabs(rot[0]) > 3.1415927/2.0 ||
+                           fabs(rot[1]) > 3.1415927/2.0 ||
+                           fabs(rot[2]) > 3.1415927/2.0));
+    values[k] = 1e10;
+  }
+
+                                /* coarse evaluation of every start */
+#ifdef _OPENMP
+#pragma omp parallel if (reentrant) private(args, i, q)
+#endif
+  {
+    args = reentrant ? new_fit_args() : NULL;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for(k=0; k<n_starts; k++) 
+      if (!skip[k]) {
+        for(i=0; i<ndim; i++)
+          q[i] = (float)starts[k][i];
+        values[k] = (*function)(args, q);
+      }
+
+    if (args != NULL)
+      delete_fit_args(args);
+  }
+
+                                /* select the initial transformation and
+                                   the best of the others */
+  n_refine = globals->multi_start < n_starts ? globals->multi_start : n_starts;
+  for(k=0; k<n_starts; k++)
+    order[k] = k;
+  for(k=1; k<n_refine; k++) {
+    j = k;
+    for(i=k+1; i<n_starts; i++)
+      if (values[order[i]] < values[order[j]]) j = i;
+    a = order[k]; order[k] = order[j]; order[j] = a;
+  }
+
+                                /* refine them, and keep the best */
+  ALLOC2D(refined, n_refine, ndim);
+  ALLOC(refined_values, n_refine);
+  ALLOC(iterations, n_refine);
+
+#ifdef _OPENMP
+#pragma omp parallel if (reentrant && n_refine > 1) private(args, the_amoeba, iteration_number)
+#endif
+  {
+    args = reentrant ? new_fit_args() : NULL;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic,1)
+#endif
+    for(k=0; k<n_refine; k++) {
+      initialize_amoeba(&the_amoeba, ndim, starts[order[k]], 
+                        simplex_size, function, 
+                        (void *)args, (VIO_Real)ftol);
+
+      iteration_number = 0;
+      while ( iteration_number<MULTI_START_ITERS && 
+              perform_amoeba(&the_amoeba, &iteration_number) ) 
+        /* empty */ ;
+
+      refined_values[k] = get_amoeba_parameters(&the_amoeba,refined[k]);
+      iterations[k] = iteration_number;
+      terminate_amoeba(&the_amoeba);
+    }
+
+    if (args != NULL)
+      delete_fit_args(args);
+  }
+
+  best = 0;
+  for(k=0; k<n_refine; k++) {
+    if (globals->flags.debug) 
+      (void)print("start %d: %f -> %f after %d iterations\n",
+                  order[k], values[order[k]], refined_values[k], iterations[k]);
+    if (refined_values[k] < refined_values[best])
+      best = k;
+  }
+  for(i=0; i<ndim; i++)
+    parameters[i] = refined[best][i];
+
+  if (sampling)
+    set_lattice_sampling(FALSE);
+
+  if (globals->flags.debug) 
+    (void)print("done with %d starts, %d refined, best %f\n",
+                n_starts, n_refine, refined_values[best]);
+
+  FREE(iterations);
+  FREE(refined_values);
+  FREE2D(refined);
+  FREE(p);
+  FREE(skip);
+  FREE(order);
+  FREE(values);
+  FREE2D(starts);
+  FREE2D(rots);
+}
+
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : optimize_simplex
                 get the parameters necessary to map volume 1 to volume 2
@@ -625,7 +1334,8 @@ VIO_BOOL optimize_simplex(VIO_Volume d1,
     *mat;
 
   VIO_Real
-    *parameters;
+    *parameters,
+    size;
 
   double trans[3];
   double cent[3];
@@ -664,8 +1374,17 @@ VIO_BOOL optimize_simplex(VIO_Volume d1,
     for(i=0; i<ndim+1; i++)                /* copy initial guess into parameter list */
       parameters[i] = (VIO_Real)p[i+1];
 
+                                /* search several starting points,
+                                   if requested */
+    if (globals->multi_start > 0)
+      multi_start_simplex(ndim, parameters, amoeba_obj_function, globals, FALSE);
+
+                                /* coarse optimization on part of
+                                   the lattice, if requested */
+    size = sampled_simplex(ndim, parameters, amoeba_obj_function, globals);
+
     initialize_amoeba(&the_amoeba, ndim, parameters, 
-                      simplex_size, amoeba_obj_function, 
+                      size, amoeba_obj_function, 
                       NULL, (VIO_Real)local_ftol);
 
     max_iters = 400;
@@ -791,7 +1510,8 @@ VIO_BOOL optimize_simplex_quater(VIO_Volume d1,
     *mat;
 
   VIO_Real
-    *parameters;
+    *parameters,
+    size;
 
   double trans[3];
   double cent[3];
@@ -836,11 +1556,17 @@ VIO_BOOL optimize_simplex_quater(VIO_Volume d1,
     for(i=0; i<ndim+1; i++)                /* copy initial guess into parameter list */
       parameters[i] = (VIO_Real)p[i+1];
 
+                                /* search several starting points,
+                                   if requested */
+    if (globals->multi_start > 0)
+      multi_start_simplex(ndim, parameters, amoeba_obj_function_quater, globals, TRUE);
 
-
+                                /* coarse optimization on part of
+                                   the lattice, if requested */
+    size = sampled_simplex(ndim, parameters, amoeba_obj_function_quater, globals);
 
     initialize_amoeba(&the_amoeba, ndim, parameters, 
-                      simplex_size, amoeba_obj_function_quater, 
+                      size, amoeba_obj_function_quater, 
                       NULL, (VIO_Real)local_ftol);
 
     max_iters = 400;
@@ -924,68 +1650,178 @@ VIO_BOOL optimize_simplex_quater(VIO_Volume d1,
 }
 
 
-VIO_BOOL replace_volume_data_with_ubyte(VIO_Volume data)
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : optimize_lbfgs
+                get the parameters necessary to map volume 1 to volume 2
+                using a limited memory BFGS optimization of the xcorr or
+                zscore objective function.
+@INPUT      : d1,d2:
+                two volumes of data (already in memory).
+              m1,m2:
+                two mask volumes for data (already in memory).
+              globals:
+                a global data structure containing info from the command line,
+                including the input parameters to be optimized, the input matrix,
+                and a plethora of flags!
+              quater:
+                TRUE for the quaternion parameters
+@OUTPUT     : 
+@RETURNS    : TRUE if ok, FALSE if error.
+@DESCRIPTION: same as optimize_simplex (or optimize_simplex_quater), with
+              the final simplex replaced by lbfgs_minimize().  Each
+              evaluation gives the gradient with the objective function,
+              so far fewer passes over the lattice are needed than for the
+              simplex.  -multi_start and -sample_* are done as for the
+              simplex, before.  The other objective functions have no
+              gradient and fall back on the simplex.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+static VIO_BOOL optimize_lbfgs(VIO_Volume d1,
+                               VIO_Volume d2,
+                               VIO_Volume m1,
+                               VIO_Volume m2, 
+                               Arg_Data *globals,
+                               VIO_BOOL quater)
 {
-  VIO_Volume tmp_vol;
-  int sizes[VIO_MAX_DIMENSIONS];
-  int i,j,k,count,n_dim;
-  VIO_progress_struct                
-    progress;
-  VIO_Real min, max;
+  float 
+    *p;
+  int 
+    n_evals,
+    i, 
+    ndim;
 
+  VIO_Transform
+    *mat;
 
-  get_volume_sizes(data, sizes);
-  n_dim = get_volume_n_dimensions(data);
+  VIO_Real
+    *parameters,
+    value,
+    size;
 
-  if (n_dim != 3) {
-    print ("Volume must have 3 dimensions for byte copy\n");
-    return(FALSE);
+  double quats[4];
+
+  if (!objective_has_gradient(globals)) {
+    print("L-BFGS needs -xcorr or -zscore, using the simplex instead.\n");
+    if (quater)
+      return( optimize_simplex_quater(d1, d2, m1, m2, globals) );
+    else
+      return( optimize_simplex(d1, d2, m1, m2, globals) );
   }
 
-  get_volume_minimum_maximum_real_value(data, &min, &max);
+                                /* find number of dimensions for optimization */
+  ndim = 0;
+  for(i=0; i<12; i++)
+    if (globals->trans_info.weights[i] != 0.0) ndim++;
 
+  if (ndim==0)
+    return(TRUE);
 
-                                /* build a matching temporary ubyte 
-                                   volume */
+  Gndim = ndim;
 
-  tmp_vol = copy_volume_definition(data, NC_BYTE, FALSE, 0.0, 0.0);
-  set_volume_real_range(tmp_vol, min, max);
+  ALLOC(p,ndim+1+1);            /* parameters [1..ndim] for fit_function */
+  ALLOC(parameters, ndim+1);    /* and [0..ndim-1] for the optimizers */
 
-                                /* copy the original voxel data into
-                                   the byte voxels */
-  count = 0;
-  initialize_progress_report(&progress, FALSE, sizes[0]*sizes[1]*sizes[2] + 1,
-                             "Converting" );
-  for(i=0; i<sizes[0]; i++)
-    for(j=0; j<sizes[1]; j++)
-      for(k=0; k<sizes[2]; k++) {
-        set_volume_real_value(tmp_vol, i,j,k,0,0,
-                              get_volume_real_value(data,i,j,k,0,0));
-        count++;
-        update_progress_report( &progress, count);
-      }
-  terminate_progress_report( &progress );
+  if (quater)
+    parameters_to_vector_quater(globals->trans_info.translations,
+                                globals->trans_info.quaternions,
+                                globals->trans_info.scales,
+                                globals->trans_info.shears,
+                                p,
+                                globals->trans_info.weights);
+  else
+    parameters_to_vector(globals->trans_info.translations,
+                         globals->trans_info.rotations,
+                         globals->trans_info.scales,
+                         globals->trans_info.shears,
+                         p,
+                         globals->trans_info.weights);
 
-  
-  free_volume_data( data );        /* get rid of original data */
+  for(i=0; i<ndim+1; i++)
+    parameters[i] = (VIO_Real)p[i+1];
+
+                                /* search several starting points and
+                                   do the coarse optimization on part of
+                                   the lattice, if requested */
+  if (globals->multi_start > 0)
+    multi_start_simplex(ndim, parameters, 
+                        quater ? amoeba_obj_function_quater : amoeba_obj_function,
+                        globals, quater);
+
+  size = sampled_simplex(ndim, parameters, 
+                         quater ? amoeba_obj_function_quater : amoeba_obj_function,
+                         globals);
+
+  n_evals = lbfgs_minimize(ndim, parameters, size, 
+                           quater ? lbfgs_obj_function_quater : lbfgs_obj_function,
+                           NULL, (VIO_Real)ftol, 400, &value);
+
+  if (globals->flags.debug) {
+    (void)print("done with L-BFGS after %d evaluations, %7.5f:", n_evals, value);
+    for(i=0; i<ndim; i++)
+      (void)print ("%8.5f ", parameters[i]);
+    (void)print ("\n");
+  }
 
-   /* 
-   * BLEAGHH!! This is an evil and nasty hack, made worse by the fact that
-   * we have to support two versions of Volume_io for it to work!  (At
-   * least this is done by the VOXEL_DATA hack^H^H^H^Hmacro, in <config.h>.)
-   * -GPW 96/04/34
-   */
+                                /* copy result into main data structure */
+  for(i=0; i<ndim; i++)                
+    p[i+1] = (float)parameters[i];
 
-  VOXEL_DATA (data) = VOXEL_DATA (tmp_vol);
-  
-  set_volume_type(data, NC_BYTE, FALSE, 0.0, 0.0);
-  
-  set_volume_real_range(data, min, max);
+  if (quater)
+    vector_to_parameters_quater(globals->trans_info.translations,
+                                globals->trans_info.quaternions,
+                                globals->trans_info.scales,
+                                globals->trans_info.shears,
+                                p,
+                                globals->trans_info.weights);
+  else
+    vector_to_parameters(globals->trans_info.translations,
+                         globals->trans_info.rotations,
+                         globals->trans_info.scales,
+                         globals->trans_info.shears,
+                         p,
+                         globals->trans_info.weights);
 
-  VOXEL_DATA (tmp_vol) = NULL;  /* is this really necessary?!?!? */
+  if (globals->trans_info.transform_type==TRANS_LSQ7) { /* adjust scaley and scalez only */
+    /* if 7 parameter fit.  */
+    globals->trans_info.scales[1] = globals->trans_info.scales[0];
+    globals->trans_info.scales[2] = globals->trans_info.scales[0];
+  }
 
+  if (get_transform_type(globals->trans_info.transformation) == CONCATENATED_TRANSFORM) {
+    mat = get_linear_transform_ptr(
+            get_nth_general_transform(globals->trans_info.transformation,0));
+  }
+  else
+    mat = get_linear_transform_ptr(globals->trans_info.transformation);
 
-  return(TRUE);
+  if (quater) {
+    for(i=0; i<3; i++)
+      quats[i] = globals->trans_info.quaternions[i];
+    quats[3] = sqrt(1-SQR(quats[0])-SQR(quats[1])-SQR(quats[2]));
+    build_transformation_matrix_quater(mat, 
+                                       globals->trans_info.center,
+                                       globals->trans_info.translations,
+                                       globals->trans_info.scales,
+                                       globals->trans_info.shears,
+                                       quats);
+  }
+  else
+    build_transformation_matrix(mat, 
+                                globals->trans_info.center,
+                                globals->trans_info.translations,
+                                globals->trans_info.scales,
+                                globals->trans_info.shears,
+                                globals->trans_info.rotations);
+
+  FREE(p);
+  FREE(parameters);
+
+  return( TRUE );
 }
 
 
@@ -1026,8 +1862,6 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
   VIO_BOOL 
     stat;
   int i;
-  VIO_Data_types
-    data_type;
   float *p;
   VIO_Transform
     *mat;
@@ -1101,29 +1935,6 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
                                 /* Collignon's mutual information */
     {
 
-      if ( globals->groups != 256 ) {
-        print ("WARNING: -groups was %d, but will be forced to 256 in this run\n",globals->groups);
-        globals->groups = 256;
-      }
-
-      data_type = get_volume_data_type (d1);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: source volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d1)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
-      data_type = get_volume_data_type (d2);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: target volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d2)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
       ALLOC(   prob_fn1,   globals->groups);
       ALLOC(   prob_fn2,   globals->groups);
       ALLOC2D( prob_hash_table, globals->groups, globals->groups);
@@ -1207,6 +2018,14 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
            /* ---------------- call the requested obj_function to 
                                establish the initial fitting value  ---------*/
 
+                                /* the volumes are not changed until the
+                                   optimization is done, so the source
+                                   side of the lattice is computed once */
+  begin_source_lattice_cache();
+  if (Brick_volumes)            /* the target is sampled obliquely */
+    (void)brick_volume(Gdata2);
+  begin_fit_cache(globals);
+
   ALLOC(p,13);
   parameters_to_vector(globals->trans_info.translations,
                        globals->trans_info.rotations,
@@ -1223,6 +2042,9 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
   case OPT_SIMPLEX:
     stat = optimize_simplex(d1, d2, m1, m2, globals);
     break;
+  case OPT_LBFGS:
+    stat = optimize_lbfgs(d1, d2, m1, m2, globals, FALSE);
+    break;
   default:
     (void)fprintf(stderr, "Unknown type of optimization requested (%d)\n",
                   globals->optimize_type);
@@ -1239,6 +2061,10 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
 
   final_corr = fit_function(p);
 
+  end_fit_cache(globals);
+  end_source_lattice_cache();
+  free_volume_bricks();
+
   FREE(p);
 
   /*--------- set up final transformation matrix ------------------*/
@@ -1273,6 +2099,7 @@ VIO_BOOL optimize_linear_transformation(VIO_Volume d1,
       FREE(   prob_fn1 );
       FREE(   prob_fn2 );
       FREE2D( prob_hash_table);
+      free_mutual_information_bins();
     }
 
 
@@ -1318,8 +2145,6 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
   VIO_BOOL 
     stat;
   int i;
-  VIO_Data_types
-    data_type;
   float *p;
   VIO_Transform
     *mat;
@@ -1393,29 +2218,6 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
                                 /* Collignon's mutual information */
     {
 
-      if ( globals->groups != 256 ) {
-        print ("WARNING: -groups was %d, but will be forced to 256 in this run\n",globals->groups);
-        globals->groups = 256;
-      }
-
-      data_type = get_volume_data_type (d1);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: source volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d1)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
-      data_type = get_volume_data_type (d2);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: target volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d2)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
       ALLOC(   prob_fn1,   globals->groups);
       ALLOC(   prob_fn2,   globals->groups);
       ALLOC2D( prob_hash_table, globals->groups, globals->groups);
@@ -1503,6 +2305,14 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
 
 
 
+                                /* the volumes are not changed until the
+                                   optimization is done, so the source
+                                   side of the lattice is computed once */
+  begin_source_lattice_cache();
+  if (Brick_volumes)            /* the target is sampled obliquely */
+    (void)brick_volume(Gdata2);
+  begin_fit_cache(globals);
+
   ALLOC(p,13);
   parameters_to_vector_quater(globals->trans_info.translations,
                               globals->trans_info.quaternions,
@@ -1519,6 +2329,9 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
   case OPT_SIMPLEX:
     stat = optimize_simplex_quater(d1, d2, m1, m2, globals);
     break;
+  case OPT_LBFGS:
+    stat = optimize_lbfgs(d1, d2, m1, m2, globals, TRUE);
+    break;
   default:
     (void)fprintf(stderr, "Unknown type of optimization requested (%d)\n",
                   globals->optimize_type);
@@ -1535,6 +2348,10 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
 
   final_corr = fit_function_quater(p);
 
+  end_fit_cache(globals);
+  end_source_lattice_cache();
+  free_volume_bricks();
+
   FREE(p);
 
   /*--------- set up final transformation matrix ------------------*/
@@ -1570,6 +2387,7 @@ VIO_BOOL optimize_linear_transformation_quater(VIO_Volume d1,
       FREE(   prob_fn1 );
       FREE(   prob_fn2 );
       FREE2D( prob_hash_table);
+      free_mutual_information_bins();
     }
 
 
@@ -1617,8 +2435,6 @@ float measure_fit(VIO_Volume d1,
   int 
     i, 
     ndim;
-  VIO_Data_types
-    data_type;
 
 
 
@@ -1660,29 +2476,6 @@ float measure_fit(VIO_Volume d1,
                                 /* Collignon's mutual information */
     {
 
-      if ( globals->groups != 256 ) {
-        print ("WARNING: -groups was %d, but will be forced to 256 in this run\n",globals->groups);
-        globals->groups = 256;
-      }
-
-      data_type = get_volume_data_type (d1);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: source volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d1)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
-      data_type = get_volume_data_type (d2);
-      if (data_type != UNSIGNED_BYTE) {
-        print ("WARNING: target volume not UNSIGNED_BYTE, will do conversion now.\n");
-        if (!replace_volume_data_with_ubyte(d2)) {
-          print_error_and_line_num("Can't replace volume data with unsigned bytes\n",
-                             __FILE__, __LINE__);
-        }
-      }
-
       ALLOC(   prob_fn1,   globals->groups);
       ALLOC(   prob_fn2,   globals->groups);
       ALLOC2D( prob_hash_table, globals->groups, globals->groups);
@@ -1891,6 +2684,7 @@ if(globals->trans_info.rotation_type == TRANS_ROT)
       FREE(   prob_fn1 );
       FREE(   prob_fn2 );
       FREE2D( prob_hash_table);
+      free_mutual_information_bins();
     }
 
 
@@ -2023,7 +2817,13 @@ VIO_BOOL optimize_non_linear_transformation(Arg_Data *globals)
            /* ---------------- call requested optimization strategy ---------*/
 
 
+  if (Brick_volumes)            /* the sub-lattices sample the targets */
+    for(i=0; i<globals->features.number_of_features; i++) 
+      (void)brick_volume(globals->features.model[i]);
+
   stat = ( do_non_linear_optimization(globals)==OK );
+
+  free_volume_bricks();
  
   
           /* ----------------finish up parameter/matrix manipulations ------*/
@@ -30,10 +30,24 @@ VIO_BOOL build_segment_table(Segment_Table **s_table, VIO_Volume d1, int groups)
   case  SIGNED_SHORT:
     min = -(1<<15); max = (1<<15)-1;
     break;
-  default:
-    print_error_and_line_num("Currently an unsupported data type (%d).", __FILE__, __LINE__, 
-                data_type);
-    return(FALSE);
+  default:                      /* float and double: no look up table,
+                                   the voxel range is split directly */
+    ALLOC( st, 1);
+
+    *s_table = st;
+    if (*s_table == NULL)
+      return(FALSE);
+
+    get_volume_minimum_maximum_real_value(d1, &st->range_min, &st->range_max);
+    st->range_min = convert_value_to_voxel(d1, st->range_min);
+    st->range_max = convert_value_to_voxel(d1, st->range_max);
+    st->min = 0;
+    st->max = -1;
+    st->groups = groups;
+    st->table = NULL;
+    st->segment = get_segment_range_value;
+
+    return(TRUE);
   }
 
   ALLOC( st, 1);
@@ -42,6 +56,8 @@ VIO_BOOL build_segment_table(Segment_Table **s_table, VIO_Volume d1, int groups)
   if (*s_table != NULL) {
     (*s_table)->min = min;
     (*s_table)->max = max;
+    (*s_table)->range_min = min;
+    (*s_table)->range_max = max;
     (*s_table)->groups = groups;
     (*s_table)->segment = get_segment_LUT_value;
     
@@ -68,22 +84,49 @@ VIO_BOOL free_segment_table(Segment_Table *s_table)
 
   int *p;
 
-  p = s_table->table;
-  p += s_table->min;
+  if (s_table->table != NULL) {
+    p = s_table->table;
+    p += s_table->min;
 
-  FREE(p);
+    FREE(p);
+  }
   FREE(s_table);
   return(TRUE);
 
 }
 
-int     get_segment_LUT_value(int value, Segment_Table *s_table)
+int     get_segment_LUT_value(VIO_Real value, Segment_Table *s_table)
 {
+  int
+    ivalue;
+
+  ivalue = (int)value;
 
-  if ((value>=s_table->min) && (value<=s_table->max))
-    return(s_table->table[value]);
+  if ((ivalue>=s_table->min) && (ivalue<=s_table->max))
+    return(s_table->table[ivalue]);
   else
     return(0);
 
 }
 
+/* the same split as the look up table of build_segment_table(), 
+   computed from the value itself; values outside the data range
+   fall in the first or last group */
+
+int     get_segment_range_value(VIO_Real value, Segment_Table *s_table)
+{
+  float
+    frac;
+
+  if (s_table->range_max <= s_table->range_min || value <= s_table->range_min)
+    return(1);
+
+  if (value >= s_table->range_max)
+    return(s_table->groups);
+
+  frac = 0.5 + ((float)(s_table->groups)-0.00001 ) * 
+    (value - s_table->range_min) / (s_table->range_max - s_table->range_min);
+
+  return( (int)ROUND( frac ) );
+}
+
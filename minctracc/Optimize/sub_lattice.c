@@ -84,10 +84,13 @@
 #include "arg_data.h"                /* definition of the global data struct      */
 #include "sub_lattice.h"
 #include "init_lattice.h"
+#include "super_sample_def.h"
+#include "interpolation.h"
 
 
 extern Arg_Data *Gglobals;      /* defined in do_nonlinear.c */
-extern VIO_Volume   Gsuper_sampled_vol; /* defined in do_nonlinear.c */
+extern Lazy_super_sampled_def
+                *Gsuper_sampled_def; /* defined in do_nonlinear.c */
 extern VIO_General_transform 
                 *Glinear_transform;/* defined in do_nonlinear.c */
 
@@ -299,6 +302,13 @@ void go_get_samples_in_source(VIO_Volume data, VIO_Volume mask,
 
 */
 
+/* a voxel of the target volume, from its bricked copy when there is
+   one (-bricked), from the volume data otherwise */
+
+#define TARGET_VOXEL(i0,i1,i2) \
+   ( (bricks != NULL) ? bricks[ BRICK_OFFSET(brick_count, i0, i1, i2) ] : \
+                        double_ptr[i0][i1][i2] )
+
 float go_get_samples_with_offset(
 				 VIO_Volume data,                  /* The volume of data */
 				 VIO_Volume mask,                  /* The target mask */  
@@ -329,6 +339,8 @@ float go_get_samples_with_offset(
   static double v000, v001, v010, v011, v100, v101, v110, v111;
 
   double ***double_ptr;
+  double *bricks;               /* bricked copy of data, if any */
+  int brick_count[3];
   
   double mean_s = 0.0;		/* init variables for stats */
   double mean_t = 0.0;
@@ -339,6 +351,7 @@ float go_get_samples_with_offset(
   number_of_nonzero_samples = 0;
 
   get_volume_sizes(data, sizes);  
+  bricks = get_volume_bricks(data, brick_count);
   xs = sizes[0];  
   ys = sizes[1];  
   zs = sizes[2];
@@ -393,7 +406,7 @@ float go_get_samples_with_offset(
          if (ind0>=0 && ind0<xs &&
              ind1>=0 && ind1<ys &&
              ind2>=0 && ind2<zs) {
-	   sample = (double)(double_ptr[ind0][ind1][ind2]);
+	   sample = (double)TARGET_VOXEL(ind0,ind1,ind2);
          }
          else{
             sample = 0.0;
@@ -442,14 +455,14 @@ float go_get_samples_with_offset(
                   ind2>=0 && ind2<(zs-offset2)) {
                  
                  /* get the data */
-                 v000 = (VIO_Real)(double_ptr[ind0        ][ind1        ][ind2        ]);
-                 v001 = (VIO_Real)(double_ptr[ind0        ][ind1        ][ind2+offset2]);
-                 v010 = (VIO_Real)(double_ptr[ind0        ][ind1+offset1][ind2        ]);
-                 v011 = (VIO_Real)(double_ptr[ind0        ][ind1+offset1][ind2+offset2]);
-                 v100 = (VIO_Real)(double_ptr[ind0+offset0][ind1        ][ind2        ]);
-                 v101 = (VIO_Real)(double_ptr[ind0+offset0][ind1        ][ind2+offset2]);
-                 v110 = (VIO_Real)(double_ptr[ind0+offset0][ind1+offset1][ind2        ]);
-                 v111 = (VIO_Real)(double_ptr[ind0+offset0][ind1+offset1][ind2+offset2]);
+                 v000 = (VIO_Real)TARGET_VOXEL(ind0,ind1,ind2);
+                 v001 = (VIO_Real)TARGET_VOXEL(ind0,ind1,ind2+offset2);
+                 v010 = (VIO_Real)TARGET_VOXEL(ind0,ind1+offset1,ind2);
+                 v011 = (VIO_Real)TARGET_VOXEL(ind0,ind1+offset1,ind2+offset2);
+                 v100 = (VIO_Real)TARGET_VOXEL(ind0+offset0,ind1,ind2);
+                 v101 = (VIO_Real)TARGET_VOXEL(ind0+offset0,ind1,ind2+offset2);
+                 v110 = (VIO_Real)TARGET_VOXEL(ind0+offset0,ind1+offset1,ind2);
+                 v111 = (VIO_Real)TARGET_VOXEL(ind0+offset0,ind1+offset1,ind2+offset2);
                  
                  /* Get the fraction parts */
                  f0 = v0 - ind0;
@@ -646,7 +659,7 @@ void    build_target_lattice(float px[], float py[], float pz[],
 /* Build the target lattice by transforming the source points through the
    current non-linear transformation stored in:
 
-        Glinear_transform and Gsuper_d{x,y,z} deformation volumes  
+        Glinear_transform and the lazily super-sampled Gsuper_sampled_def
 
    both input (px,py,pz) and output (tx,ty,tz) coordinate lists are in
    WORLD COORDINATES
@@ -658,18 +671,10 @@ void    build_target_lattice_using_super_sampled_def(
                                      int len, int dim)
 {
   int 
-    i,j,
-    sizes[VIO_MAX_DIMENSIONS],
-    xyzv[VIO_MAX_DIMENSIONS];
+    i;
   VIO_Real 
     def_vector[VIO_N_DIMENSIONS],
-    voxel[VIO_MAX_DIMENSIONS],
     x,y,z;
-  long 
-    index[VIO_MAX_DIMENSIONS];
-
-  get_volume_sizes(Gsuper_sampled_vol,sizes);
-  get_volume_XYZV_indices(Gsuper_sampled_vol,xyzv);
 
   for(i=1; i<=len; i++) {
 
@@ -682,23 +687,9 @@ void    build_target_lattice_using_super_sampled_def(
                                 /* now get the non-linear part, using
                                    nearest neighbour interpolation in
                                    the super-sampled deformation
-                                   volume. */
-
-    convert_world_to_voxel(Gsuper_sampled_vol, 
-                           x,y,z, voxel);
-
-    if ((voxel[ xyzv[VIO_X] ] >= -0.5) && (voxel[ xyzv[VIO_X] ] < sizes[xyzv[VIO_X]]-0.5) &&
-        (voxel[ xyzv[VIO_Y] ] >= -0.5) && (voxel[ xyzv[VIO_Y] ] < sizes[xyzv[VIO_Y]]-0.5) &&
-        (voxel[ xyzv[VIO_Z] ] >= -0.5) && (voxel[ xyzv[VIO_Z] ] < sizes[xyzv[VIO_Z]]-0.5) ) {
-
-      for(j=0; j<3; j++) index[ xyzv[j] ] = (long) (voxel[ xyzv[j] ]+0.5);
-      
-      for(index[xyzv[VIO_Z+1]]=0; index[xyzv[VIO_Z+1]]<sizes[xyzv[VIO_Z+1]]; index[xyzv[VIO_Z+1]]++) 
-        GET_VALUE_4D(def_vector[ index[ xyzv[VIO_Z+1] ]  ], \
-                     Gsuper_sampled_vol, \
-                     index[0], index[1], index[2], index[3]);
-
+                                   field, computed on demand. */
 
+    if (get_lazy_super_sampled_def(Gsuper_sampled_def, x,y,z, def_vector)) {
       x += def_vector[VIO_X];
       y += def_vector[VIO_Y];
       z += def_vector[VIO_Z];
@@ -109,6 +109,8 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #include <Proglib.h>
 #include "constants.h"
 #include "point_vector.h"
+#include "super_sample_def.h"
+#include "local_macros.h"
 
                                 /* prototypes called: */
 
@@ -2416,3 +2418,289 @@ static void interpolate_super_sampled_data_by2_dim2_Z(
     terminate_progress_report( &progress );
 
 }
+
+/*
+   Lazily evaluated super-sampled deformation field.
+
+   Rather than resampling the whole deformation field onto the finer
+   lattice at each iteration (factor^3 times the size of the coarse
+   field), the fine field is broken into LAZY_TILE^3 tiles that are
+   computed from the coarse field only when a point that falls inside
+   them is first looked up.  Regions of the field that are never visited
+   (i.e. under masked nodes) cost neither time nor memory.
+
+   The fine lattice is aligned with the coarse one, as in
+   create_super_sampled_data_volumes_by2(), so that fine voxel s along an
+   axis sits at coarse voxel s/factor.  Fine values are copied at the
+   coarse nodes, interpolated with a Catmull-Rom cubic between nodes and
+   linearly between the first and last pair of nodes along each axis.
+   With factor == 2, this is the same kernel as
+   interpolate_super_sampled_data_by2() (the cubic weights reduce to
+   MY_CUBIC_05()).  The kernel is applied separably, one axis at a time,
+   within the tile.
+
+   At most max_tiles tiles are kept at once; when the cache is full it
+   is simply flushed and refilled on demand.
+*/
+
+static int get_super_sample_taps(Lazy_super_sampled_def *lazy,
+                                 int fine, int coarse_count,
+                                 int tap_index[], VIO_Real tap_weight[])
+{
+  int i, r, k;
+
+  i = fine / lazy->factor;
+  r = fine % lazy->factor;
+
+  if (coarse_count < 2 || r == 0) {
+    tap_index[0] = i;      tap_weight[0] = 1.0;
+    return(1);
+  }
+
+  if (i == 0 || i >= coarse_count-2) {
+    tap_index[0] = i;      tap_weight[0] = 1.0 - (VIO_Real)r/lazy->factor;
+    tap_index[1] = i+1;    tap_weight[1] = (VIO_Real)r/lazy->factor;
+    return(2);
+  }
+
+  for(k=0; k<4; k++) {
+    tap_index[k]  = i-1+k;
+    tap_weight[k] = lazy->kernel[ 4*r + k ];
+  }
+  return(4);
+}
+
+Lazy_super_sampled_def *new_lazy_super_sampled_def(VIO_General_transform *orig_deformation,
+                                                   Deform_grid *coarse_grid,
+                                                   int factor,
+                                                   int max_tiles)
+{
+  Lazy_super_sampled_def 
+    *lazy;
+  int
+    i, n,
+    sizes[VIO_MAX_DIMENSIONS];
+  VIO_Real
+    t;
+
+  if (orig_deformation->type != GRID_TRANSFORM) {
+    print_error_and_line_num("new_lazy_super_sampled_def not called with GRID_TRANSFORM",
+                             __FILE__, __LINE__);
+  }
+  if (factor < 1) {
+    print_error_and_line_num("super-sampling rate must be >= 1 (not %d)",
+                             __FILE__, __LINE__, factor);
+  }
+
+  ALLOC(lazy, 1);
+
+  lazy->coarse_vol  = orig_deformation->displacement_volume;
+  lazy->coarse_grid = coarse_grid;
+  lazy->factor     = factor;
+  get_volume_XYZV_indices(lazy->coarse_vol, lazy->xyzv);
+  get_volume_sizes(       lazy->coarse_vol, sizes);
+
+                                /* Catmull-Rom weights for each fine
+                                   offset t = r/factor between nodes
+                                   i and i+1, applied to i-1..i+2  */
+  ALLOC(lazy->kernel, 4*factor);
+  for(i=0; i<factor; i++) {
+    t = (VIO_Real)i / factor;
+    lazy->kernel[4*i + 0] = 0.5 * (-t*t*t + 2.0*t*t - t);
+    lazy->kernel[4*i + 1] = 0.5 * ( 3.0*t*t*t - 5.0*t*t + 2.0);
+    lazy->kernel[4*i + 2] = 0.5 * (-3.0*t*t*t + 4.0*t*t + t);
+    lazy->kernel[4*i + 3] = 0.5 * ( t*t*t - t*t);
+  }
+
+  n = 1;
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    lazy->coarse_count[i] = sizes[ lazy->xyzv[i] ];
+    if (lazy->coarse_count[i] > 1)
+      lazy->fine_count[i] = factor*(lazy->coarse_count[i] - 1) + 1;
+    else
+      lazy->fine_count[i] = lazy->coarse_count[i];
+    lazy->n_tiles[i] = (lazy->fine_count[i] + LAZY_TILE - 1) / LAZY_TILE;
+    n *= lazy->n_tiles[i];
+  }
+
+  lazy->total_tiles = n;
+  lazy->max_tiles   = (max_tiles > 0 && max_tiles < n) ? max_tiles : n;
+  lazy->n_resident  = 0;
+  lazy->n_filled    = 0;
+
+  ALLOC(lazy->tiles, n);
+  for(i=0; i<n; i++) 
+    lazy->tiles[i] = NULL;
+
+  ALLOC(lazy->pool, lazy->max_tiles);
+  for(i=0; i<lazy->max_tiles; i++) 
+    lazy->pool[i] = NULL;
+
+  return(lazy);
+}
+
+void flush_lazy_super_sampled_def(Lazy_super_sampled_def *lazy)
+{
+  int i;
+
+  for(i=0; i<lazy->total_tiles; i++) 
+    lazy->tiles[i] = NULL;
+
+  lazy->n_resident = 0;
+}
+
+void delete_lazy_super_sampled_def(Lazy_super_sampled_def *lazy)
+{
+  int i;
+
+  for(i=0; i<lazy->max_tiles; i++) 
+    if (lazy->pool[i] != NULL)
+      FREE(lazy->pool[i]);
+
+  FREE(lazy->pool);
+  FREE(lazy->tiles);
+  FREE(lazy->kernel);
+  FREE(lazy);
+}
+
+/* compute all fine values of tile t[] (in XYZ order) from the coarse field */
+
+static float *fill_lazy_tile(Lazy_super_sampled_def *lazy, int tile_id, int t[])
+{
+  float
+    *tile;
+  int
+    a, f, k, v, x, y, z,
+    lo[VIO_N_DIMENSIONS],
+    n[VIO_N_DIMENSIONS],
+    c_lo[VIO_N_DIMENSIONS],
+    c_n[VIO_N_DIMENSIONS],
+    n_taps[VIO_N_DIMENSIONS][LAZY_TILE],
+    taps[VIO_N_DIMENSIONS][LAZY_TILE][4];
+  long
+    node;
+  VIO_Real
+    value,
+    weights[VIO_N_DIMENSIONS][LAZY_TILE][4],
+    coarse[VIO_N_DIMENSIONS][LAZY_SPAN][LAZY_SPAN][LAZY_SPAN],
+    along_x[VIO_N_DIMENSIONS][LAZY_SPAN][LAZY_SPAN][LAZY_TILE],
+    along_y[VIO_N_DIMENSIONS][LAZY_SPAN][LAZY_TILE][LAZY_TILE];
+
+  if (lazy->n_resident >= lazy->max_tiles)
+    flush_lazy_super_sampled_def(lazy);
+
+  if (lazy->pool[ lazy->n_resident ] == NULL)
+    ALLOC(lazy->pool[ lazy->n_resident ], VIO_N_DIMENSIONS*LAZY_TILE*LAZY_TILE*LAZY_TILE);
+  tile = lazy->pool[ lazy->n_resident++ ];
+
+                                /* get the taps along each axis, and the
+                                   range of coarse nodes that they touch */
+  for(a=0; a<VIO_N_DIMENSIONS; a++) {
+    lo[a] = t[a]*LAZY_TILE;
+    n[a]  = lazy->fine_count[a] - lo[a];
+    if (n[a] > LAZY_TILE) n[a] = LAZY_TILE;
+    c_lo[a] = lazy->coarse_count[a];
+    c_n[a]  = -1;
+    for(f=0; f<n[a]; f++) {
+      n_taps[a][f] = get_super_sample_taps(lazy, lo[a]+f, lazy->coarse_count[a],
+                                           taps[a][f], weights[a][f]);
+      for(k=0; k<n_taps[a][f]; k++) {
+        if (taps[a][f][k] < c_lo[a]) c_lo[a] = taps[a][f][k];
+        if (taps[a][f][k] > c_n[a])  c_n[a]  = taps[a][f][k];
+      }
+    }
+    c_n[a] = c_n[a] - c_lo[a] + 1;
+    for(f=0; f<n[a]; f++) 
+      for(k=0; k<n_taps[a][f]; k++) 
+        taps[a][f][k] -= c_lo[a];
+  }
+
+                                /* copy the coarse nodes needed */
+  for(z=0; z<c_n[VIO_Z]; z++) 
+    for(y=0; y<c_n[VIO_Y]; y++) 
+      for(x=0; x<c_n[VIO_X]; x++) {
+        node = DEFORM_GRID_OFFSET(lazy->coarse_grid, 
+                                  c_lo[VIO_X]+x, c_lo[VIO_Y]+y, c_lo[VIO_Z]+z);
+        for(v=0; v<VIO_N_DIMENSIONS; v++) 
+          coarse[v][z][y][x] = lazy->coarse_grid->d[v][node];
+      }
+
+                                /* interpolate along x, then y, then z */
+  for(v=0; v<VIO_N_DIMENSIONS; v++) {
+
+    for(z=0; z<c_n[VIO_Z]; z++) 
+      for(y=0; y<c_n[VIO_Y]; y++) 
+        for(x=0; x<n[VIO_X]; x++) {
+          value = 0.0;
+          for(k=0; k<n_taps[VIO_X][x]; k++) 
+            value += weights[VIO_X][x][k] * coarse[v][z][y][ taps[VIO_X][x][k] ];
+          along_x[v][z][y][x] = value;
+        }
+
+    for(z=0; z<c_n[VIO_Z]; z++) 
+      for(y=0; y<n[VIO_Y]; y++) 
+        for(x=0; x<n[VIO_X]; x++) {
+          value = 0.0;
+          for(k=0; k<n_taps[VIO_Y][y]; k++) 
+            value += weights[VIO_Y][y][k] * along_x[v][z][ taps[VIO_Y][y][k] ][x];
+          along_y[v][z][y][x] = value;
+        }
+
+    for(z=0; z<n[VIO_Z]; z++) 
+      for(y=0; y<n[VIO_Y]; y++) 
+        for(x=0; x<n[VIO_X]; x++) {
+          value = 0.0;
+          for(k=0; k<n_taps[VIO_Z][z]; k++) 
+            value += weights[VIO_Z][z][k] * along_y[v][ taps[VIO_Z][z][k] ][y][x];
+          tile[ ((v*LAZY_TILE + z)*LAZY_TILE + y)*LAZY_TILE + x ] = (float)value;
+        }
+  }
+
+  lazy->tiles[tile_id] = tile;
+  lazy->n_filled++;
+
+  return(tile);
+}
+
+/* 
+   return the super-sampled deformation vector nearest to the world
+   coordinate (wx,wy,wz) in def[], computing the tile that contains it
+   if needed.  Returns FALSE (and leaves def[] untouched) when the point
+   falls outside of the deformation field.
+*/
+VIO_BOOL get_lazy_super_sampled_def(Lazy_super_sampled_def *lazy,
+                                    VIO_Real wx, VIO_Real wy, VIO_Real wz,
+                                    VIO_Real def[])
+{
+  float
+    *tile;
+  int
+    i, tile_id,
+    fine[VIO_N_DIMENSIONS],
+    t[VIO_N_DIMENSIONS];
+  VIO_Real
+    f,
+    voxel[VIO_MAX_DIMENSIONS];
+
+  convert_world_to_voxel(lazy->coarse_vol, wx, wy, wz, voxel);
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) {
+    f = lazy->factor * voxel[ lazy->xyzv[i] ];
+    if (f < -0.5 || f >= lazy->fine_count[i]-0.5)
+      return(FALSE);
+    fine[i] = (int)(f + 0.5);
+    t[i]    = fine[i] / LAZY_TILE;
+    fine[i] = fine[i] % LAZY_TILE;
+  }
+
+  tile_id = (t[VIO_Z]*lazy->n_tiles[VIO_Y] + t[VIO_Y])*lazy->n_tiles[VIO_X] + t[VIO_X];
+
+  tile = lazy->tiles[tile_id];
+  if (tile == NULL)
+    tile = fill_lazy_tile(lazy, tile_id, t);
+
+  for(i=0; i<VIO_N_DIMENSIONS; i++) 
+    def[i] = tile[ ((i*LAZY_TILE + fine[VIO_Z])*LAZY_TILE + fine[VIO_Y])*LAZY_TILE + fine[VIO_X] ];
+
+  return(TRUE);
+}
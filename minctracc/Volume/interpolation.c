@@ -71,7 +71,10 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 #endif
 
 #include <volume_io.h>
+#include <Proglib.h>
 #include "point_vector.h"
+#include "interpolation.h"
+#include "local_macros.h"
 
 #define VOL_NDIMS 3
 
@@ -151,8 +154,9 @@ int trilinear_interpolant(VIO_Volume volume,
   int sizes[3];
   int flag;
   double temp_result;
-  static double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
-  static double v000, v001, v010, v011, v100, v101, v110, v111;
+  /* automatic, not static: each thread has its own */
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double v000, v001, v010, v011, v100, v101, v110, v111;
   
   /* Check that the coordinate is inside the volume */
   
@@ -219,6 +223,92 @@ int trilinear_interpolant(VIO_Volume volume,
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : trilinear_gradient_interpolant
+@INPUT      : volume - pointer to volume data
+              coord - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated TRUE value.
+              gradient - derivatives of the interpolated value along the
+                 three voxel axes (in the order of coord).
+@RETURNS    : TRUE if coord is within the volume, FALSE otherwise.
+@DESCRIPTION: same value as trilinear_interpolant(), with its derivatives,
+              for the gradient based linear optimization.  Near the edges,
+              where trilinear_interpolant() uses the nearest neighbour,
+              the gradient is zero.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int trilinear_gradient_interpolant(VIO_Volume volume, 
+                                   PointR *coord, double *result,
+                                   double gradient[])
+{
+  long ind0, ind1, ind2;
+  int sizes[3];
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double v000, v001, v010, v011, v100, v101, v110, v111;
+  
+  get_volume_sizes(volume, sizes);
+  
+  if ((Point_x( *coord ) < 0) || (Point_x( *coord ) >= sizes[0]-1) ||
+      (Point_y( *coord ) < 0) || (Point_y( *coord ) >= sizes[1]-1) ||
+      (Point_z( *coord ) < 0) || (Point_z( *coord ) >= sizes[2]-1)) {
+    
+    gradient[0] = gradient[1] = gradient[2] = 0.0;
+    return(nearest_neighbour_interpolant(volume, coord, result));
+  }
+    
+  ind0 = (long) Point_x( *coord );
+  ind1 = (long) Point_y( *coord );
+  ind2 = (long) Point_z( *coord );
+  
+  GET_VALUE_3D( v000 ,  volume, ind0  , ind1  , ind2   ); 
+  GET_VALUE_3D( v001 ,  volume, ind0  , ind1  , ind2+1 ); 
+  GET_VALUE_3D( v010 ,  volume, ind0  , ind1+1, ind2   ); 
+  GET_VALUE_3D( v011 ,  volume, ind0  , ind1+1, ind2+1 ); 
+  GET_VALUE_3D( v100 ,  volume, ind0+1, ind1  , ind2   ); 
+  GET_VALUE_3D( v101 ,  volume, ind0+1, ind1  , ind2+1 ); 
+  GET_VALUE_3D( v110 ,  volume, ind0+1, ind1+1, ind2   ); 
+  GET_VALUE_3D( v111 ,  volume, ind0+1, ind1+1, ind2+1 ); 
+
+  f0 = Point_x( *coord ) - ind0;
+  f1 = Point_y( *coord ) - ind1;
+  f2 = Point_z( *coord ) - ind2;
+  r0 = 1.0 - f0;
+  r1 = 1.0 - f1;
+  r2 = 1.0 - f2;
+  
+                                /* the value as in trilinear_interpolant() */
+  r1r2 = r1 * r2;
+  r1f2 = r1 * f2;
+  f1r2 = f1 * r2;
+  f1f2 = f1 * f2;
+  
+  *result =
+    r0 *  (r1r2 * v000 +
+           r1f2 * v001 +
+           f1r2 * v010 +
+           f1f2 * v011);
+  *result +=
+    f0 *  (r1r2 * v100 +
+           r1f2 * v101 +
+           f1r2 * v110 +
+           f1f2 * v111);
+
+  gradient[0] = r1r2*(v100-v000) + r1f2*(v101-v001) +
+                f1r2*(v110-v010) + f1f2*(v111-v011);
+  gradient[1] = r0*r2*(v010-v000) + r0*f2*(v011-v001) +
+                f0*r2*(v110-v100) + f0*f2*(v111-v101);
+  gradient[2] = r0*r1*(v001-v000) + r0*f1*(v011-v010) +
+                f0*r1*(v101-v100) + f0*f1*(v111-v110);
+  
+  return TRUE;
+}
+
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : do_Ncubic_interpolation
 @INPUT      : volume - pointer to volume data
@@ -299,6 +389,41 @@ void do_Ncubic_interpolation(VIO_Volume volume,
 }
 
 
+/* the weights given to the four voxels around u (0 <= u < 1) by the
+   cubic of do_Ncubic_interpolation(), so that the interpolated value
+   is w[0]*v0 + w[1]*v1 + w[2]*v2 + w[3]*v3 */
+
+static void cubic_weights(double u, double w[4])
+{
+  w[0] = u * (-0.5 + u * ( 1.0 - 0.5 * u));
+  w[1] = 1.0 + u * u * (-2.5 + 1.5 * u);
+  w[2] = u * ( 0.5 + u * ( 2.0 - 1.5 * u));
+  w[3] = u * u * (-0.5 + 0.5 * u);
+}
+
+/* separable cubic interpolation of the 4x4x4 voxels in v (the last
+   index varying fastest): the 16 lines are reduced first, then the 4
+   planes, then the volume. */
+
+static double tricubic_sum(double v[64], 
+                           double w0[4], double w1[4], double w2[4])
+{
+  double 
+    line[16], plane[4];
+  int 
+    i;
+
+  for(i=0; i<16; i++)
+    line[i] = w2[0]*v[4*i] + w2[1]*v[4*i+1] + w2[2]*v[4*i+2] + w2[3]*v[4*i+3];
+
+  for(i=0; i<4; i++)
+    plane[i] = w1[0]*line[4*i] + w1[1]*line[4*i+1] + 
+               w1[2]*line[4*i+2] + w1[3]*line[4*i+3];
+
+  return( w0[0]*plane[0] + w0[1]*plane[1] + w0[2]*plane[2] + w0[3]*plane[3] );
+}
+
+
 /* ----------------------------- MNI Header -----------------------------------
 @NAME       : tricubic_interpolant
 @INPUT      : volume - pointer to volume data
@@ -314,14 +439,16 @@ void do_Ncubic_interpolation(VIO_Volume volume,
 @CREATED    : February 12, 1993 (Peter Neelin)
 @MODIFIED   : Fri May 28 09:06:12 EST 1993 Louis Collins
                mod to use david's volume_struct
+              separable, without the recursion of do_Ncubic_interpolation()
 ---------------------------------------------------------------------------- */
 int tricubic_interpolant(VIO_Volume volume, 
                                 PointR *coord, double *result)
 {
-   long ind0, ind1, ind2, max[3], index[VOL_NDIMS];
-   double frac[VOL_NDIMS];
+   long ind0, ind1, ind2, max[3];
+   double frac[VOL_NDIMS], w[VOL_NDIMS][4], v[64];
+   double ***data, *row;
    int sizes[3];
-   int flag;
+   int flag, i, j, k, n;
    double temp_result;
 
    /* Check that the coordinate is inside the volume */
@@ -358,16 +485,549 @@ int tricubic_interpolant(VIO_Volume volume,
        (ind2 >= max[2]-3) || (ind2 < 0)) {
       return trilinear_interpolant(volume, coord, result);
    }
-   index[0]=ind0; index[1]=ind1; index[2]=ind2;
 
-   /* Do the interpolation */
-   do_Ncubic_interpolation(volume, index, 0, frac, result);
+   /* Get the 4x4x4 voxels, from the rows of the data directly
+      when the volume is a double volume in memory */
+   n = 0;
+   if (get_volume_data_type(volume) == DOUBLE && VOXEL_DATA(volume) != NULL) {
+     data = VOXEL_DATA(volume);
+     for(i=0; i<4; i++)
+       for(j=0; j<4; j++) {
+         row = data[ind0+i][ind1+j] + ind2;
+         v[n++] = row[0]; v[n++] = row[1]; v[n++] = row[2]; v[n++] = row[3];
+       }
+   }
+   else {
+     for(i=0; i<4; i++)
+       for(j=0; j<4; j++)
+         for(k=0; k<4; k++) {
+           GET_VOXEL_3D( v[n],  volume, ind0+i, ind1+j, ind2+k );
+           n++;
+         }
+   }
+
+   /* Do the interpolation, with the weights of each axis computed
+      once, instead of the 21 cubics of do_Ncubic_interpolation() */
+   cubic_weights(frac[0], w[0]);
+   cubic_weights(frac[1], w[1]);
+   cubic_weights(frac[2], w[2]);
+
+   *result = CONVERT_VOXEL_TO_VALUE(volume, tricubic_sum(v, w[0], w[1], w[2]));
 
    return TRUE;
 
 }
 
 
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : init_volume_descriptor
+@INPUT      : volume - pointer to volume data
+@OUTPUT     : desc - what the descriptor interpolants need of the volume
+@RETURNS    : (nothing)
+@DESCRIPTION: takes the sizes, the voxel to value scaling and, for a double
+              volume held in one block of memory, the data pointer and
+              strides, once, so that the interpolants below need not ask
+              volume_io for them at each sample.  The descriptor holds no
+              state that changes while sampling: one descriptor can be
+              used by several threads.  It must be built again if the
+              volume is reallocated or rescaled.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+void init_volume_descriptor(Volume_descriptor *desc, VIO_Volume volume)
+{
+  double
+    ***data;
+
+  desc->volume = volume;
+  get_volume_sizes(volume, desc->sizes);
+
+  desc->strides[2] = 1;
+  desc->strides[1] = desc->sizes[2];
+  desc->strides[0] = (long)desc->sizes[1] * desc->sizes[2];
+
+  desc->translation = CONVERT_VOXEL_TO_VALUE(volume, 0.0);
+  desc->scale       = CONVERT_VOXEL_TO_VALUE(volume, 1.0) - desc->translation;
+  desc->outside     = CONVERT_VOXEL_TO_VALUE(volume, get_volume_voxel_min(volume));
+
+  desc->data = NULL;
+  if (get_volume_n_dimensions(volume) == VOL_NDIMS &&
+      get_volume_data_type(volume) == DOUBLE && VOXEL_DATA(volume) != NULL) {
+
+    data = VOXEL_DATA(volume);
+                                /* use the block only if the rows are
+                                   where the strides say they are */
+    if (data[desc->sizes[0]-1][desc->sizes[1]-1] == 
+        data[0][0] + (desc->sizes[0]-1)*desc->strides[0] + 
+                     (desc->sizes[1]-1)*desc->strides[1])
+      desc->data = data[0][0];
+  }
+
+  desc->bricks = NULL;
+  if (desc->data != NULL)
+    desc->bricks = get_volume_bricks(volume, desc->brick_count);
+}
+
+
+/* Volumes sampled along oblique paths (the target of a linear fit
+   under rotation, the sub-lattices of the nonlinear fit) can be
+   copied, by brick_volume(), into bricks of BRICK_SIDE^3 voxels stored
+   one after the other, so that the neighbours of a voxel lie in a few
+   cache lines and pages whatever the direction of the path.  The
+   copies are kept in a list, found by init_volume_descriptor() and
+   get_volume_bricks(), and must be freed by free_volume_bricks()
+   before the volume is changed. */
+
+typedef struct Volume_bricks_struct {
+  VIO_Volume volume;
+  int        count[3];          /* bricks along each axis */
+  double     *bricks;
+  struct Volume_bricks_struct *next;
+} Volume_bricks;
+
+static Volume_bricks *bricked_volumes = NULL;
+
+/* the bricked copy of volume, or NULL if there is none; count gets
+   the number of bricks along each axis */
+
+double *get_volume_bricks(VIO_Volume volume, int count[])
+{
+  Volume_bricks *entry;
+
+  for(entry=bricked_volumes; entry!=NULL; entry=entry->next)
+    if (entry->volume == volume) {
+      if (count != NULL) {
+        count[0] = entry->count[0];
+        count[1] = entry->count[1];
+        count[2] = entry->count[2];
+      }
+      return(entry->bricks);
+    }
+
+  return(NULL);
+}
+
+/* make a bricked copy of a double volume in memory; returns FALSE
+   (and makes none) for any other volume */
+
+VIO_BOOL brick_volume(VIO_Volume volume)
+{
+  Volume_descriptor desc;
+  Volume_bricks *entry;
+  long i, j, k, n;
+
+  if (get_volume_bricks(volume, NULL) != NULL)
+    return(TRUE);
+
+  init_volume_descriptor(&desc, volume);
+  if (desc.data == NULL)
+    return(FALSE);
+
+  ALLOC(entry, 1);
+  entry->volume = volume;
+  n = BRICK_SIDE * BRICK_SIDE * BRICK_SIDE;
+  for(i=0; i<3; i++) {
+    entry->count[i] = (desc.sizes[i] + BRICK_SIDE - 1) / BRICK_SIDE;
+    n *= entry->count[i];
+  }
+
+  ALLOC(entry->bricks, n);
+  for(i=0; i<n; i++)            /* the padding of the last bricks */
+    entry->bricks[i] = 0.0;
+
+  for(i=0; i<desc.sizes[0]; i++)
+    for(j=0; j<desc.sizes[1]; j++)
+      for(k=0; k<desc.sizes[2]; k++)
+        entry->bricks[ BRICK_OFFSET(entry->count, i, j, k) ] = 
+          desc.data[ i*desc.strides[0] + j*desc.strides[1] + k ];
+
+  entry->next = bricked_volumes;
+  bricked_volumes = entry;
+
+  return(TRUE);
+}
+
+void free_volume_bricks(void)
+{
+  Volume_bricks *entry;
+
+  while (bricked_volumes != NULL) {
+    entry = bricked_volumes;
+    bricked_volumes = entry->next;
+    FREE(entry->bricks);
+    FREE(entry);
+  }
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : descriptor_nearest_neighbour_interpolant
+@INPUT      : desc - descriptor of the volume, from init_volume_descriptor()
+              x,y,z - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated TRUE value.
+@RETURNS    : TRUE if the point is within the volume, FALSE otherwise.
+@DESCRIPTION: nearest_neighbour_interpolant() on a volume descriptor.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int descriptor_nearest_neighbour_interpolant(Volume_descriptor *desc, 
+                                             VIO_Real x, VIO_Real y, VIO_Real z,
+                                             double *result)
+{
+  long ind0, ind1, ind2;
+
+  if ((x < -0.5) || (x >= desc->sizes[0]-0.5) ||
+      (y < -0.5) || (y >= desc->sizes[1]-0.5) ||
+      (z < -0.5) || (z >= desc->sizes[2]-0.5)) {
+    *result = desc->outside;
+    return FALSE;
+  }
+
+  ind0 = (long) (x + 0.5);
+  ind1 = (long) (y + 0.5);
+  ind2 = (long) (z + 0.5);
+
+  if (desc->bricks != NULL)
+    *result = desc->scale * desc->bricks[ BRICK_OFFSET(desc->brick_count, ind0, ind1, ind2) ] + 
+              desc->translation;
+  else if (desc->data != NULL)
+    *result = desc->scale * desc->data[ind0*desc->strides[0] + ind1*desc->strides[1] + ind2] + 
+              desc->translation;
+  else
+    GET_VALUE_3D( *result ,  desc->volume, ind0, ind1, ind2 );
+
+  return TRUE;
+}
+
+
+/* the eight voxels around (ind0,ind1,ind2) of a descriptor with data,
+   v000 to v111 in that order */
+
+static void trilinear_corners(Volume_descriptor *desc, 
+                              long ind0, long ind1, long ind2,
+                              double v[8])
+{
+  long s0, s1;
+  double *p;
+  int *count;
+
+  if (desc->bricks != NULL) {
+    count = desc->brick_count;
+    v[0] = desc->bricks[ BRICK_OFFSET(count, ind0  , ind1  , ind2  ) ];
+    v[1] = desc->bricks[ BRICK_OFFSET(count, ind0  , ind1  , ind2+1) ];
+    v[2] = desc->bricks[ BRICK_OFFSET(count, ind0  , ind1+1, ind2  ) ];
+    v[3] = desc->bricks[ BRICK_OFFSET(count, ind0  , ind1+1, ind2+1) ];
+    v[4] = desc->bricks[ BRICK_OFFSET(count, ind0+1, ind1  , ind2  ) ];
+    v[5] = desc->bricks[ BRICK_OFFSET(count, ind0+1, ind1  , ind2+1) ];
+    v[6] = desc->bricks[ BRICK_OFFSET(count, ind0+1, ind1+1, ind2  ) ];
+    v[7] = desc->bricks[ BRICK_OFFSET(count, ind0+1, ind1+1, ind2+1) ];
+  }
+  else {
+    s0 = desc->strides[0];
+    s1 = desc->strides[1];
+    p  = desc->data + ind0*s0 + ind1*s1 + ind2;
+    v[0] = p[0];     v[1] = p[1];
+    v[2] = p[s1];    v[3] = p[s1+1];
+    v[4] = p[s0];    v[5] = p[s0+1];
+    v[6] = p[s0+s1]; v[7] = p[s0+s1+1];
+  }
+}
+
+
+/* tri-linear interpolation at a point known to be inside the volume
+   (0 <= x < sizes[0]-1, ...) of a descriptor with data: no checks. */
+
+static double trilinear_interior(Volume_descriptor *desc, 
+                                 VIO_Real x, VIO_Real y, VIO_Real z)
+{
+  long ind0, ind1, ind2;
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double v[8];
+
+  ind0 = (long) x;
+  ind1 = (long) y;
+  ind2 = (long) z;
+  f0 = x - ind0;  r0 = 1.0 - f0;
+  f1 = y - ind1;  r1 = 1.0 - f1;
+  f2 = z - ind2;  r2 = 1.0 - f2;
+
+  trilinear_corners(desc, ind0, ind1, ind2, v);
+
+  r1r2 = r1 * r2;
+  r1f2 = r1 * f2;
+  f1r2 = f1 * r2;
+  f1f2 = f1 * f2;
+
+  return( desc->scale * 
+          (r0 * (r1r2 * v[0] + r1f2 * v[1] + 
+                 f1r2 * v[2] + f1f2 * v[3]) +
+           f0 * (r1r2 * v[4] + r1f2 * v[5] + 
+                 f1r2 * v[6] + f1f2 * v[7])) +
+          desc->translation );
+}
+
+
+/* trilinear_interior() with the derivatives of the value along the
+   three voxel axes, as in trilinear_gradient_interpolant() */
+
+static double trilinear_gradient_interior(Volume_descriptor *desc, 
+                                          VIO_Real x, VIO_Real y, VIO_Real z,
+                                          double gradient[])
+{
+  long ind0, ind1, ind2;
+  double f0, f1, f2, r0, r1, r2, r1r2, r1f2, f1r2, f1f2;
+  double v[8];
+
+  ind0 = (long) x;
+  ind1 = (long) y;
+  ind2 = (long) z;
+  f0 = x - ind0;  r0 = 1.0 - f0;
+  f1 = y - ind1;  r1 = 1.0 - f1;
+  f2 = z - ind2;  r2 = 1.0 - f2;
+
+  trilinear_corners(desc, ind0, ind1, ind2, v);
+
+  r1r2 = r1 * r2;
+  r1f2 = r1 * f2;
+  f1r2 = f1 * r2;
+  f1f2 = f1 * f2;
+
+  gradient[0] = desc->scale * 
+    (r1r2*(v[4]-v[0]) + r1f2*(v[5]-v[1]) +
+     f1r2*(v[6]-v[2]) + f1f2*(v[7]-v[3]));
+  gradient[1] = desc->scale * 
+    (r0*r2*(v[2]-v[0]) + r0*f2*(v[3]-v[1]) +
+     f0*r2*(v[6]-v[4]) + f0*f2*(v[7]-v[5]));
+  gradient[2] = desc->scale * 
+    (r0*r1*(v[1]-v[0]) + r0*f1*(v[3]-v[2]) +
+     f0*r1*(v[5]-v[4]) + f0*f1*(v[7]-v[6]));
+
+  return( desc->scale * 
+          (r0 * (r1r2 * v[0] + r1f2 * v[1] + 
+                 f1r2 * v[2] + f1f2 * v[3]) +
+           f0 * (r1r2 * v[4] + r1f2 * v[5] + 
+                 f1r2 * v[6] + f1f2 * v[7])) +
+          desc->translation );
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : descriptor_trilinear_interpolant
+@INPUT      : desc - descriptor of the volume, from init_volume_descriptor()
+              x,y,z - point at which volume should be interpolated in voxel 
+                 units (with 0 being first point of the volume).
+@OUTPUT     : result - interpolated TRUE value.
+@RETURNS    : TRUE if the point is within the volume, FALSE otherwise.
+@DESCRIPTION: trilinear_interpolant() on a volume descriptor.  Points in
+              the interior go to trilinear_interior(), which reads the
+              data block without any check; the others, within a voxel
+              of the edge, take the nearest neighbour as before.  There
+              is no static storage: this can be called from several
+              threads.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int descriptor_trilinear_interpolant(Volume_descriptor *desc, 
+                                     VIO_Real x, VIO_Real y, VIO_Real z,
+                                     double *result)
+{
+  PointR coord;
+
+  if ((x < 0) || (x >= desc->sizes[0]-1) ||
+      (y < 0) || (y >= desc->sizes[1]-1) ||
+      (z < 0) || (z >= desc->sizes[2]-1)) 
+    return(descriptor_nearest_neighbour_interpolant(desc, x, y, z, result));
+
+  if (desc->data == NULL) {
+    fill_Point(coord, x, y, z);
+    return(trilinear_interpolant(desc->volume, &coord, result));
+  }
+
+  *result = trilinear_interior(desc, x, y, z);
+
+  return TRUE;
+}
+
+
+/* tri-cubic interpolation at a point at least one voxel away from
+   the edges of a descriptor with data (1 <= x < sizes[0]-2, ...), as
+   in tricubic_interpolant(): no checks. */
+
+static double tricubic_interior(Volume_descriptor *desc, 
+                                VIO_Real x, VIO_Real y, VIO_Real z)
+{
+  long ind0, ind1, ind2;
+  double w[VOL_NDIMS][4], v[64], *plane, *row;
+  int i, j, k, n;
+
+  ind0 = (long) x;
+  ind1 = (long) y;
+  ind2 = (long) z;
+  cubic_weights(x - ind0, w[0]);
+  cubic_weights(y - ind1, w[1]);
+  cubic_weights(z - ind2, w[2]);
+
+  n = 0;
+  if (desc->bricks != NULL) {
+    for(i=0; i<4; i++)
+      for(j=0; j<4; j++)
+        for(k=0; k<4; k++)
+          v[n++] = desc->bricks[ BRICK_OFFSET(desc->brick_count, 
+                                              ind0-1+i, ind1-1+j, ind2-1+k) ];
+  }
+  else {
+    plane = desc->data + (ind0-1)*desc->strides[0] + (ind1-1)*desc->strides[1] + ind2-1;
+    for(i=0; i<4; i++, plane += desc->strides[0]) {
+      row = plane;
+      for(j=0; j<4; j++, row += desc->strides[1]) {
+        v[n++] = row[0]; v[n++] = row[1]; v[n++] = row[2]; v[n++] = row[3];
+      }
+    }
+  }
+
+  return( desc->scale * tricubic_sum(v, w[0], w[1], w[2]) + desc->translation );
+}
+
+
+/* the derivatives of the trilinear interpolant at a point, as in
+   trilinear_gradient_interpolant() but through the descriptor: zero
+   within a voxel of the edges.  Returns TRUE if the point is within
+   the volume. */
+
+static int descriptor_trilinear_gradient(Volume_descriptor *desc, 
+                                         VIO_Real x, VIO_Real y, VIO_Real z,
+                                         double gradient[])
+{
+  PointR coord;
+  double value;
+
+  if (desc->data == NULL) {
+    fill_Point(coord, x, y, z);
+    return(trilinear_gradient_interpolant(desc->volume, &coord, &value, gradient));
+  }
+
+  if ((x >= 0) && (x < desc->sizes[0]-1) &&
+      (y >= 0) && (y < desc->sizes[1]-1) &&
+      (z >= 0) && (z < desc->sizes[2]-1)) {
+    (void)trilinear_gradient_interior(desc, x, y, z, gradient);
+    return(TRUE);
+  }
+
+  gradient[0] = gradient[1] = gradient[2] = 0.0;
+  return(descriptor_nearest_neighbour_interpolant(desc, x, y, z, &value));
+}
+
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : interpolate_points
+@INPUT      : desc - descriptor of the volume, from init_volume_descriptor()
+              interpolant - nearest_neighbour_interpolant, 
+                 trilinear_interpolant, tricubic_interpolant or any other
+                 Interpolating_Function
+              n - number of points
+              x,y,z - the points, in voxel units (with 0 being first point
+                 of the volume)
+@OUTPUT     : value - interpolated TRUE value of each point
+              inside - TRUE for the points within the volume
+              gradient - if not NULL, the derivatives of the trilinear
+                 interpolant along the three voxel axes at each point,
+                 whichever interpolant gives the values (zero near the
+                 edges, as with trilinear_gradient_interpolant())
+@RETURNS    : the number of points within the volume
+@DESCRIPTION: the interpolant applied to n points at once, for the lattice
+              walkers.  For the three interpolants above, on a double
+              volume in memory, the points are sampled through the
+              descriptor (the interior ones without any bounds check),
+              with the same values as the interpolant would give; any
+              other interpolant is called on each point.  With the
+              trilinear interpolant, the value and the gradient of a
+              point come from the same eight voxels.  No static
+              storage: several threads can call this at once.
+@METHOD     : 
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
+int interpolate_points(Volume_descriptor *desc, 
+                       int (*interpolant)(VIO_Volume, PointR *, double *),
+                       int n,
+                       VIO_Real x[], VIO_Real y[], VIO_Real z[],
+                       double value[],
+                       char inside[],
+                       double (*gradient)[3])
+{
+  PointR coord;
+  int k, n_inside;
+  VIO_BOOL gradient_done;
+
+  gradient_done = FALSE;
+
+  if (interpolant == nearest_neighbour_interpolant) {
+    for(k=0; k<n; k++)
+      inside[k] = descriptor_nearest_neighbour_interpolant(desc, x[k], y[k], z[k], &value[k]);
+  }
+  else if (interpolant == trilinear_interpolant && desc->data != NULL) {
+    for(k=0; k<n; k++) {
+      if ((x[k] >= 0) && (x[k] < desc->sizes[0]-1) &&
+          (y[k] >= 0) && (y[k] < desc->sizes[1]-1) &&
+          (z[k] >= 0) && (z[k] < desc->sizes[2]-1)) {
+        if (gradient != NULL)
+          value[k] = trilinear_gradient_interior(desc, x[k], y[k], z[k], gradient[k]);
+        else
+          value[k] = trilinear_interior(desc, x[k], y[k], z[k]);
+        inside[k] = TRUE;
+      }
+      else {
+        if (gradient != NULL)
+          gradient[k][0] = gradient[k][1] = gradient[k][2] = 0.0;
+        inside[k] = descriptor_nearest_neighbour_interpolant(desc, x[k], y[k], z[k], &value[k]);
+      }
+    }
+    gradient_done = TRUE;
+  }
+  else if (interpolant == tricubic_interpolant && desc->data != NULL) {
+    for(k=0; k<n; k++) {
+      if ((x[k] >= 1) && ((long)x[k] < desc->sizes[0]-2) &&
+          (y[k] >= 1) && ((long)y[k] < desc->sizes[1]-2) &&
+          (z[k] >= 1) && ((long)z[k] < desc->sizes[2]-2)) {
+        value[k]  = tricubic_interior(desc, x[k], y[k], z[k]);
+        inside[k] = TRUE;
+      }
+      else                      /* the edges, as in tricubic_interpolant() */
+        inside[k] = descriptor_trilinear_interpolant(desc, x[k], y[k], z[k], &value[k]);
+    }
+  }
+  else {
+    for(k=0; k<n; k++) {
+      fill_Point(coord, x[k], y[k], z[k]);
+      inside[k] = (*interpolant)(desc->volume, &coord, &value[k]);
+    }
+  }
+
+  if (gradient != NULL && !gradient_done)
+    for(k=0; k<n; k++)
+      if (!descriptor_trilinear_gradient(desc, x[k], y[k], z[k], gradient[k]))
+        inside[k] = FALSE;
+
+  n_inside = 0;
+  for(k=0; k<n; k++)
+    if (inside[k]) n_inside++;
+
+  return(n_inside);
+}
+
+
 /* A point is not masked if it is a point we should consider.
    If the mask volume is NULL, we consider all points.
    Otherwise, consider a point if the mask volume value is > 0.
@@ -110,6 +110,8 @@ static char rcsid[]="$Header: /private-cvsroot/registration/mni_autoreg/minctrac
 
 int point_not_masked(VIO_Volume volume, 
                             VIO_Real wx, VIO_Real wy, VIO_Real wz);
+int voxel_point_not_masked(VIO_Volume volume, 
+                                  VIO_Real vx, VIO_Real vy, VIO_Real vz);
 VIO_Real get_value_of_point_in_volume(VIO_Real xw, VIO_Real yw, VIO_Real zw, 
           VIO_Volume data);
 
@@ -125,117 +127,212 @@ void  set_feature_value_threshold(VIO_Volume d1,
 #define MIN_ZRANGE -5.0
 #define MAX_ZRANGE  5.0
 
+/* running statistics of the voxels of one slice, combined in slice
+   order by add_zscore_stats() (Welford, and Chan et al. for the
+   combination), so that the mean and std do not depend on the number
+   of threads. */
+
+typedef struct {
+  unsigned long count;
+  VIO_Real      mean;
+  VIO_Real      m2;             /* sum of squared differences to mean */
+} Zscore_stats;
+
+static void add_zscore_stats(Zscore_stats *total, Zscore_stats *part)
+{
+  VIO_Real
+    n, delta;
+
+  if (part->count == 0)
+    return;
+
+  n     = (VIO_Real)total->count + (VIO_Real)part->count;
+  delta = part->mean - total->mean;
+
+  total->mean += delta * (VIO_Real)part->count / n;
+  total->m2   += part->m2 + 
+                 delta * delta * (VIO_Real)total->count * (VIO_Real)part->count / n;
+  total->count += part->count;
+}
+
+/* the affine map from the voxels of d1 to those of m1: origin, then the
+   steps along the slice, row and col axes of d1.  Returns TRUE when the
+   two volumes share the same grid, so that voxel (s,r,c) of d1 is voxel
+   (s,r,c) of m1. */
+
+static VIO_BOOL map_voxels_to_mask(VIO_Volume d1, VIO_Volume m1, 
+                                   VIO_Real map[4][3])
+{
+  int
+    d1_sizes[VIO_MAX_DIMENSIONS],
+    m1_sizes[VIO_MAX_DIMENSIONS],
+    i,j;
+  VIO_Real
+    vox[3],
+    wx,wy,wz;
+  VIO_BOOL
+    same;
+
+  for(i=0; i<4; i++) {
+    for(j=0; j<3; j++) 
+      vox[j] = (i == j+1) ? 1.0 : 0.0;
+    convert_3D_voxel_to_world(d1, vox[0], vox[1], vox[2], &wx, &wy, &wz);
+    convert_3D_world_to_voxel(m1, wx, wy, wz, &map[i][0], &map[i][1], &map[i][2]);
+  }
+  for(i=1; i<4; i++)
+    for(j=0; j<3; j++) 
+      map[i][j] -= map[0][j];
+
+  get_volume_sizes(d1, d1_sizes);
+  get_volume_sizes(m1, m1_sizes);
+
+  same = TRUE;
+  for(j=0; j<3; j++) {
+    if (d1_sizes[j] != m1_sizes[j]) 
+      same = FALSE;
+    for(i=0; i<4; i++) 
+      if (fabs(map[i][j] - ((i == j+1) ? 1.0 : 0.0)) > 1e-5)
+        same = FALSE;
+  }
+
+  return(same);
+}
+
+/* ----------------------------- MNI Header -----------------------------------
+@NAME       : make_zscore_volume
+@INPUT      : d1 - volume of data
+              m1 - its mask (may be NULL)
+              threshold - lower limit of the values considered
+@OUTPUT     : d1 - replaced by its z-score, clamped to [-5,5]
+              threshold - the threshold, in z-score
+@RETURNS    : 
+@DESCRIPTION: the mean and std of the voxels above threshold (and inside
+              the mask) are tallied in one pass, and every voxel above
+              threshold is then replaced in place by its z-score; the
+              others are set to the bottom of the range.
+
+              When the mask shares the grid of the data, the mask voxel
+              is read at the same index; otherwise the mask voxel
+              coordinates are stepped along the data voxels.  Both passes
+              are done slice by slice, in parallel when built with OpenMP.
+@GLOBALS    : 
+@CALLS      : 
+@CREATED    : 
+@MODIFIED   : 
+---------------------------------------------------------------------------- */
 void make_zscore_volume(VIO_Volume d1, VIO_Volume m1, 
                                VIO_Real *threshold)
 {
-  unsigned long
-    count;
   int 
-    stat_count,
     sizes[VIO_MAX_DIMENSIONS],
-    s,r,c;
+    s;
   VIO_Real
-    wx,wy,wz,
+    map[4][3],
     valid_min_dvoxel, valid_max_dvoxel,
-    min,max,
-    sum, sum2, mean, var, std,
-    data_vox,data_val,
-    thick[VIO_MAX_DIMENSIONS];
-
-  PointR 
-    voxel;
-
+    mean, var, std;
+  VIO_BOOL
+    same_grid;
+  Zscore_stats
+    total,
+    *slice_stats;
   VIO_Volume 
     vol;
 
-  VIO_progress_struct
-    progress;
-
   /* get default information from data and mask */
 
-  /* build temporary working volume */
- 
-  vol = copy_volume_definition(d1, NC_UNSPECIFIED, FALSE, 0.0, 0.0);
-  set_volume_real_range(vol, MIN_ZRANGE, MAX_ZRANGE);
   get_volume_sizes(d1, sizes);
-  get_volume_separations(d1, thick);
   get_volume_voxel_range(d1, &valid_min_dvoxel, &valid_max_dvoxel);
 
-  /* initialize counters and sums */
+  same_grid = FALSE;
+  if (m1 != NULL)
+    same_grid = map_voxels_to_mask(d1, m1, map);
 
-  count  = 0;
-  sum  = 0.0;
-  sum2 = 0.0;
-  min = 1e38;
-  max = -1e38;
-  stat_count = 0;
+  /* build a header to convert z-scores to voxels, the data
+     itself is replaced in place */
+ 
+  vol = copy_volume_definition_no_alloc(d1, NC_UNSPECIFIED, FALSE, 0.0, 0.0);
+  set_volume_real_range(vol, MIN_ZRANGE, MAX_ZRANGE);
 
-  initialize_progress_report(&progress, FALSE, sizes[0]*sizes[1]*sizes[2] + 1,
-                             "Tally stats" );
+  ALLOC(slice_stats, sizes[0]+1);
 
                                 /* do first pass, to get mean and std */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
   for(s=0; s<sizes[0]; s++) {
+    Zscore_stats
+      *stats;
+    VIO_Real
+      mask_val,
+      data_vox,data_val,
+      delta;
+    int
+      r,c;
+
+    stats = &slice_stats[s];
+    stats->count = 0;
+    stats->mean  = 0.0;
+    stats->m2    = 0.0;
+
     for(r=0; r<sizes[1]; r++) {
       for(c=0; c<sizes[2]; c++) {
 
-        stat_count++;
-        update_progress_report( &progress, stat_count);
-        convert_3D_voxel_to_world(d1, (VIO_Real)s, (VIO_Real)r, (VIO_Real)c, &wx, &wy, &wz);
-
         if (m1 != NULL) {
-          convert_3D_world_to_voxel(m1, wx, wy, wz, &Point_x(voxel), &Point_y(voxel), &Point_z(voxel));
-        }
-        else {
-          wx = 0.0; wy = 0.0; wz = 0.0;
+          if (same_grid) {
+            GET_VALUE_3D( mask_val, m1, s, r, c );
+            if (!(mask_val > 0.0))
+              continue;
+          }
+          else if (!voxel_point_not_masked(m1, 
+                          map[0][0] + s*map[1][0] + r*map[2][0] + c*map[3][0],
+                          map[0][1] + s*map[1][1] + r*map[2][1] + c*map[3][1],
+                          map[0][2] + s*map[1][2] + r*map[2][2] + c*map[3][2]))
+            continue;
         }
-
-        if (point_not_masked(m1, wx,wy,wz)) {
           
-          GET_VOXEL_3D( data_vox,  d1 , s, r, c );
+        GET_VOXEL_3D( data_vox,  d1 , s, r, c );
 
-          if (data_vox >= valid_min_dvoxel && data_vox <= valid_max_dvoxel) { 
+        if (data_vox >= valid_min_dvoxel && data_vox <= valid_max_dvoxel) { 
 
-            data_val = CONVERT_VOXEL_TO_VALUE(d1, data_vox);
+          data_val = CONVERT_VOXEL_TO_VALUE(d1, data_vox);
             
-            if (data_val > *threshold) {
-              sum  += data_val;
-              sum2 += data_val*data_val;
-              
-              count++;
-              
-              if (data_val < min)
-                min = data_val;
-              else
-                if (data_val > max)
-                  max = data_val;
-            }
+          if (data_val > *threshold) {
+            stats->count++;
+            delta = data_val - stats->mean;
+            stats->mean += delta / (VIO_Real)stats->count;
+            stats->m2   += delta * (data_val - stats->mean);
           }
         }
       }
     }
   }
-  terminate_progress_report( &progress );
 
-  stat_count = 0;
-  initialize_progress_report(&progress, FALSE, sizes[0]*sizes[1]*sizes[2] + 1,
-                             "Zscore convert" );
+  total.count = 0;
+  total.mean  = 0.0;
+  total.m2    = 0.0;
+  for(s=0; s<sizes[0]; s++)
+    add_zscore_stats(&total, &slice_stats[s]);
+
+  FREE(slice_stats);
 
                                 /* calc mean and std */
-  mean = sum / (float)count;
-  var  = ((float)count*sum2 - sum*sum) / ((float)count*((float)count-1));
+  mean = total.mean;
+  var  = total.m2 / ((VIO_Real)total.count - 1.0);
   std  = sqrt(var);
 
-  min = 1e38;
-  max = -1e38;
-
                                 /* replace the voxel values */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
   for(s=0; s<sizes[0]; s++) {
+    VIO_Real
+      data_vox,data_val;
+    int
+      r,c;
+
     for(r=0; r<sizes[1]; r++) {
       for(c=0; c<sizes[2]; c++) {
         
-        stat_count++;
-        update_progress_report( &progress, stat_count);
-
         GET_VOXEL_3D( data_vox,  d1, s, r, c );
         
         if (data_vox >= valid_min_dvoxel && data_vox <= valid_max_dvoxel) { 
@@ -244,41 +341,25 @@ void make_zscore_volume(VIO_Volume d1, VIO_Volume m1,
           
           if (data_val > *threshold) {
 
-                                /* instead of   
-                                   data_val = CONVERT_VALUE_TO_VOXEL(d1, data_vox);
-                                   i will use
-                                   data_val = CONVERT_VALUE_TO_VOXEL(d1, vol);
-
-                                   since the values in vol are changed with respect to the
-                                   new z-score volume */
+                                /* the voxel value is computed with the
+                                   z-score range of vol, which becomes
+                                   the range of d1 below */
 
             data_val = (data_val - mean) / std;
             if (data_val< MIN_ZRANGE) data_val = MIN_ZRANGE;
             if (data_val> MAX_ZRANGE) data_val = MAX_ZRANGE;
 
             data_vox = CONVERT_VALUE_TO_VOXEL( vol, data_val);
-            
-
-            if (data_val < min) {
-              min = data_val;
-            }
-            else {
-              if (data_val > max)
-                max = data_val;
-            }
           }
           else
             data_vox = -DBL_MAX;   /* should be fill_value! */
           
           SET_VOXEL_3D( d1 , s, r, c, data_vox );
         }
-        
       }
     }
   }
 
-  terminate_progress_report( &progress );
-
   set_volume_real_range(d1, MIN_ZRANGE, MAX_ZRANGE);        /* reset the data volume's range */
 
   *threshold = (*threshold - mean) / std;
@@ -410,41 +491,147 @@ void qs_list(float *item2, int left, int right)
 }
 
 
-void normalize_data_to_match_target(VIO_Volume d1, VIO_Volume m1, VIO_Real thresh1,
-                                           VIO_Volume d2, VIO_Volume m2, VIO_Real thresh2,
-                                           Arg_Data *globals)
+/* the k-th smallest element of item2[0..n-1] (k from 0), found by
+   quickselect with a median of three pivot.  item2 is partly
+   reordered.  Should the partitions stop shrinking fast enough, the
+   part left is sorted with qs_list(), so that the cost stays
+   O(n log n) at worst and is O(n) in general. */
+
+static float select_order_statistic(float *item2, int n, int k)
 {
+  int 
+    left, right, i, j, mid, depth;
+  float 
+    x, y;
 
-  VectorR
-    vector_step;
+  left  = 0;
+  right = n-1;
+  depth = 0;
+  for(i=n; i>1; i/=2) depth += 2;
+
+  while (right > left) {
+
+    if (depth-- <= 0) {
+      qs_list(item2, left, right);
+      break;
+    }
+                                /* median of three, in place */
+    mid = left + (right-left)/2;
+    if (item2[mid]   < item2[left]) { y=item2[mid];   item2[mid]=item2[left];  item2[left]=y; }
+    if (item2[right] < item2[left]) { y=item2[right]; item2[right]=item2[left]; item2[left]=y; }
+    if (item2[right] < item2[mid])  { y=item2[right]; item2[right]=item2[mid];  item2[mid]=y; }
+    x = item2[mid];
+
+    i = left;
+    j = right;
+    do {
+      while (item2[i] < x) i++;
+      while (x < item2[j]) j--;
+      if (i<=j) {
+        y=item2[i];
+        item2[i]=item2[j];
+        item2[j]=y;
+        i++;
+        j--;
+      }
+    } while (i<=j);
+                                /* [left,j] <= x <= [i,right] */
+    if (k <= j)
+      right = j;
+    else if (k >= i)
+      left = i;
+    else
+      break;                    /* j < k < i: item2[k] == x */
+  }
+
+  return(item2[k]);
+}
+
+/* collect the ratios of d1 to d2 values on slice s of the lattice into
+   ratios[], and return their number.  count1 is the number of nodes
+   above the threshold in d1. */
 
+static int normalize_ratios_slice(VIO_Volume d1, VIO_Volume m1, VIO_Real t1,
+                                  VIO_Volume d2, VIO_Volume m2, VIO_Real t2,
+                                  Arg_Data *globals,
+                                  int s,
+                                  float *ratios,
+                                  int *count1)
+{
   PointR
-    starting_position,
-    slice,
-    row,
     col,
-    pos2,
-    voxel;
+    pos2;
+  VIO_Real
+    value1, value2;
+  int
+    r,c,count2;
+
+  count2  = 0;
+  *count1 = 0;
+
+  for(r=0; r<=globals->count[ROW_IND]; r++) {
+    for(c=0; c<=globals->count[COL_IND]; c++) {
+
+      fill_Point( col,
+                  globals->start[VIO_X] + s*Point_x(globals->directions[SLICE_IND]) +
+                     r*Point_x(globals->directions[ROW_IND]) + c*Point_x(globals->directions[COL_IND]),
+                  globals->start[VIO_Y] + s*Point_y(globals->directions[SLICE_IND]) +
+                     r*Point_y(globals->directions[ROW_IND]) + c*Point_y(globals->directions[COL_IND]),
+                  globals->start[VIO_Z] + s*Point_z(globals->directions[SLICE_IND]) +
+                     r*Point_z(globals->directions[ROW_IND]) + c*Point_z(globals->directions[COL_IND]) );
+        
+      if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {
+
+        value1 = get_value_of_point_in_volume( Point_x(col), Point_y(col), Point_z(col), d1);
+
+        if ( value1 > t1 ) {
+
+          (*count1)++;
+
+          DO_TRANSFORM(pos2, globals->trans_info.transformation, col);
+            
+          if (point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
+
+            value2 = get_value_of_point_in_volume( Point_x(pos2), Point_y(pos2), Point_z(pos2), d2);
+
+            if ( (value2 > t2)  && 
+                 ((value2 < -1e-15) || (value2 > 1e-15)) ) {
+                  
+              ratios[count2++] = value1 / value2 ;
+                
+            } /* if voxel in d2 */
+          } /* if point in mask volume two */
+        } /* if voxel in d1 */
+      } /* if point in mask volume one */
+        
+    } /* for c */
+  } /* for r */
+
+  return(count2);
+}
+
+
+void normalize_data_to_match_target(VIO_Volume d1, VIO_Volume m1, VIO_Real thresh1,
+                                           VIO_Volume d2, VIO_Volume m2, VIO_Real thresh2,
+                                           Arg_Data *globals)
+{
 
-  double
-    tx,ty,tz;
   int
     i,j,k,
-    r,c,s;
+    s;
 
   VIO_Real
     min_range, max_range,
-    data_vox, data_val,
-    value1, value2;
+    data_vox, data_val;
   
   VIO_Real
-    t1,t2,                        /* temporary threshold values     */
-    s1,s2,s3;                   /* to store the sums for f1,f2,f3 */
+    t1,t2;                        /* temporary threshold values     */
   float 
     *ratios,
     result;                                /* the result */
   int 
-    sizes[VIO_MAX_DIMENSIONS],ratios_size,count1,count2;
+    sizes[VIO_MAX_DIMENSIONS],slice_size,count1,count2,
+    *slice_count1, *slice_count2;
 
   VIO_Volume 
     vol;
@@ -464,82 +651,37 @@ void normalize_data_to_match_target(VIO_Volume d1, VIO_Volume m1, VIO_Real thres
     print ("In normalize_data_to_match_target, thresh = %10.3f %10.3f\n",t1,t2) ;
   }
 
-  ratios_size = globals->count[ROW_IND] * globals->count[COL_IND] * globals->count[SLICE_IND];
+                                /* the lattice is walked from 0 to count
+                                   inclusive, along each axis; each slice
+                                   fills its own part of ratios[] */
 
-  ALLOC(ratios, ratios_size);  
+  slice_size = (globals->count[ROW_IND]+1) * (globals->count[COL_IND]+1);
 
-  fill_Point( starting_position, globals->start[VIO_X], globals->start[VIO_Y], globals->start[VIO_Z]);
+  ALLOC(ratios,       slice_size * (globals->count[SLICE_IND]+1));  
+  ALLOC(slice_count1, globals->count[SLICE_IND]+1);  
+  ALLOC(slice_count2, globals->count[SLICE_IND]+1);  
 
-  s1 = s2 = s3 = 0.0;
-  count1 = count2 = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(s=0; s<=globals->count[SLICE_IND]; s++) 
+    slice_count2[s] = normalize_ratios_slice(d1, m1, t1, d2, m2, t2, globals, s,
+                                             &ratios[s*slice_size], &slice_count1[s]);
 
+                                /* pack the ratios, in slice order */
+  count1 = count2 = 0;
   for(s=0; s<=globals->count[SLICE_IND]; s++) {
+    count1 += slice_count1[s];
+    for(i=0; i<slice_count2[s]; i++) 
+      ratios[count2++] = ratios[s*slice_size + i];
+  }
 
-    SCALE_VECTOR( vector_step, globals->directions[SLICE_IND], s);
-    ADD_POINT_VECTOR( slice, starting_position, vector_step );
-
-    for(r=0; r<=globals->count[ROW_IND]; r++) {
-      
-      SCALE_VECTOR( vector_step, globals->directions[ROW_IND], r);
-      ADD_POINT_VECTOR( row, slice, vector_step );
-      
-      SCALE_POINT( col, row, 1.0); /* init first col position */
-      for(c=0; c<=globals->count[COL_IND]; c++) {
-        
-        convert_3D_world_to_voxel(d1, Point_x(col), Point_y(col), Point_z(col), &tx, &ty, &tz);
-        
-        fill_Point( voxel, tx, ty, tz ); /* build the voxel POINT */
-        
-        if (point_not_masked(m1, Point_x(col), Point_y(col), Point_z(col))) {
-
-          value1 = get_value_of_point_in_volume( Point_x(col), Point_y(col), Point_z(col), d1);
-
-          if ( value1 > t1 ) {
-
-            count1++;
-
-            DO_TRANSFORM(pos2, globals->trans_info.transformation, col);
-            
-            convert_3D_world_to_voxel(d2, Point_x(pos2), Point_y(pos2), Point_z(pos2), &tx, &ty, &tz);
-            
-            fill_Point( voxel, tx, ty, tz ); /* build the voxel POINT */
-        
-            if (point_not_masked(m2, Point_x(pos2), Point_y(pos2), Point_z(pos2))) {
-
-              value2 = get_value_of_point_in_volume( Point_x(pos2), Point_y(pos2), Point_z(pos2), d2);
-
-              if ( (value2 > t2)  && 
-                   ((value2 < -1e-15) || (value2 > 1e-15)) ) {
-                  
-                ratios[count2++] = value1 / value2 ;
-
-                s1 += value1*value2;
-                s2 += value1*value1;
-                s3 += value2*value2;
-                  
-                
-              } /* if voxel in d2 */
-            } /* if point in mask volume two */
-          } /* if voxel in d1 */
-        } /* if point in mask volume one */
-        
-        ADD_POINT_VECTOR( col, col, globals->directions[COL_IND] );
-        
-      } /* for c */
-    } /* for r */
-  } /* for s */
-  
+  FREE(slice_count1);
+  FREE(slice_count2);
 
   if (count2 > 0) {
 
-    if (globals->flags.debug) (void)print ("Starting qsort of ratios...");
-
-
-    qs_list (ratios,0,count2);
-
-    if (globals->flags.debug) (void)print ("Done.\n");
-
-    result = ratios[ (int)(count2/2) ];        /* the median value */
+    result = select_order_statistic(ratios, count2, count2/2); /* the median value */
 
     if (globals->flags.debug) (void)print ("Normalization: %7d %7d -> %10.8f\n",count1,count2,result);
 